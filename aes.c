@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+
+#ifdef HAVE_AESNI
+#include <immintrin.h>
+
+#define AESNI __attribute__((target("aes,sse2")))
+
+int aesni_usable(void)
+{
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+}
+
+/* the s-box of each byte of w, out of aeskeygenassist */
+AESNI static uint32_t sub_word(uint32_t w)
+{
+	return _mm_cvtsi128_si32(
+		_mm_aeskeygenassist_si128(_mm_set_epi32(0, 0, w, 0), 0));
+}
+
+/**
+ * aes_set_key - the FIPS-197 key expansion of a 16, 24 or 32 byte key
+ *
+ * It's done once per process, the words are kept in memory order,
+ * which is what aesenc wants.
+ */
+int aes_set_key(struct aes_key *key, const unsigned char *k, int len)
+{
+	int i, nk = len / 4;
+	uint32_t t, rcon = 1;
+	uint32_t w[15 * 4];
+
+	if (len != 16 && len != 24 && len != 32)
+		return -1;
+
+	key->rounds = nk + 6;
+	memcpy(w, k, len);
+	for (i = nk; i < (key->rounds + 1) * 4; i++) {
+		t = w[i - 1];
+		if (i % nk == 0) {
+			t = sub_word(t >> 8 | t << 24) ^ rcon;
+			rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x11b : 0);
+		} else if (nk > 6 && i % nk == 4) {
+			t = sub_word(t);
+		}
+
+		w[i] = w[i - nk] ^ t;
+	}
+
+	memcpy(key->rk, w, (key->rounds + 1) * AES_BLOCK_LEN);
+	return 0;
+}
+
+void aes_cfb_init(struct aes_cfb_ctx *ctx, const struct aes_key *key,
+		  const unsigned char *iv)
+{
+	ctx->key = key;
+	memcpy(ctx->iv, iv, AES_BLOCK_LEN);
+	ctx->num = 0;
+}
+
+AESNI static inline __m128i aes_encrypt_block(const struct aes_key *key,
+					      __m128i b)
+{
+	int i;
+	const __m128i *rk = (const void *)key->rk;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (i = 1; i < key->rounds; i++)
+		b = _mm_aesenc_si128(b, rk[i]);
+
+	return _mm_aesenclast_si128(b, rk[key->rounds]);
+}
+
+/* the next keystream block, for a partial block at the end */
+AESNI static void next_keystream(struct aes_cfb_ctx *ctx)
+{
+	__m128i iv = _mm_loadu_si128((void *)ctx->iv);
+
+	_mm_storeu_si128((void *)ctx->iv, aes_encrypt_block(ctx->key, iv));
+}
+
+/* every cipher block depends on the last one, nothing to pipeline */
+AESNI void aes_cfb_encrypt(struct aes_cfb_ctx *ctx, unsigned char *out,
+			   const unsigned char *in, size_t len)
+{
+	__m128i iv;
+
+	for (; len > 0 && ctx->num > 0; len--) {
+		*out++ = ctx->iv[ctx->num] ^= *in++;
+		ctx->num = (ctx->num + 1) % AES_BLOCK_LEN;
+	}
+
+	iv = _mm_loadu_si128((void *)ctx->iv);
+	for (; len >= AES_BLOCK_LEN; len -= AES_BLOCK_LEN) {
+		iv = _mm_xor_si128(aes_encrypt_block(ctx->key, iv),
+				   _mm_loadu_si128((const void *)in));
+		_mm_storeu_si128((void *)out, iv);
+		in += AES_BLOCK_LEN;
+		out += AES_BLOCK_LEN;
+	}
+
+	_mm_storeu_si128((void *)ctx->iv, iv);
+	if (len == 0)
+		return;
+
+	next_keystream(ctx);
+	for (; len > 0; len--) {
+		*out++ = ctx->iv[ctx->num] ^= *in++;
+		ctx->num++;
+	}
+}
+
+/**
+ * aes_cfb_decrypt - decrypt len bytes, in and out may be the same
+ *
+ * Plain block i is cipher block i xor E(cipher block i - 1), all the
+ * inputs of aes are there already, so AES_CFB_PIPELINE blocks go
+ * through the rounds together and hide the latency of aesenc.
+ */
+AESNI void aes_cfb_decrypt(struct aes_cfb_ctx *ctx, unsigned char *out,
+			   const unsigned char *in, size_t len)
+{
+	int i, j;
+	unsigned char c;
+	const __m128i *rk = (const void *)ctx->key->rk;
+	__m128i iv, b[AES_CFB_PIPELINE], x[AES_CFB_PIPELINE];
+
+	for (; len > 0 && ctx->num > 0; len--) {
+		c = *in++;
+		*out++ = ctx->iv[ctx->num] ^ c;
+		ctx->iv[ctx->num] = c;
+		ctx->num = (ctx->num + 1) % AES_BLOCK_LEN;
+	}
+
+	iv = _mm_loadu_si128((void *)ctx->iv);
+	for (; len >= AES_CFB_PIPELINE * AES_BLOCK_LEN;
+	     len -= AES_CFB_PIPELINE * AES_BLOCK_LEN) {
+		/* all loaded before anything is stored, in place works */
+		for (j = 0; j < AES_CFB_PIPELINE; j++)
+			b[j] = _mm_loadu_si128((const void *)
+					       (in + j * AES_BLOCK_LEN));
+
+		x[0] = _mm_xor_si128(iv, rk[0]);
+		for (j = 1; j < AES_CFB_PIPELINE; j++)
+			x[j] = _mm_xor_si128(b[j - 1], rk[0]);
+
+		for (i = 1; i < ctx->key->rounds; i++)
+			for (j = 0; j < AES_CFB_PIPELINE; j++)
+				x[j] = _mm_aesenc_si128(x[j], rk[i]);
+
+		for (j = 0; j < AES_CFB_PIPELINE; j++) {
+			x[j] = _mm_aesenclast_si128(x[j], rk[i]);
+			_mm_storeu_si128((void *)(out + j * AES_BLOCK_LEN),
+					 _mm_xor_si128(x[j], b[j]));
+		}
+
+		iv = b[AES_CFB_PIPELINE - 1];
+		in += AES_CFB_PIPELINE * AES_BLOCK_LEN;
+		out += AES_CFB_PIPELINE * AES_BLOCK_LEN;
+	}
+
+	for (; len >= AES_BLOCK_LEN; len -= AES_BLOCK_LEN) {
+		b[0] = _mm_loadu_si128((const void *)in);
+		_mm_storeu_si128((void *)out, _mm_xor_si128(
+			aes_encrypt_block(ctx->key, iv), b[0]));
+		iv = b[0];
+		in += AES_BLOCK_LEN;
+		out += AES_BLOCK_LEN;
+	}
+
+	_mm_storeu_si128((void *)ctx->iv, iv);
+	if (len == 0)
+		return;
+
+	next_keystream(ctx);
+	for (; len > 0; len--) {
+		c = *in++;
+		*out++ = ctx->iv[ctx->num] ^ c;
+		ctx->iv[ctx->num] = c;
+		ctx->num++;
+	}
+}
+#endif
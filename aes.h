@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_AES_H
+#define SS_AES_H
+
+#include <stddef.h>
+
+/* aes-ni is only built where the compiler has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AESNI
+#endif
+
+#define AES_BLOCK_LEN 16
+/* cipher blocks decrypted side by side */
+#define AES_CFB_PIPELINE 8
+
+struct aes_key {
+	unsigned char rk[15][AES_BLOCK_LEN] __attribute__((aligned(16)));
+	int rounds;
+};
+
+/* cfb128, the same state as openssl keeps */
+struct aes_cfb_ctx {
+	/* shared by every stream under the same key */
+	const struct aes_key *key;
+	/* the last cipher block, in a partial block iv[0, num) is cipher
+	 * text and iv[num, 16) the keystream not used yet */
+	unsigned char iv[AES_BLOCK_LEN];
+	int num;
+};
+
+#ifdef HAVE_AESNI
+int aesni_usable(void);
+int aes_set_key(struct aes_key *key, const unsigned char *k, int len);
+void aes_cfb_init(struct aes_cfb_ctx *ctx, const struct aes_key *key,
+		  const unsigned char *iv);
+void aes_cfb_encrypt(struct aes_cfb_ctx *ctx, unsigned char *out,
+		     const unsigned char *in, size_t len);
+void aes_cfb_decrypt(struct aes_cfb_ctx *ctx, unsigned char *out,
+		     const unsigned char *in, size_t len);
+#else
+/* nothing else gets called when it's false */
+static inline int aesni_usable(void)
+{
+	return 0;
+}
+
+static inline int aes_set_key(struct aes_key *key, const unsigned char *k,
+			      int len)
+{
+	return -1;
+}
+
+static inline void aes_cfb_init(struct aes_cfb_ctx *ctx,
+				const struct aes_key *key,
+				const unsigned char *iv)
+{
+}
+
+static inline void aes_cfb_encrypt(struct aes_cfb_ctx *ctx,
+				   unsigned char *out,
+				   const unsigned char *in, size_t len)
+{
+}
+
+static inline void aes_cfb_decrypt(struct aes_cfb_ctx *ctx,
+				   unsigned char *out,
+				   const unsigned char *in, size_t len)
+{
+}
+#endif
+
+#endif
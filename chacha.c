@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#include <string.h>
+
+#include "chacha.h"
+
+#ifdef HAVE_CHACHA20_X86
+#include <immintrin.h>
+#endif
+
+/* xor nblocks whole blocks of keystream into in, the counter in
+ * state[12] goes up by nblocks */
+typedef void (*chacha20_blocks_t)(uint32_t *state, unsigned char *out,
+				  const unsigned char *in, size_t nblocks);
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/* works on uint32_t and on the generic vectors alike */
+#define QUARTERROUND(a, b, c, d) do {				\
+		a += b; d ^= a; d = ROTL32(d, 16);		\
+		c += d; b ^= c; b = ROTL32(b, 12);		\
+		a += b; d ^= a; d = ROTL32(d, 8);		\
+		c += d; b ^= c; b = ROTL32(b, 7);		\
+	} while (0)
+
+#define DOUBLEROUND(x) do {					\
+		QUARTERROUND(x[0], x[4], x[8], x[12]);		\
+		QUARTERROUND(x[1], x[5], x[9], x[13]);		\
+		QUARTERROUND(x[2], x[6], x[10], x[14]);		\
+		QUARTERROUND(x[3], x[7], x[11], x[15]);		\
+		QUARTERROUND(x[0], x[5], x[10], x[15]);		\
+		QUARTERROUND(x[1], x[6], x[11], x[12]);		\
+		QUARTERROUND(x[2], x[7], x[8], x[13]);		\
+		QUARTERROUND(x[3], x[4], x[9], x[14]);		\
+	} while (0)
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void chacha20_block(const uint32_t *state, unsigned char *ks)
+{
+	int i;
+	uint32_t x[16];
+
+	memcpy(x, state, sizeof(x));
+	for (i = 0; i < 10; i++)
+		DOUBLEROUND(x);
+
+	for (i = 0; i < 16; i++)
+		put_le32(ks + i * 4, x[i] + state[i]);
+}
+
+static void blocks_scalar(uint32_t *state, unsigned char *out,
+			  const unsigned char *in, size_t nblocks)
+{
+	int i;
+	unsigned char ks[CHACHA20_BLOCK_LEN];
+
+	for (; nblocks > 0; nblocks--) {
+		chacha20_block(state, ks);
+		state[12]++;
+
+		for (i = 0; i < CHACHA20_BLOCK_LEN; i++)
+			out[i] = in[i] ^ ks[i];
+
+		in += CHACHA20_BLOCK_LEN;
+		out += CHACHA20_BLOCK_LEN;
+	}
+}
+
+#ifdef HAVE_CHACHA20_VECTOR
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+/*
+ * The vector kernels run several blocks side by side: vector x[i]
+ * holds word i of each block, so a quarter round works on all of them
+ * at once, and the words are put back in block order on the way out.
+ */
+static void blocks_vector(uint32_t *state, unsigned char *out,
+			  const unsigned char *in, size_t nblocks)
+{
+	int i, b;
+	u32x4 x[16], s[16];
+	const u32x4 inc = {0, 1, 2, 3};
+
+	for (; nblocks >= 4; nblocks -= 4) {
+		for (i = 0; i < 16; i++)
+			s[i] = (u32x4){state[i], state[i], state[i], state[i]};
+
+		s[12] += inc;
+		memcpy(x, s, sizeof(x));
+		for (i = 0; i < 10; i++)
+			DOUBLEROUND(x);
+
+		for (i = 0; i < 16; i++)
+			x[i] += s[i];
+
+		for (b = 0; b < 4; b++)
+			for (i = 0; i < 16; i++)
+				put_le32(out + b * 64 + i * 4,
+					 get_le32(in + b * 64 + i * 4) ^
+					 x[i][b]);
+
+		state[12] += 4;
+		in += 4 * CHACHA20_BLOCK_LEN;
+		out += 4 * CHACHA20_BLOCK_LEN;
+	}
+
+	blocks_scalar(state, out, in, nblocks);
+}
+#endif
+
+#ifdef HAVE_CHACHA20_X86
+#define ROTL128(v, n) \
+	_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTERROUND128(a, b, c, d) do {				\
+		a = _mm_add_epi32(a, b);				\
+		d = ROTL128(_mm_xor_si128(d, a), 16);			\
+		c = _mm_add_epi32(c, d);				\
+		b = ROTL128(_mm_xor_si128(b, c), 12);			\
+		a = _mm_add_epi32(a, b);				\
+		d = ROTL128(_mm_xor_si128(d, a), 8);			\
+		c = _mm_add_epi32(c, d);				\
+		b = ROTL128(_mm_xor_si128(b, c), 7);			\
+	} while (0)
+
+#define DOUBLEROUND128(x) do {					\
+		QUARTERROUND128(x[0], x[4], x[8], x[12]);	\
+		QUARTERROUND128(x[1], x[5], x[9], x[13]);	\
+		QUARTERROUND128(x[2], x[6], x[10], x[14]);	\
+		QUARTERROUND128(x[3], x[7], x[11], x[15]);	\
+		QUARTERROUND128(x[0], x[5], x[10], x[15]);	\
+		QUARTERROUND128(x[1], x[6], x[11], x[12]);	\
+		QUARTERROUND128(x[2], x[7], x[8], x[13]);	\
+		QUARTERROUND128(x[3], x[4], x[9], x[14]);	\
+	} while (0)
+
+/* four blocks at a time in sse2 registers */
+__attribute__((target("sse2")))
+static void blocks_sse2(uint32_t *state, unsigned char *out,
+			const unsigned char *in, size_t nblocks)
+{
+	int i, b;
+	__m128i x[16], s[16], t[4], w[4];
+
+	for (; nblocks >= 4; nblocks -= 4) {
+		for (i = 0; i < 16; i++)
+			s[i] = _mm_set1_epi32(state[i]);
+
+		s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+		memcpy(x, s, sizeof(x));
+		for (i = 0; i < 10; i++)
+			DOUBLEROUND128(x);
+
+		/* words 4i to 4i + 3 of the four blocks, transposed so
+		 * w[b] is them in block b */
+		for (i = 0; i < 4; i++) {
+			w[0] = _mm_add_epi32(x[i * 4], s[i * 4]);
+			w[1] = _mm_add_epi32(x[i * 4 + 1], s[i * 4 + 1]);
+			w[2] = _mm_add_epi32(x[i * 4 + 2], s[i * 4 + 2]);
+			w[3] = _mm_add_epi32(x[i * 4 + 3], s[i * 4 + 3]);
+
+			t[0] = _mm_unpacklo_epi32(w[0], w[1]);
+			t[1] = _mm_unpacklo_epi32(w[2], w[3]);
+			t[2] = _mm_unpackhi_epi32(w[0], w[1]);
+			t[3] = _mm_unpackhi_epi32(w[2], w[3]);
+			w[0] = _mm_unpacklo_epi64(t[0], t[1]);
+			w[1] = _mm_unpackhi_epi64(t[0], t[1]);
+			w[2] = _mm_unpacklo_epi64(t[2], t[3]);
+			w[3] = _mm_unpackhi_epi64(t[2], t[3]);
+
+			for (b = 0; b < 4; b++) {
+				__m128i *p = (void *)(out + b * 64 + i * 16);
+				const __m128i *q =
+					(const void *)(in + b * 64 + i * 16);
+
+				_mm_storeu_si128(p, _mm_xor_si128(
+					_mm_loadu_si128(q), w[b]));
+			}
+		}
+
+		state[12] += 4;
+		in += 4 * CHACHA20_BLOCK_LEN;
+		out += 4 * CHACHA20_BLOCK_LEN;
+	}
+
+	blocks_scalar(state, out, in, nblocks);
+}
+
+/* byte shuffles do the rotations by 16 and 8 in one instruction */
+#define ROTL256(v, n) \
+	_mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define QUARTERROUND256(a, b, c, d) do {				\
+		a = _mm256_add_epi32(a, b);				\
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);	\
+		c = _mm256_add_epi32(c, d);				\
+		b = ROTL256(_mm256_xor_si256(b, c), 12);		\
+		a = _mm256_add_epi32(a, b);				\
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);	\
+		c = _mm256_add_epi32(c, d);				\
+		b = ROTL256(_mm256_xor_si256(b, c), 7);			\
+	} while (0)
+
+#define DOUBLEROUND256(x) do {					\
+		QUARTERROUND256(x[0], x[4], x[8], x[12]);	\
+		QUARTERROUND256(x[1], x[5], x[9], x[13]);	\
+		QUARTERROUND256(x[2], x[6], x[10], x[14]);	\
+		QUARTERROUND256(x[3], x[7], x[11], x[15]);	\
+		QUARTERROUND256(x[0], x[5], x[10], x[15]);	\
+		QUARTERROUND256(x[1], x[6], x[11], x[12]);	\
+		QUARTERROUND256(x[2], x[7], x[8], x[13]);	\
+		QUARTERROUND256(x[3], x[4], x[9], x[14]);	\
+	} while (0)
+
+/* eight blocks at a time, then whatever sse2 can do with the rest */
+__attribute__((target("avx2")))
+static void blocks_avx2(uint32_t *state, unsigned char *out,
+			const unsigned char *in, size_t nblocks)
+{
+	int i, j, b;
+	__m256i x[16], s[16], t[4], w[2][4];
+	const __m256i rot16 = _mm256_set_epi8(
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+
+	for (; nblocks >= 8; nblocks -= 8) {
+		for (i = 0; i < 16; i++)
+			s[i] = _mm256_set1_epi32(state[i]);
+
+		s[12] = _mm256_add_epi32(s[12],
+					 _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+		memcpy(x, s, sizeof(x));
+		for (i = 0; i < 10; i++)
+			DOUBLEROUND256(x);
+
+		/* unpack works within 128 bit lanes, so after the 4x4
+		 * transpose w[][b] has block b in the low lane and block
+		 * b + 4 in the high one, two groups of words make the
+		 * 32 bytes stored at once */
+		for (i = 0; i < 4; i += 2) {
+			for (j = 0; j < 2; j++) {
+				__m256i *v = w[j];
+				int k = (i + j) * 4;
+
+				v[0] = _mm256_add_epi32(x[k], s[k]);
+				v[1] = _mm256_add_epi32(x[k + 1], s[k + 1]);
+				v[2] = _mm256_add_epi32(x[k + 2], s[k + 2]);
+				v[3] = _mm256_add_epi32(x[k + 3], s[k + 3]);
+
+				t[0] = _mm256_unpacklo_epi32(v[0], v[1]);
+				t[1] = _mm256_unpacklo_epi32(v[2], v[3]);
+				t[2] = _mm256_unpackhi_epi32(v[0], v[1]);
+				t[3] = _mm256_unpackhi_epi32(v[2], v[3]);
+				v[0] = _mm256_unpacklo_epi64(t[0], t[1]);
+				v[1] = _mm256_unpackhi_epi64(t[0], t[1]);
+				v[2] = _mm256_unpacklo_epi64(t[2], t[3]);
+				v[3] = _mm256_unpackhi_epi64(t[2], t[3]);
+			}
+
+			for (b = 0; b < 4; b++) {
+				__m256i lo = _mm256_permute2x128_si256(
+					w[0][b], w[1][b], 0x20);
+				__m256i hi = _mm256_permute2x128_si256(
+					w[0][b], w[1][b], 0x31);
+				__m256i *p = (void *)(out + b * 64 + i * 16);
+				__m256i *q = (void *)(out + (b + 4) * 64 +
+						      i * 16);
+				const __m256i *r =
+					(const void *)(in + b * 64 + i * 16);
+				const __m256i *u =
+					(const void *)(in + (b + 4) * 64 +
+						       i * 16);
+
+				_mm256_storeu_si256(p, _mm256_xor_si256(
+					_mm256_loadu_si256(r), lo));
+				_mm256_storeu_si256(q, _mm256_xor_si256(
+					_mm256_loadu_si256(u), hi));
+			}
+		}
+
+		state[12] += 8;
+		in += 8 * CHACHA20_BLOCK_LEN;
+		out += 8 * CHACHA20_BLOCK_LEN;
+	}
+
+	blocks_sse2(state, out, in, nblocks);
+}
+#endif
+
+struct chacha20_kernel {
+	const char *name;
+	chacha20_blocks_t blocks;
+	/* whether this cpu can run it */
+	int (*usable)(void);
+};
+
+static int always(void)
+{
+	return 1;
+}
+
+#ifdef HAVE_CHACHA20_X86
+static int cpu_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* the fastest first */
+static const struct chacha20_kernel kernels[] = {
+#ifdef HAVE_CHACHA20_X86
+	{"avx2", blocks_avx2, cpu_avx2},
+	{"sse2", blocks_sse2, cpu_sse2},
+#endif
+#ifdef HAVE_CHACHA20_VECTOR
+	{"vector", blocks_vector, always},
+#endif
+	{"scalar", blocks_scalar, always},
+};
+
+#define NR_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct chacha20_kernel *kernel;
+
+static const struct chacha20_kernel *find_kernel(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_KERNELS; i++) {
+		if (name && strcmp(kernels[i].name, name) != 0)
+			continue;
+
+		if (kernels[i].usable())
+			return &kernels[i];
+	}
+
+	return NULL;
+}
+
+/* name of the kernel in use, the first call picks the best one */
+const char *chacha20_kernel(void)
+{
+	if (kernel == NULL)
+		kernel = find_kernel(NULL);
+
+	return kernel->name;
+}
+
+/* the i-th kernel built in, NULL after the last one */
+const char *chacha20_kernel_name(int i)
+{
+	if (i < 0 || i >= NR_KERNELS)
+		return NULL;
+
+	return kernels[i].name;
+}
+
+/* whether this cpu can run kernel name */
+int chacha20_kernel_usable(const char *name)
+{
+	return find_kernel(name) != NULL;
+}
+
+/* switch to kernel name, -1 if this cpu can't run it */
+int chacha20_use_kernel(const char *name)
+{
+	const struct chacha20_kernel *k = find_kernel(name);
+
+	if (k == NULL)
+		return -1;
+
+	kernel = k;
+	return 0;
+}
+
+static const unsigned char zero_nonce[CHACHA20_NONCE_LEN];
+
+/* "expand 32-byte k" and the key, the nonce is set per stream */
+void chacha20_init(struct chacha20_ctx *ctx, const unsigned char *key)
+{
+	int i;
+
+	ctx->state[0] = 0x61707865;
+	ctx->state[1] = 0x3320646e;
+	ctx->state[2] = 0x79622d32;
+	ctx->state[3] = 0x6b206574;
+
+	for (i = 0; i < 8; i++)
+		ctx->state[4 + i] = get_le32(key + i * 4);
+
+	chacha20_set_nonce(ctx, zero_nonce, 0);
+	/* pick the kernel before the first block */
+	chacha20_kernel();
+}
+
+void chacha20_set_nonce(struct chacha20_ctx *ctx, const unsigned char *nonce,
+			uint32_t counter)
+{
+	ctx->state[12] = counter;
+	ctx->state[13] = get_le32(nonce);
+	ctx->state[14] = get_le32(nonce + 4);
+	ctx->state[15] = get_le32(nonce + 8);
+	ctx->ks_pos = CHACHA20_BLOCK_LEN;
+}
+
+/**
+ * chacha20_xor - en/decrypt len bytes of the stream, in and out may
+ * be the same
+ *
+ * Whole blocks go to the kernel, the keystream left from a partial
+ * block is kept for the next call.
+ */
+void chacha20_xor(struct chacha20_ctx *ctx, unsigned char *out,
+		  const unsigned char *in, size_t len)
+{
+	size_t n;
+
+	while (len > 0 && ctx->ks_pos < CHACHA20_BLOCK_LEN) {
+		*out++ = *in++ ^ ctx->ks[ctx->ks_pos++];
+		len--;
+	}
+
+	n = len / CHACHA20_BLOCK_LEN;
+	if (n > 0) {
+		kernel->blocks(ctx->state, out, in, n);
+		in += n * CHACHA20_BLOCK_LEN;
+		out += n * CHACHA20_BLOCK_LEN;
+		len -= n * CHACHA20_BLOCK_LEN;
+	}
+
+	if (len > 0) {
+		chacha20_block(ctx->state, ctx->ks);
+		ctx->state[12]++;
+		ctx->ks_pos = 0;
+
+		while (len > 0) {
+			*out++ = *in++ ^ ctx->ks[ctx->ks_pos++];
+			len--;
+		}
+	}
+}
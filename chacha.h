@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_CHACHA_H
+#define SS_CHACHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the vector kernels are only built where the compiler has them */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CHACHA20_X86
+#endif
+
+#if defined(__GNUC__)
+#define HAVE_CHACHA20_VECTOR
+#endif
+
+#define CHACHA20_KEY_LEN 32
+#define CHACHA20_NONCE_LEN 12
+#define CHACHA20_BLOCK_LEN 64
+
+/* RFC 7539 chacha20, a 32 bit block counter and a 96 bit nonce */
+struct chacha20_ctx {
+	uint32_t state[16];
+	/* keystream of the last partial block, ks[ks_pos, 64) is unused */
+	unsigned char ks[CHACHA20_BLOCK_LEN];
+	int ks_pos;
+};
+
+void chacha20_init(struct chacha20_ctx *ctx, const unsigned char *key);
+void chacha20_set_nonce(struct chacha20_ctx *ctx, const unsigned char *nonce,
+			uint32_t counter);
+void chacha20_xor(struct chacha20_ctx *ctx, unsigned char *out,
+		  const unsigned char *in, size_t len);
+const char *chacha20_kernel(void);
+const char *chacha20_kernel_name(int i);
+int chacha20_kernel_usable(const char *name);
+int chacha20_use_kernel(const char *name);
+
+#endif
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "crypto.h"
 #include "log.h"
+#include "preconnect.h"
 
 char rsv_frag[3] = {0x00, 0x00, 0x00};
 
@@ -36,7 +37,10 @@ int parse_socks5_proto(int sockfd, struct link *ln)
 				goto out;
 		}
 
-		ret = do_send(sockfd, ln, "text", 0);
+		/* auth request consumed, cmd request comes next */
+		buf_reset(&ln->up);
+
+		ret = do_send(sockfd, ln, &ln->down);
 		if (ret == -2) {
 			goto out;
 		} else if (ret == -1) {
@@ -60,7 +64,7 @@ int parse_socks5_proto(int sockfd, struct link *ln)
 		}
 
 		/* cmd reply to local */
-		ret = do_send(sockfd, ln, "text", 0);
+		ret = do_send(sockfd, ln, &ln->down);
 		if (ret == -2 || cmd == SOCKS5_CMD_REP_FAILED) {
 			goto out;
 		} else if (ret == -1) {
@@ -82,10 +86,17 @@ int client_do_local_read(int sockfd, struct link *ln)
 {
 	int ret;
 
-	if (ln->state & LOCAL_SEND_PENDING)
+	/* the server side still hasn't drained what we read last
+	 * time (or the socks5 reply is pending), stop reading local
+	 * until it is done, the pollout handler re-enables it */
+	if (ln->state & SERVER_SEND_PENDING ||
+	    (!(ln->state & SOCKS5_CMD_REPLY_SENT) &&
+	     ln->state & LOCAL_SEND_PENDING)) {
+		poll_rm(sockfd, POLLIN);
 		return 0;
+	}
 
-	ret = do_read(sockfd, ln, "text", 0);
+	ret = do_read(sockfd, ln, &ln->up);
 	if (ret == -2) {
 		goto out;
 	} else if (ret == -1) {
@@ -96,29 +107,28 @@ int client_do_local_read(int sockfd, struct link *ln)
 		if (parse_socks5_proto(sockfd, ln) == -1)
 			goto out;
 
-		if (ln->state & LOCAL_SEND_PENDING ||
-		    ln->text_len == 0)
+		/* the ss tcp header is kept at the head of ln->up,
+		 * wait for some payload to send together with it */
+		if (!(ln->state & SOCKS5_CMD_REPLY_SENT) ||
+		    ln->up.len <= ln->ss_header_len)
 			return 0;
 	}
 
 	if (ln->state & SS_UDP) {
 		/* remove rsv(2) + frag(1) */
-		if (rm_data(sockfd, ln, "text", 3) == -1)
-			goto out;
-	} else if (!(ln->state & SS_TCP_HEADER_SENT)) {
-		if (add_data(sockfd, ln, "text",
-			     ln->cipher, ln->ss_header_len) == -1)
+		if (rm_data(sockfd, &ln->up, 3) == -1)
 			goto out;
 	}
 
 	if (crypto_encrypt(sockfd, ln) == -1)
 		goto out;
 
-	ret = do_send(ln->server_sockfd, ln, "cipher", 0);
+	ret = do_send(ln->server_sockfd, ln, &ln->up);
 	if (ret == -2) {
 		goto out;
 	} else if (ret == -1) {
 		ln->state |= SERVER_SEND_PENDING;
+		poll_rm(sockfd, POLLIN);
 	} else {
 		if (!(ln->state & SS_TCP_HEADER_SENT))
 			ln->state |= SS_TCP_HEADER_SENT;
@@ -134,58 +144,43 @@ int client_do_server_read(int sockfd, struct link *ln)
 {
 	int ret;
 
-	if (ln->state & SERVER_SEND_PENDING) {
+	/* local hasn't drained the last chunk, apply backpressure */
+	if (ln->state & LOCAL_SEND_PENDING) {
+		poll_rm(sockfd, POLLIN);
 		return 0;
 	}
 
-	/* if iv isn't received, wait to receive bigger than iv_len
-	 * bytes before go to next step */
-	if (ln->state & SERVER_READ_PENDING) {
-		sock_debug(sockfd, "%s: server read pending", __func__);
-		pr_link_debug(ln);
-
-		ret = do_read(sockfd, ln, "cipher", ln->cipher_len);
-		if (ret == -2) {
-			goto out;
-		} else if (ret == -1) {
-			return 0;
-		}
-
-		if (ln->cipher_len <= iv_len) {
-			return 0;
-		} else {
-			ln->state &= ~SERVER_READ_PENDING;
-		}
-	} else {
-		ret = do_read(sockfd, ln, "cipher", 0);
-		if (ret == -2) {
-			goto out;
-		} else if (ret == -1) {
-			return 0;
-		}
-
-		if (!(ln->state & SS_IV_RECEIVED)) {
-			if (ln->cipher_len <= iv_len) {
-				ln->state |= SERVER_READ_PENDING;
-				return 0;
-			}
-		}
+	/* if iv isn't received, keep what we have and wait to
+	 * receive bigger than iv_len bytes before go to next step */
+	ret = do_read(sockfd, ln, &ln->down);
+	if (ret == -2) {
+		goto out;
+	} else if (ret == -1) {
+		return 0;
 	}
 
+	if (!(ln->state & SS_IV_RECEIVED) && ln->down.len <= iv_len)
+		return 0;
+
 	if (crypto_decrypt(sockfd, ln) == -1)
 		goto out;
 
+	/* an aead chunk isn't complete yet */
+	if (ln->down.len == 0)
+		return 0;
+
 	if (ln->state & SS_UDP) {
-		if (add_data(sockfd, ln, "text",
+		if (add_data(sockfd, &ln->down,
 			     rsv_frag, sizeof(rsv_frag)) == -1)
 			goto out;
 	}
 
-	ret = do_send(ln->local_sockfd, ln, "text", 0);
+	ret = do_send(ln->local_sockfd, ln, &ln->down);
 	if (ret == -2) {
 		goto out;
 	} else if (ret == -1) {
 		ln->state |= LOCAL_SEND_PENDING;
+		poll_rm(sockfd, POLLIN);
 	}
 
 	return 0;
@@ -196,24 +191,13 @@ out:
 int client_do_pollin(int sockfd, struct link *ln)
 {
 	if (sockfd == ln->local_sockfd) {
-		if (ln->state & SERVER_PENDING) {
-			sock_debug(sockfd, "%s: server pending",
-				   __func__);
-			goto out;
-		} else if (client_do_local_read(sockfd, ln) == -1) {
+		if (client_do_local_read(sockfd, ln) == -1)
 			goto clean;
-		}
 	} else if (sockfd == ln->server_sockfd) {
-		if (ln->state & LOCAL_PENDING) {
-			sock_debug(sockfd, "%s: local pending",
-				   __func__);
-			goto out;
-		} else if (client_do_server_read(sockfd, ln) == -1) {
+		if (client_do_server_read(sockfd, ln) == -1)
 			goto clean;
-		}
 	}
 
-out:
 	return 0;
 clean:
 	sock_info(sockfd, "%s close", __func__);
@@ -223,69 +207,68 @@ clean:
 
 int client_do_pollout(int sockfd, struct link *ln)
 {
-	int ret, optval;
-	int optlen = sizeof(optval);
+	int ret;
 
 	/* write to local */
 	if (sockfd == ln->local_sockfd) {
 		if (ln->state & LOCAL_SEND_PENDING) {
-			ret = do_send(sockfd, ln, "text", 0);
+			ret = do_send(sockfd, ln, &ln->down);
 			if (ret == -2) {
 				goto clean;
 			} else if (ret == -1) {
 				goto out;
-			} else {
-				ln->state &= ~LOCAL_SEND_PENDING;
 			}
 
-			/* update socks5 state */
-			if (!(ln->state & SOCKS5_AUTH_REPLY_SENT))
-				ln->state &= SOCKS5_AUTH_REPLY_SENT;
-			else if (!(ln->state & SOCKS5_CMD_REPLY_SENT))
-				ln->state &= SOCKS5_CMD_REPLY_SENT;
+			ln->state &= ~LOCAL_SEND_PENDING;
+			poll_rm(sockfd, POLLOUT);
+
+			/* update socks5 state, or resume reading the
+			 * server now local has room again */
+			if (!(ln->state & SOCKS5_AUTH_REPLY_SENT)) {
+				ln->state |= SOCKS5_AUTH_REPLY_SENT;
+				poll_add(sockfd, POLLIN);
+			} else if (!(ln->state & SOCKS5_CMD_REPLY_SENT)) {
+				ln->state |= SOCKS5_CMD_REPLY_SENT;
+				poll_add(sockfd, POLLIN);
+			} else if (ln->server_sockfd >= 0) {
+				poll_add(ln->server_sockfd, POLLIN);
+			}
 
 			goto out;
 		} else {
 			poll_rm(sockfd, POLLOUT);
 		}
-	} else if (sockfd == ln->server_sockfd) {
-		/* pending connect finished */
+	} else {
+		/* pending connect finished, on any of the attempts */
 		if (!(ln->state & SERVER)) {
-			if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
-				       &optval, (void *)&optlen) == -1) {
-				sock_warn(sockfd, "%s: getsockopt() %s",
-					  __func__, strerror(errno));
-				goto clean;
-			}
-
-			if (optval == 0) {
-				sock_info(sockfd,
-					  "%s: pending connect() finished",
-					  __func__);
-				ln->time = time(NULL);
-				ln->state |= SERVER;
-			} else {
-				sock_warn(sockfd,
-					  "%s: pending connect() failed",
+			ret = connect_done(sockfd, ln);
+			if (ret == -2) {
+				sock_warn(sockfd, "%s: connect() failed",
 					  __func__);
 				goto clean;
+			} else if (ret == -1) {
+				goto out;
 			}
 		}
 
 		if (ln->state & SERVER_SEND_PENDING) {
 			/* write to server */
-			ret = do_send(sockfd, ln, "cipher", 0);
+			ret = do_send(sockfd, ln, &ln->up);
 			if (ret == -2) {
 				goto clean;
 			} else if (ret == -1) {
 				goto out;
-			} else {
-				ln->state &= ~SERVER_SEND_PENDING;
-
-				if (!(ln->state & SS_TCP_HEADER_SENT))
-					ln->state |= SS_TCP_HEADER_SENT;
-				goto out;
 			}
+
+			ln->state &= ~SERVER_SEND_PENDING;
+			poll_rm(sockfd, POLLOUT);
+
+			if (!(ln->state & SS_TCP_HEADER_SENT))
+				ln->state |= SS_TCP_HEADER_SENT;
+
+			/* server has room again, resume reading local */
+			poll_add(ln->local_sockfd, POLLIN);
+			goto out;
 		} else {
 			poll_rm(sockfd, POLLOUT);
 		}
@@ -299,11 +282,34 @@ clean:
 	return -1;
 }
 
+static void client_do_accept(int listenfd, struct addrinfo *server_ai)
+{
+	int i, sockfd;
+	struct link *ln;
+
+	/* drain the backlog, but leave some time for the links */
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		sockfd = do_accept(listenfd);
+		if (sockfd == -1)
+			break;
+
+		ln = create_link(sockfd, "client");
+		if (ln == NULL) {
+			poll_del(sockfd);
+			close(sockfd);
+			continue;
+		}
+
+		link_set_server(ln, server_ai);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	short revents;
-	int i, listenfd, sockfd;
+	int i, nevents, listenfd, sockfd;
 	int ret = 0;
+	struct poll_event events[MAX_POLL_EVENTS];
 	struct link *ln;
 	struct addrinfo *server_ai = NULL;
 	struct addrinfo *local_ai = NULL;
@@ -338,55 +344,75 @@ int main(int argc, char **argv)
 	}
 
 	ss_init();
+	time_update();
+	if (preconnect_init(server_ai, ss_opt.preconnect) == -1) {
+		ret = -1;
+		goto out;
+	}
+
 	listenfd = do_listen(local_ai, "tcp");
-	clients[0].fd = listenfd;
-	clients[0].events = POLLIN;
+	if (poll_set(listenfd, POLLIN) == -1) {
+		ret = -1;
+		goto out;
+	}
 
 	while (1) {
 		pr_debug("start polling\n");
-		ret = poll(clients, nfds, TCP_INACTIVE_TIMEOUT * 1000);
-		if (ret == -1)
+		nevents = poll_wait(events, MAX_POLL_EVENTS,
+				    preconnect_timeout(timer_timeout()));
+		time_update();
+		if (nevents == -1)
 			err_exit("poll error");
-		else if (ret == 0) {
+		else if (nevents == 0) {
+			/* idle, a good time to make ivs */
+			crypto_iv_refill();
 			reaper();
+			preconnect_refill();
 			continue;
 		}
 
-		if (clients[0].revents & POLLIN) {
-			sockfd = accept(clients[0].fd, NULL, NULL);
-			if (sockfd == -1) {
-				pr_warn("accept error\n");
-			} else if (poll_set(sockfd, POLLIN) == -1) {
-				close(sockfd);
-			} else {
-				ln = create_link(sockfd, "client");
-				if (ln == NULL) {
-					poll_del(sockfd);
-					close(sockfd);
-				} else {
-					ln->server = server_ai;
-				}
-			}
-		}
+handle:
+		for (i = 0; i < nevents; i++) {
+			sockfd = events[i].fd;
+			revents = events[i].revents;
+
+			if (sockfd == listenfd) {
+				if (revents & POLLIN)
+					client_do_accept(listenfd, server_ai);
 
-		for (i = 1; i < nfds; i++) {
-			sockfd = clients[i].fd;
-			if (sockfd == -1)
 				continue;
+			}
 
-			revents = clients[i].revents;
-			if (revents == 0)
+			/* an idle connection of the pool, or one on its
+			 * way, see preconnect.c */
+			if (link_head[sockfd] == NULL &&
+			    preconnect_event(sockfd, revents) == 0)
 				continue;
 
+			/* the link may have been destroyed through its
+			 * other sockfd earlier in this round */
 			ln = get_link(sockfd);
-			if (ln == NULL) {
-				sock_warn(sockfd, "close: can't get link");
-				close(sockfd);
+			if (ln == NULL)
+				continue;
+
+			/* a connect() attempt finished or failed, nothing
+			 * is read before one has won, see connect_done() */
+			if (!(ln->state & SERVER) &&
+			    sockfd != ln->local_sockfd)
+				revents = POLLOUT;
+
+			/* a sockfd whose reading is paused still reports
+			 * errors and hangups, don't spin on them */
+			if (!(revents & (POLLIN | POLLOUT)) &&
+			    revents & (POLLERR | POLLHUP)) {
+				sock_info(sockfd, "error or hangup, close");
+				destroy_link(sockfd);
 				continue;
 			}
-			
+
 			if (revents & POLLIN) {
-				client_do_pollin(sockfd, ln);
+				if (client_do_pollin(sockfd, ln) == -1)
+					continue;
 			}
 
 			if (revents & POLLOUT) {
@@ -405,10 +431,20 @@ int main(int argc, char **argv)
 			/* } */
 		}
 
+		/* the recv()s and send()s queued by the handlers complete
+		 * in events of their own, still in this round */
+		nevents = poll_flush(events, MAX_POLL_EVENTS);
+		if (nevents == -1)
+			err_exit("poll error");
+		else if (nevents > 0)
+			goto handle;
+
 		reaper();
+		preconnect_refill();
 	}
 
 out:
+	preconnect_exit();
 	crypto_exit();
 
 	if (server_ai)
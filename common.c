@@ -4,10 +4,13 @@
  * it under the terms of the MIT license. See COPYING for details.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -17,21 +20,91 @@
 #include <arpa/inet.h>
 #include <openssl/evp.h>
 #include <openssl/bio.h>
+#include <sys/epoll.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "log.h"
 #include "common.h"
+#include "crypto.h"
+#include "dns.h"
+#include "pool.h"
+#include "preconnect.h"
+#include "resolve.h"
+#include "uring.h"
 
 static bool daemonize;
+/* size of clients[] and link_head[], grows up to max_fds */
 int nfds = DEFAULT_MAX_CONNECTION;
+static int max_fds = DEFAULT_MAX_CONNECTION;
+int nlinks;
+/* memory held by links, checked against ss_opt.mem_budget */
+size_t link_mem;
+
+/* listening sockfds which stopped accepting, see do_accept() */
+static int paused_listenfd[MAX_LISTENFD];
+static int npaused;
+/* when they try again if they ran out of fds, 0 if they didn't */
+static time_t accept_retry;
+static void resume_accept(void);
 struct pollfd *clients;
 struct ss_option ss_opt;
 struct link **link_head;
 
+enum poll_backend {
+	POLL_BACKEND_POLL,
+	POLL_BACKEND_EPOLL,
+	POLL_BACKEND_URING,
+};
+
+static enum poll_backend backend = POLL_BACKEND_POLL;
+static int epfd = -1;
+
+/* cached monotonic clock, see time_update() */
+time_t current_time;
+static long long current_ms;
+
+/*
+ * links hashed by deadline(in seconds) into one second slots. A single
+ * level is enough: a link only ever waits TCP_CONNECT_TIMEOUT or
+ * TCP_INACTIVE_TIMEOUT, both compile time constants shorter than a
+ * turn of the wheel, so no deadline wraps onto a slot that comes up
+ * before it's due. Timeouts beyond a turn would need a second level
+ * cascading into this one.
+ */
+#if TCP_INACTIVE_TIMEOUT >= TIMER_WHEEL_SLOTS || \
+	TCP_CONNECT_TIMEOUT >= TIMER_WHEEL_SLOTS
+#error "a link timeout doesn't fit in one turn of the timer wheel"
+#endif
+static struct link *wheel[TIMER_WHEEL_SLOTS];
+static time_t wheel_tick;
+static int wheel_links;
+
+/* links waiting for their next connect() attempt, all wait the same
+ * CONNECT_ATTEMPT_DELAY, so the queue is in deadline order */
+static struct link *attempt_head;
+static struct link *attempt_tail;
+
+/* links and their buffers are recycled instead of being freed */
+static struct pool link_pool = POOL_INIT("link", sizeof(struct link),
+					 LINK_SLAB_OBJS);
+static struct pool buf_pool = POOL_INIT("buffer",
+					BUF_HEADROOM + TEXT_BUF_SIZE,
+					BUF_SLAB_OBJS);
+/* data a buffer holds and the room behind it, which aead methods
+ * need to grow the data in place, both set by ss_init() */
+static int buf_data_size = TEXT_BUF_SIZE;
+static int buf_tailroom;
+/* what an active link costs, for the memory budget */
+static size_t link_mem_size;
+
+/* set by SIGUSR1, the stats are logged by reaper() */
+static volatile sig_atomic_t stats_requested;
+
 static void usage_client(const char *name)
 {
 	pr_err("Usage: %s [options]\n"
@@ -41,7 +114,13 @@ static void usage_client(const char *name)
 	       "\t-u,--local_addr\t local Used address\n"
 	       "\t-b,--local_port\t local Binding port\n"
 	       "\t-k,--password\t your password\n"
-	       "\t-m,--method\t encryption algorithm(aes-*-cfb, bf-cfb, cast5-cfb, des-cfb, rc2-cfb, rc4, seed-cfb)\n"
+	       "\t-m,--method\t encryption algorithm(aes-*-cfb, aes-*-ctr, bf-cfb, camellia-*-cfb, cast5-cfb, des-cfb,\n"
+	       "\t\t\t rc2-cfb, rc4, seed-cfb, chacha20-ietf, aes-128-gcm, aes-256-gcm, chacha20-ietf-poly1305)\n"
+	       "\t-C,--chunk_size\t max payload of an aead chunk(1024-16383), default is 16383\n"
+	       "\t-e,--event\t event backend(epoll, poll, io_uring), default is epoll\n"
+	       "\t-c,--max_conn\t max connections, default is what fd limit allows\n"
+	       "\t-M,--mem_budget\t memory for links in MB, default is unlimited\n"
+	       "\t-P,--preconnect\t idle connections to the server kept at most(0-64), default is 8\n"
 	       "\t-d,--daemon\t run as daemon\n"
 	       "\t-l,--log_level\t log level(0-7), default is LOG_NOTICE\n"
 	       "\t-h,--help\t print this help\n", name);
@@ -55,6 +134,16 @@ static void usage_server(const char *name)
 	       "\t-b,--local_port\t local port\n"
 	       "\t-k,--password\t your password\n"
 	       "\t-m,--method\t encryption algorithm\n"
+	       "\t-C,--chunk_size\t max payload of an aead chunk(1024-16383), default is 16383\n"
+	       "\t-e,--event\t event backend(epoll, poll, io_uring), default is epoll\n"
+	       "\t-c,--max_conn\t max connections, default is what fd limit allows\n"
+	       "\t-M,--mem_budget\t memory for links in MB, default is unlimited\n"
+	       "\t-w,--workers\t number of worker processes, default is 1\n"
+	       "\t-a,--affinity\t pin each worker to its own cpu\n"
+	       "\t-r,--resolvers\t dns resolver threads per worker, default is 4\n"
+	       "\t-N,--nameserver\t ipv4 nameserver[:port], default is what resolv.conf says\n"
+	       "\t-D,--dns_cache\t names the dns cache holds, default is 1024\n"
+	       "\t-F,--dns_file\t file the dns cache is loaded from and saved to\n"
 	       "\t-d,--daemon\t run as daemon\n"
 	       "\t-l,--log_level\t log level(0-7), default is LOG_NOTICE\n"
 	       "\t-h,--help\t print this help information\n", name);
@@ -74,10 +163,19 @@ static void pr_ss_option(const char *type)
 		"server address: %s, server port: %s\n"
 		"local address: %s, local port: %s\n"
 		"password: %s\n"
-		"method: %s\n",
+		"method: %s, chunk size: %d\n"
+		"event: %s\n"
+		"workers: %d%s, resolvers: %d\n"
+		"dns cache: %d%s%s\n"
+		"preconnect: %d\n",
 		server, server_port,
 		ss_opt.local_addr, ss_opt.local_port,
-		ss_opt.password, ss_opt.method);
+		ss_opt.password, ss_opt.method, ss_opt.chunk_size,
+		ss_opt.event,
+		ss_opt.workers, ss_opt.affinity ? " (cpu affinity)" : "",
+		ss_opt.resolvers,
+		ss_opt.dns_cache, ss_opt.dns_file[0] ? ", file: " : "",
+		ss_opt.dns_file, ss_opt.preconnect);
 }
 
 static void parse_cmdline(int argc, char **argv, const char *type)
@@ -94,6 +192,16 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 		{"local_port", required_argument, 0, 'b'},
 		{"password", required_argument, 0, 'k'},
 		{"method", required_argument, 0, 'm'},
+		{"chunk_size", required_argument, 0, 'C'},
+		{"event", required_argument, 0, 'e'},
+		{"max_conn", required_argument, 0, 'c'},
+		{"mem_budget", required_argument, 0, 'M'},
+		{"workers", required_argument, 0, 'w'},
+		{"affinity", no_argument, 0, 'a'},
+		{"resolvers", required_argument, 0, 'r'},
+		{"nameserver", required_argument, 0, 'N'},
+		{"dns_cache", required_argument, 0, 'D'},
+		{"dns_file", required_argument, 0, 'F'},
 		{"daemon", no_argument, 0, 'd'},
 		{"log_level", no_argument, 0, 'l'},
 		{"help", no_argument, 0, 'h'},
@@ -107,6 +215,11 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 		{"local_port", required_argument, 0, 'b'},
 		{"password", required_argument, 0, 'k'},
 		{"method", required_argument, 0, 'm'},
+		{"chunk_size", required_argument, 0, 'C'},
+		{"event", required_argument, 0, 'e'},
+		{"max_conn", required_argument, 0, 'c'},
+		{"mem_budget", required_argument, 0, 'M'},
+		{"preconnect", required_argument, 0, 'P'},
 		{"daemon", no_argument, 0, 'd'},
 		{"log_level", no_argument, 0, 'l'},
 		{"log_stderr", no_argument, 0, 'L'},
@@ -116,12 +229,12 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 
 	if (strcmp(type, "client") == 0) {
 		longopts = client_long_options;
-		optstring = "s:p:u:b:k:m:dl:h";
+		optstring = "s:p:u:b:k:m:C:e:c:M:P:dl:h";
 		usage = usage_client;
 		openlog("sslocal", log_opt, LOG_DAEMON);
 	} else if (strcmp(type, "server") == 0) {
 		longopts = server_long_options;
-		optstring = "u:b:k:m:dl:h";
+		optstring = "u:b:k:m:C:e:c:M:w:ar:N:D:F:dl:h";
 		usage = usage_server;
 		openlog("sserver", log_opt, LOG_DAEMON);
 	} else {
@@ -129,6 +242,9 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 		pr_exit("%s: unknown type\n", __func__);
 	}
 
+	/* -P 0 turns the pool off, so the default goes first */
+	ss_opt.preconnect = PRECONNECT_SIZE;
+
 	while (1) {
 		opt = getopt_long(argc, argv, optstring, longopts, NULL);
 		if (opt == -1)
@@ -212,6 +328,116 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 				ss_opt.method[MAX_METHOD_NAME_LEN] = '\0';
 			}
 
+			break;
+		case 'C':
+			ss_opt.chunk_size = atoi(optarg);
+			if (ss_opt.chunk_size < MIN_CHUNK_SIZE ||
+			    ss_opt.chunk_size > MAX_CHUNK_SIZE) {
+				pr_err("%s: illegal chunk size %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'e':
+			len = strlen(optarg);
+			if (len <= MAX_EVENT_NAME_LEN) {
+				strcpy(ss_opt.event, optarg);
+			} else {
+				strncpy(ss_opt.event, optarg,
+					MAX_EVENT_NAME_LEN);
+				ss_opt.event[MAX_EVENT_NAME_LEN] = '\0';
+			}
+
+			break;
+		case 'c':
+			ss_opt.max_conn = atoi(optarg);
+			if (ss_opt.max_conn < 1) {
+				pr_err("%s: illegal max connection %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'M':
+			ss_opt.mem_budget = atoi(optarg);
+			if (ss_opt.mem_budget < 1) {
+				pr_err("%s: illegal memory budget %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'w':
+			ss_opt.workers = atoi(optarg);
+			if (ss_opt.workers < 1) {
+				pr_err("%s: illegal workers number %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'a':
+			ss_opt.affinity = true;
+			break;
+		case 'r':
+			ss_opt.resolvers = atoi(optarg);
+			if (ss_opt.resolvers < 1 ||
+			    ss_opt.resolvers > MAX_RESOLVERS) {
+				pr_err("%s: illegal resolvers number %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'N':
+			len = strlen(optarg);
+			if (len > MAX_NAMESERVER_LEN) {
+				pr_err("%s: illegal nameserver %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			strcpy(ss_opt.nameserver, optarg);
+			break;
+		case 'D':
+			ss_opt.dns_cache = atoi(optarg);
+			if (ss_opt.dns_cache < 1 ||
+			    ss_opt.dns_cache > DNS_CACHE_MAX_SIZE) {
+				pr_err("%s: illegal dns cache size %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		case 'F':
+			len = strlen(optarg);
+			if (len > MAX_PATH_LEN) {
+				pr_err("%s: dns file path is too long\n",
+				       __func__);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
+			strcpy(ss_opt.dns_file, optarg);
+			break;
+		case 'P':
+			ss_opt.preconnect = atoi(optarg);
+			if (ss_opt.preconnect < 0 ||
+			    ss_opt.preconnect > PRECONNECT_MAX_SIZE) {
+				pr_err("%s: illegal preconnect size %s\n",
+				       __func__, optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+
 			break;
 		case 'd':
 			daemonize = true;
@@ -266,6 +492,21 @@ static void parse_cmdline(int argc, char **argv, const char *type)
 	if (strlen(ss_opt.method) == 0)
 		strcat(missing, "-m ");
 
+	if (strlen(ss_opt.event) == 0)
+		strcpy(ss_opt.event, "epoll");
+
+	if (ss_opt.workers == 0)
+		ss_opt.workers = 1;
+
+	if (ss_opt.resolvers == 0)
+		ss_opt.resolvers = DEFAULT_RESOLVERS;
+
+	if (ss_opt.dns_cache == 0)
+		ss_opt.dns_cache = DNS_CACHE_SIZE;
+
+	if (ss_opt.chunk_size == 0)
+		ss_opt.chunk_size = MAX_CHUNK_SIZE;
+
 	if (strlen(missing) != 0) {
 		pr_err("Missing parameter(s): %s\n", missing);
 		usage(argv[0]);
@@ -303,11 +544,43 @@ void pr_data(FILE *fp, const char *name, char *data, int len)
 	BIO_dump_fp(fp, (void *)data, len);
 }
 
+/* the size of sa for connect() and friends */
+socklen_t sockaddr_len(union ss_sockaddr *sa)
+{
+	return sa->sa.sa_family == AF_INET ? sizeof(SA_IN) : sizeof(SA_IN6);
+}
+
+/* the ip of sa as text */
+const char *sockaddr_str(union ss_sockaddr *sa, char *str, int len)
+{
+	if (sa->sa.sa_family == AF_INET)
+		return inet_ntop(AF_INET, &sa->in.sin_addr, str, len);
+
+	return inet_ntop(AF_INET6, &sa->in6.sin6_addr, str, len);
+}
+
+/* memory held by ln right now, the buffers come and go with traffic */
+static size_t link_mem_held(struct link *ln)
+{
+	size_t size = sizeof(*ln);
+
+	if (ln->up.data)
+		size += ln->up.size;
+
+	if (ln->down.data)
+		size += ln->down.size;
+
+	return size;
+}
+
 void _pr_link(int level, struct link *ln)
 {
 	enum link_state state = ln->state;
 	char state_str[512] = {'\0'};
 
+	if (!(setlogmask(0) & LOG_MASK(level)))
+		return;
+
 	if (state & LOCAL && state & SERVER)
 		strcat(state_str, "linked");
 	else if (state & LOCAL)
@@ -318,6 +591,9 @@ void _pr_link(int level, struct link *ln)
 	if (state & SS_UDP)
 		strcat(state_str, ", udp");
 
+	if (state & SS_RESOLVING)
+		strcat(state_str, ", resolving");
+
 	if (state & SS_IV_SENT && state & SS_IV_RECEIVED)
 		strcat(state_str, ", iv exchanged");
 	else if (state & SS_IV_SENT)
@@ -341,20 +617,14 @@ void _pr_link(int level, struct link *ln)
 	if (state & LOCAL_SEND_PENDING)
 		strcat(state_str, ", local send pending");
 
-	if (state & LOCAL_READ_PENDING)
-		strcat(state_str, ", local read pending");
-
-	if (state & SERVER_READ_PENDING)
-		strcat(state_str, ", server read pending");
-
 	if (state & SERVER_SEND_PENDING)
 		strcat(state_str, ", server_send_pending");
 
 	syslog(level, "state: %s\n", state_str);
 	syslog(level, "local sockfd: %d; server sockfd: %d; "
-	       "text len: %d; cipher len: %d;\n",
+	       "up len: %d; down len: %d; held: %zu;\n",
 	       ln->local_sockfd, ln->server_sockfd,
-	       ln->text_len, ln->cipher_len);
+	       ln->up.len, ln->down.len, link_mem_held(ln));
 }
 
 void pr_link_debug(struct link *ln)
@@ -377,20 +647,179 @@ void pr_link_warn(struct link *ln)
 	_pr_link(LOG_WARNING, ln);
 }
 
-void ss_init(void)
+static int poll_init(void)
+{
+	if (strcmp(ss_opt.event, "poll") == 0) {
+		backend = POLL_BACKEND_POLL;
+	} else if (strcmp(ss_opt.event, "epoll") == 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			pr_warn("%s: epoll_create1() %s, fall back to poll\n",
+				__func__, strerror(errno));
+			backend = POLL_BACKEND_POLL;
+		} else {
+			backend = POLL_BACKEND_EPOLL;
+		}
+	} else if (strcmp(ss_opt.event, "io_uring") == 0) {
+#ifdef HAVE_IO_URING
+		if (uring_init() == -1) {
+			pr_warn("%s: io_uring unavailable, fall back to poll\n",
+				__func__);
+			backend = POLL_BACKEND_POLL;
+		} else {
+			backend = POLL_BACKEND_URING;
+		}
+#else
+		pr_warn("%s: built without io_uring, fall back to poll\n",
+			__func__);
+		backend = POLL_BACKEND_POLL;
+#endif
+	} else {
+		pr_err("%s: unknown event backend %s\n",
+		       __func__, ss_opt.event);
+		return -1;
+	}
+
+	pr_info("%s: event backend: %s\n", __func__,
+		backend == POLL_BACKEND_EPOLL ? "epoll" :
+		backend == POLL_BACKEND_URING ? "io_uring" : "poll");
+
+	return 0;
+}
+
+/* raise the soft fd limit as far as the hard limit allows */
+static void raise_fd_limit(void)
 {
-	int i, ret;
 	struct rlimit limit;
 
-	ret = getrlimit(RLIMIT_NOFILE, &limit);
-	if (ret == -1) {
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
 		pr_err("%s: %s\n", __func__, strerror(errno));
-	} else {
-		if (limit.rlim_cur < DEFAULT_MAX_CONNECTION)
-			nfds = limit.rlim_cur;
+		return;
+	}
+
+	if (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > MAX_FDS)
+		limit.rlim_max = MAX_FDS;
+
+	if (limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+			pr_warn("%s: setrlimit() %s\n",
+				__func__, strerror(errno));
+			getrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	if (limit.rlim_cur > MAX_FDS)
+		limit.rlim_cur = MAX_FDS;
+
+	max_fds = limit.rlim_cur;
+}
+
+/* make clients[] and link_head[] big enough to hold sockfd */
+static int grow_tables(int sockfd)
+{
+	int i, size;
+	void *p;
+
+	if (sockfd >= max_fds) {
+		pr_warn("%s: sockfd %d exceeds fd limit %d\n",
+			__func__, sockfd, max_fds);
+		return -1;
+	}
+
+	size = nfds;
+	while (size <= sockfd)
+		size *= 2;
+
+	if (size > max_fds)
+		size = max_fds;
+
+	p = realloc(link_head, size * sizeof(void *));
+	if (p == NULL)
+		goto err;
+
+	link_head = p;
+	for (i = nfds; i < size; i++)
+		link_head[i] = NULL;
+
+	p = realloc(clients, size * sizeof(struct pollfd));
+	if (p == NULL)
+		goto err;
+
+	clients = p;
+	for (i = nfds; i < size; i++) {
+		clients[i].fd = -1;
+		clients[i].events = 0;
+		clients[i].revents = 0;
+	}
+
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING && uring_grow(size) == -1)
+		goto err;
+#endif
+
+	pr_info("%s: %d -> %d\n", __func__, nfds, size);
+	nfds = size;
+
+	return 0;
+err:
+	pr_warn("%s: can't grow to %d\n", __func__, size);
+	return -1;
+}
+
+static void stats_handler(int signo)
+{
+	stats_requested = 1;
+}
+
+static void pr_stats(void)
+{
+	int i, nactive = 0;
+	struct link *ln;
+
+	for (i = 0; i < nfds; i++) {
+		ln = link_head[i];
+		if (ln == NULL || ln->local_sockfd != i)
+			continue;
+
+		if (ln->up.data || ln->down.data)
+			nactive++;
+
+		pr_info("link %d/%d: %zu bytes held, up %d, down %d\n",
+			ln->local_sockfd, ln->server_sockfd,
+			link_mem_held(ln), ln->up.len, ln->down.len);
+	}
+
+	pr_notice("links: %d(with buffers %d), link memory: %zu, "
+		  "per link: %zu\n", nlinks, nactive, link_mem,
+		  nlinks ? link_mem / nlinks : 0);
+	pr_pool(&link_pool);
+	pr_pool(&buf_pool);
+	crypto_pr_pool();
+	dns_cache_pr_stats();
+	preconnect_pr_stats();
+}
+
+void ss_init(void)
+{
+	int i;
+
+	raise_fd_limit();
+
+	if (nfds > max_fds)
+		nfds = max_fds;
+
+	/* every link takes two sockfds */
+	if (ss_opt.max_conn == 0 || ss_opt.max_conn > max_fds / 2) {
+		if (ss_opt.max_conn > max_fds / 2)
+			pr_warn("%s: max connection %d is above fd limit %d\n",
+				__func__, ss_opt.max_conn, max_fds);
+
+		ss_opt.max_conn = max_fds / 2;
 	}
 
-	pr_info("%s: max connection: %d\n", __func__, nfds);
+	pr_info("%s: max connection: %d, fd limit: %d\n",
+		__func__, ss_opt.max_conn, max_fds);
 
 	link_head = calloc(nfds, sizeof(void *));
 	if (link_head == NULL)
@@ -402,6 +831,20 @@ void ss_init(void)
 
 	for (i = 0; i < nfds; i++)
 		clients[i].fd = -1;
+
+	if (poll_init() == -1)
+		pr_exit("%s: poll_init failed\n", __func__);
+
+	buf_data_size = crypto_buf_size();
+	buf_tailroom = crypto_tailroom(buf_data_size);
+	buf_pool.obj_size = BUF_HEADROOM + buf_data_size + buf_tailroom;
+	link_mem_size = sizeof(struct link) + 2 * buf_pool.obj_size;
+
+	/* the first slabs, so the first connections don't pay for it */
+	if (pool_grow(&link_pool) == -1 || pool_grow(&buf_pool) == -1)
+		pr_exit("%s: pool_grow failed\n", __func__);
+
+	signal(SIGUSR1, stats_handler);
 }
 
 void ss_exit(void)
@@ -411,6 +854,19 @@ void ss_exit(void)
 
 	if (clients)
 		free(clients);
+
+	if (epfd != -1) {
+		close(epfd);
+		epfd = -1;
+	}
+
+	pool_destroy(&link_pool);
+	pool_destroy(&buf_pool);
+
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		uring_exit();
+#endif
 }
 
 void poll_events_string(short events, char *events_str)
@@ -430,17 +886,67 @@ void poll_events_string(short events, char *events_str)
 	}
 }
 
+/* clients[] keeps the interest set for both backends, epoll is only
+ * told about the changes */
+static int epoll_update(int sockfd, short events, bool registered)
+{
+	int op;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = sockfd;
+
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+
+	op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(epfd, op, sockfd, &ev) == 0)
+		return 0;
+
+	/* the sockfd may be closed and reused without poll_del(),
+	 * epoll forgets a closed sockfd by itself */
+	if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else
+		goto err;
+
+	if (epoll_ctl(epfd, op, sockfd, &ev) == 0)
+		return 0;
+err:
+	sock_warn(sockfd, "%s: epoll_ctl() %s", __func__, strerror(errno));
+	return -1;
+}
+
 int poll_set(int sockfd, short events)
 {
+	bool registered;
 	char events_str[42] = {'\0'};
 
-	if (sockfd < 0 || sockfd >= nfds) {
+	if (sockfd < 0) {
 		sock_err(sockfd, "%s: illegal sockfd(%d)", __func__, sockfd);
 		return -1;
 	}
 
+	if (sockfd >= nfds && grow_tables(sockfd) == -1)
+		return -1;
+
+	registered = clients[sockfd].fd == sockfd;
+
+	if (backend == POLL_BACKEND_EPOLL &&
+	    epoll_update(sockfd, events, registered) == -1)
+		return -1;
+
 	clients[sockfd].fd = sockfd;
 	clients[sockfd].events = events;
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		uring_poll_update(sockfd);
+#endif
 	poll_events_string(events, events_str);
 	sock_info(sockfd, "%s: %s", __func__, events_str);
 
@@ -449,6 +955,7 @@ int poll_set(int sockfd, short events)
 
 int poll_add(int sockfd, short events)
 {
+	short new_events;
 	char events_str[42] = {'\0'};
 
 	if (sockfd < 0 || sockfd >= nfds) {
@@ -462,7 +969,19 @@ int poll_add(int sockfd, short events)
 		return -1;
 	}
 
-	clients[sockfd].events |= events;
+	new_events = clients[sockfd].events | events;
+	if (new_events == clients[sockfd].events)
+		return 0;
+
+	if (backend == POLL_BACKEND_EPOLL &&
+	    epoll_update(sockfd, new_events, true) == -1)
+		return -1;
+
+	clients[sockfd].events = new_events;
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		uring_poll_update(sockfd);
+#endif
 	poll_events_string(events, events_str);
 	sock_info(sockfd, "%s: %s", __func__, events_str);
 
@@ -471,6 +990,7 @@ int poll_add(int sockfd, short events)
 
 int poll_rm(int sockfd, short events)
 {
+	short new_events;
 	char events_str[42] = {'\0'};
 
 	if (sockfd < 0 || sockfd >= nfds) {
@@ -478,7 +998,19 @@ int poll_rm(int sockfd, short events)
 		return -1;
 	}
 
-	clients[sockfd].events &= ~events;
+	new_events = clients[sockfd].events & ~events;
+	if (new_events == clients[sockfd].events)
+		return 0;
+
+	if (backend == POLL_BACKEND_EPOLL && clients[sockfd].fd == sockfd &&
+	    epoll_update(sockfd, new_events, true) == -1)
+		return -1;
+
+	clients[sockfd].events = new_events;
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		uring_poll_update(sockfd);
+#endif
 	poll_events_string(events, events_str);
 	sock_info(sockfd, "%s: %s", __func__, events_str);
 
@@ -492,175 +1024,623 @@ int poll_del(int sockfd)
 		return -1;
 	}
 
+	if (backend == POLL_BACKEND_EPOLL && clients[sockfd].fd == sockfd)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
+
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		uring_poll_del(sockfd);
+#endif
+
 	clients[sockfd].fd = -1;
 	sock_info(sockfd, "%s: deleted from poll", __func__);
 
 	return 0;
 }
 
-/**
- * time_out - check if it's timed out
- *
- * @this: the time_t we want to compare(usually is NOW)
- * @that: the time_t we want to check
- * @value: how long we think it's a timeout
- *
- * Return: 0 means time out, -1 means not time out
- */
-static int time_out(time_t this, time_t that, double value)
+static int epoll_do_wait(struct poll_event *events, int maxevents,
+			 int timeout)
 {
-	if (difftime(this, that) > value)
-		return 0;
-	else
-		return -1;
-}
+	int i, ret;
+	short revents;
+	struct epoll_event ep_events[MAX_POLL_EVENTS];
 
-void reaper(void)
-{
-	int sockfd;
-	double value;
-	struct link *ln;
-	time_t now = time(NULL);
-	static time_t checked = (time_t)-1;
+	if (maxevents > MAX_POLL_EVENTS)
+		maxevents = MAX_POLL_EVENTS;
 
-	if (checked == (time_t)-1) {
-		checked = now;
-	} else if (time_out(now, checked, TCP_INACTIVE_TIMEOUT) == -1) {
-		return;
-	} else {
-		checked = now;
-	}
+	ret = epoll_wait(epfd, ep_events, maxevents, timeout);
+	if (ret == -1)
+		return -1;
 
-	for (sockfd = 0; sockfd < nfds; sockfd++) {
-		ln = link_head[sockfd];
-		if (ln == NULL)
-			continue;
+	for (i = 0; i < ret; i++) {
+		revents = 0;
 
-		if (ln->state & SERVER)
-			value = TCP_INACTIVE_TIMEOUT;
-		else
-			value = TCP_CONNECT_TIMEOUT;
+		if (ep_events[i].events & EPOLLIN)
+			revents |= POLLIN;
 
-		if (time_out(now, ln->time, value) == 0) {
-			if (value == TCP_CONNECT_TIMEOUT)
-				pr_debug("%s: connect timeout, close\n",
-					 __func__);
+		if (ep_events[i].events & EPOLLOUT)
+			revents |= POLLOUT;
 
-			if (value == TCP_INACTIVE_TIMEOUT)
-				pr_debug("%s: inactive timeout, close\n",
-					 __func__);
+		if (ep_events[i].events & EPOLLERR)
+			revents |= POLLERR;
 
-			destroy_link(sockfd);
-		}
+		if (ep_events[i].events & EPOLLHUP)
+			revents |= POLLHUP;
+
+		events[i].fd = ep_events[i].data.fd;
+		events[i].revents = revents;
 	}
+
+	return ret;
 }
 
-struct link *create_link(int sockfd, const char *type)
+static int poll_do_wait(struct poll_event *events, int maxevents,
+			int timeout)
 {
-	struct link *ln;
+	int i, n, ret;
 
-	ln = calloc(1, sizeof(*ln));
-	if (ln == NULL)
-		goto err;
+	ret = poll(clients, nfds, timeout);
+	if (ret <= 0)
+		return ret;
 
-	ln->text = malloc(TEXT_BUF_SIZE);
-	if (ln->text == NULL)
-		goto err;
+	/* whatever doesn't fit in events will be reported again by
+	 * the next poll() */
+	for (i = 0, n = 0; i < nfds && n < ret && n < maxevents; i++) {
+		if (clients[i].fd == -1 || clients[i].revents == 0)
+			continue;
 
-	ln->cipher = malloc(CIPHER_BUF_SIZE);
-	if (ln->cipher == NULL)
-		goto err;
+		events[n].fd = clients[i].fd;
+		events[n].revents = clients[i].revents;
+		n++;
+	}
 
-	/* cipher to encrypt local data */
-	ln->local_ctx = EVP_CIPHER_CTX_new();
-	if (ln->local_ctx == NULL)
-		goto err;
+	return n;
+}
 
-	/* cipher to decrypt server data */
-	ln->server_ctx = EVP_CIPHER_CTX_new();
-	if (ln->server_ctx == NULL)
-		goto err;
+/**
+ * poll_wait - wait for events on the sockfds set by poll_set()
+ *
+ * @events: filled with ready sockfds and their revents
+ * @maxevents: size of events
+ * @timeout: in milliseconds, -1 means infinite
+ *
+ * Return: number of ready sockfds, 0 means timeout(or interrupted),
+ * -1 means error
+ */
+int poll_wait(struct poll_event *events, int maxevents, int timeout)
+{
+	int ret;
 
-	ln->state |= LOCAL;
+	if (backend == POLL_BACKEND_EPOLL)
+		ret = epoll_do_wait(events, maxevents, timeout);
+#ifdef HAVE_IO_URING
+	else if (backend == POLL_BACKEND_URING)
+		ret = uring_poll_wait(events, maxevents, timeout);
+#endif
+	else
+		ret = poll_do_wait(events, maxevents, timeout);
 
-	ln->local_sockfd = sockfd;
-	ln->server_sockfd = -1;
-	ln->time = time(NULL);
+	if (ret == -1 && errno == EINTR)
+		return 0;
 
-	if (link_head[sockfd] != NULL) {
-		sock_warn(sockfd, "%s: link already exist for sockfd %d",
-			  __func__, sockfd);
-		goto err;
-	}
+	return ret;
+}
 
-	link_head[sockfd] = ln;
+/**
+ * poll_flush - the events of the recv()s and send()s the handlers
+ * queued, see uring_poll_flush()
+ *
+ * Called after the events of poll_wait() are handled, and again after
+ * those it returned, until it returns 0. Only io_uring queues them.
+ *
+ * Return: the number of events, -1 on error
+ */
+int poll_flush(struct poll_event *events, int maxevents)
+{
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING)
+		return uring_poll_flush(events, maxevents);
+#endif
 
-	return ln;
-err:
-	if (ln->server_ctx)
-		EVP_CIPHER_CTX_free(ln->server_ctx);
+	return 0;
+}
 
-	if (ln->local_ctx)
-		EVP_CIPHER_CTX_free(ln->local_ctx);
+/**
+ * time_update - refresh the cached clock
+ *
+ * Called once per event loop round, everything else reads
+ * current_time instead of asking the kernel.
+ */
+void time_update(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	current_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	current_time = ts.tv_sec;
 
-	if (ln->text)
-		free(ln->text);
+	if (wheel_tick == 0)
+		wheel_tick = current_time;
+}
 
-	if (ln->cipher)
-		free(ln->cipher);
+static void timer_add(struct link *ln)
+{
+	int slot = ln->expire & (TIMER_WHEEL_SLOTS - 1);
 
-	if (ln)
-		free(ln);
+	ln->timer_prev = NULL;
+	ln->timer_next = wheel[slot];
+	if (wheel[slot])
+		wheel[slot]->timer_prev = ln;
 
-	sock_warn(sockfd, "%s: failed", __func__);
-	return NULL;
+	wheel[slot] = ln;
+	ln->timer_slot = slot;
+	wheel_links++;
 }
 
-struct link *get_link(int sockfd)
+static void timer_del(struct link *ln)
 {
-	if (sockfd < 0 || sockfd >= nfds) {
-		pr_warn("%s: invalid sockfd %d", __func__, sockfd);
-		return NULL;
+	if (ln->timer_slot == -1)
+		return;
+
+	if (ln->timer_prev)
+		ln->timer_prev->timer_next = ln->timer_next;
+	else
+		wheel[ln->timer_slot] = ln->timer_next;
+
+	if (ln->timer_next)
+		ln->timer_next->timer_prev = ln->timer_prev;
+
+	ln->timer_prev = ln->timer_next = NULL;
+	ln->timer_slot = -1;
+	wheel_links--;
+}
+
+/**
+ * link_touch - push the deadline of a link forward
+ *
+ * A link has TCP_CONNECT_TIMEOUT until it's connected to the server,
+ * TCP_INACTIVE_TIMEOUT after that. Only the deadline is updated, a
+ * link sitting in an earlier slot is moved when that slot expires.
+ */
+void link_touch(struct link *ln)
+{
+	if (ln->state & SERVER)
+		ln->expire = current_time + TCP_INACTIVE_TIMEOUT;
+	else
+		ln->expire = current_time + TCP_CONNECT_TIMEOUT;
+
+	if (ln->timer_slot == -1)
+		timer_add(ln);
+}
+
+static void attempt_queue(struct link *ln)
+{
+	ln->attempt_ms = current_ms + CONNECT_ATTEMPT_DELAY;
+	ln->attempt_next = NULL;
+	ln->attempt_prev = attempt_tail;
+	if (attempt_tail)
+		attempt_tail->attempt_next = ln;
+	else
+		attempt_head = ln;
+
+	attempt_tail = ln;
+}
+
+static void attempt_dequeue(struct link *ln)
+{
+	if (ln->attempt_ms == 0)
+		return;
+
+	if (ln->attempt_prev)
+		ln->attempt_prev->attempt_next = ln->attempt_next;
+	else
+		attempt_head = ln->attempt_next;
+
+	if (ln->attempt_next)
+		ln->attempt_next->attempt_prev = ln->attempt_prev;
+	else
+		attempt_tail = ln->attempt_prev;
+
+	ln->attempt_prev = ln->attempt_next = NULL;
+	ln->attempt_ms = 0;
+}
+
+/* give up the connect() attempt to server_addrs[i] */
+static void attempt_close(struct link *ln, int i)
+{
+	int fd = ln->conn_fds[i];
+
+	link_head[fd] = NULL;
+	poll_del(fd);
+	close(fd);
+	ln->conn_fds[i] = -1;
+	ln->nattempts--;
+
+	if (ln->server_sockfd != fd)
+		return;
+
+	/* another attempt stands in until one wins */
+	ln->server_sockfd = -1;
+	for (i = 0; i < ln->server_naddrs; i++)
+		if (ln->conn_fds[i] != -1)
+			ln->server_sockfd = ln->conn_fds[i];
+}
+
+/* fd is connected, the other attempts are cancelled */
+static void connect_won(struct link *ln, int fd)
+{
+	int i;
+
+	attempt_dequeue(ln);
+	ln->server_sockfd = fd;
+	for (i = 0; i < ln->server_naddrs; i++)
+		if (ln->conn_fds[i] != -1 && ln->conn_fds[i] != fd)
+			attempt_close(ln, i);
+
+	ln->state |= SERVER;
+	link_touch(ln);
+	if (ln->state & SERVER_SEND_PENDING)
+		poll_add(fd, POLLOUT);
+
+	sock_info(fd, "%s: connected", __func__);
+}
+
+/**
+ * connect_next - start a connect() attempt to the next address
+ *
+ * An address which fails right away is skipped. If there are more
+ * addresses after it, the link is queued so the next one starts in
+ * CONNECT_ATTEMPT_DELAY unless this one is done by then.
+ *
+ * Return: 0 if an attempt is in flight or won, -1 otherwise
+ */
+static int connect_next(struct link *ln)
+{
+	int i, fd, type;
+	union ss_sockaddr *sa;
+
+	attempt_dequeue(ln);
+	type = ln->state & SS_UDP ? SOCK_DGRAM : SOCK_STREAM;
+
+	while (ln->next_addr < ln->server_naddrs) {
+		i = ln->next_addr++;
+		sa = &ln->server_addrs[i];
+		fd = socket(sa->sa.sa_family, type | SOCK_NONBLOCK, 0);
+		if (fd == -1) {
+			pr_warn("%s: socket() %s\n", __func__, strerror(errno));
+			continue;
+		}
+
+		if (poll_set(fd, POLLIN) == -1) {
+			close(fd);
+			continue;
+		}
+
+		link_head[fd] = ln;
+		ln->conn_fds[i] = fd;
+		ln->nattempts++;
+		if (ln->server_sockfd == -1)
+			ln->server_sockfd = fd;
+
+		if (connect(fd, &sa->sa, sockaddr_len(sa)) == 0) {
+			connect_won(ln, fd);
+			return 0;
+		}
+
+		if (errno != EINPROGRESS) {
+			sock_info(fd, "%s: connect() %s",
+				  __func__, strerror(errno));
+			attempt_close(ln, i);
+			continue;
+		}
+
+		poll_add(fd, POLLOUT);
+		if (ln->next_addr < ln->server_naddrs)
+			attempt_queue(ln);
+
+		return 0;
 	}
 
-	if (link_head[sockfd] == NULL) {
-		sock_warn(sockfd, "%s: link doesn't exist", __func__);
-		return NULL;
+	return ln->nattempts > 0 ? 0 : -1;
+}
+
+/**
+ * timer_timeout - milliseconds until the next slot with links expires,
+ * the next connect() attempt is due, or paused listening sockfds try
+ * again
+ *
+ * Return: the timeout for poll_wait(), -1 means no timer at all
+ */
+int timer_timeout(void)
+{
+	int i, timeout = -1;
+	long long expire;
+
+	for (i = 1; wheel_links > 0 && i <= TIMER_WHEEL_SLOTS; i++) {
+		if (wheel[(wheel_tick + i) & (TIMER_WHEEL_SLOTS - 1)]) {
+			expire = (long long)(wheel_tick + i) * 1000;
+			timeout = expire <= current_ms ? 0 : expire - current_ms;
+			break;
+		}
 	}
 
-	return link_head[sockfd];
+	if (accept_retry) {
+		expire = (long long)accept_retry * 1000 - current_ms;
+		if (expire < 0)
+			expire = 0;
+
+		if (timeout == -1 || expire < timeout)
+			timeout = expire;
+	}
+
+	if (attempt_head) {
+		expire = attempt_head->attempt_ms - current_ms;
+		if (expire < 0)
+			expire = 0;
+
+		if (timeout == -1 || expire < timeout)
+			timeout = expire;
+	}
+
+	return timeout;
 }
 
-static void free_link(struct link *ln)
+/* close the links whose deadline passed, start the delayed connect()
+ * attempts and resume accepting, run once per loop round */
+void reaper(void)
 {
-	if (ln->text)
-		free(ln->text);
+	int slot;
+	struct link *ln, *next;
 
-	if (ln->cipher)
-		free(ln->cipher);
+	if (stats_requested) {
+		stats_requested = 0;
+		pr_stats();
+	}
+
+	/* fds or memory may have been freed by now, not necessarily by
+	 * a link of ours going away */
+	if (accept_retry && accept_retry <= current_time) {
+		accept_retry = 0;
+		resume_accept();
+	}
+
+	/* the attempts in flight are slow, the next address has a go */
+	while (attempt_head && attempt_head->attempt_ms <= current_ms)
+		connect_next(attempt_head);
+
+	/* nothing in the wheel is further away than a whole turn */
+	if (current_time - wheel_tick > TIMER_WHEEL_SLOTS)
+		wheel_tick = current_time - TIMER_WHEEL_SLOTS;
+
+	while (wheel_tick < current_time) {
+		wheel_tick++;
+		slot = wheel_tick & (TIMER_WHEEL_SLOTS - 1);
+		ln = wheel[slot];
+		wheel[slot] = NULL;
+
+		for (; ln; ln = next) {
+			next = ln->timer_next;
+			ln->timer_prev = ln->timer_next = NULL;
+			ln->timer_slot = -1;
+			wheel_links--;
+
+			if (ln->expire > current_time) {
+				timer_add(ln);
+				continue;
+			}
+
+			if (ln->state & SERVER)
+				pr_debug("%s: inactive timeout, close\n",
+					 __func__);
+			else
+				pr_debug("%s: connect timeout, close\n",
+					 __func__);
+
+			destroy_link(ln->local_sockfd);
+		}
+	}
+}
+
+static bool link_admissible(void)
+{
+	if (nlinks >= ss_opt.max_conn)
+		return false;
+
+	/* buffers are held only by active links, leave room for the
+	 * new one to become active */
+	if (ss_opt.mem_budget &&
+	    link_mem + link_mem_size > (size_t)ss_opt.mem_budget << 20)
+		return false;
+
+	return true;
+}
+
+static void pause_accept(int listenfd)
+{
+	int i;
+
+	for (i = 0; i < npaused; i++)
+		if (paused_listenfd[i] == listenfd)
+			return;
+
+	if (npaused == MAX_LISTENFD)
+		return;
+
+	poll_rm(listenfd, POLLIN);
+	paused_listenfd[npaused++] = listenfd;
+	pr_warn("%s: stop accepting, links: %d, memory: %zu bytes\n",
+		__func__, nlinks, link_mem);
+}
+
+/* called whenever a link goes away */
+static void resume_accept(void)
+{
+	if (npaused == 0 || !link_admissible())
+		return;
+
+	while (npaused > 0)
+		poll_add(paused_listenfd[--npaused], POLLIN);
+
+	pr_warn("%s: accepting again, links: %d\n", __func__, nlinks);
+}
+
+/**
+ * buf_get - make sure buf has memory before data is put in it
+ *
+ * Links only hold buffers while they have data in flight, idle links
+ * and links in the handshake cost little more than struct link.
+ */
+static int buf_get(struct ss_buf *buf)
+{
+	if (buf->data)
+		return 0;
+
+	buf->data = pool_get(&buf_pool);
+	if (buf->data == NULL)
+		return -1;
+
+	buf->size = buf_pool.obj_size;
+	buf_reset(buf);
+	link_mem += buf->size;
+	return 0;
+}
+
+/* give the memory of buf back to the pool, even if it isn't empty */
+static void buf_free(struct ss_buf *buf)
+{
+	if (buf->data == NULL)
+		return;
+
+	pool_put(&buf_pool, buf->data);
+	link_mem -= buf->size;
+	buf->data = NULL;
+	buf->len = 0;
+	buf->rest = 0;
+	buf->pre_len = 0;
+}
+
+/* once buf is drained, it goes back to the pool for other links */
+static void buf_put(struct ss_buf *buf)
+{
+	if (buf->data == NULL || buf->len > 0 || buf->rest > 0 ||
+	    buf->pre_len > 0)
+		return;
+
+	buf_free(buf);
+	resume_accept();
+}
+
+static void free_link(struct link *ln)
+{
+	buf_free(&ln->up);
+	buf_free(&ln->down);
 
 	if (ln->local_ctx)
-		EVP_CIPHER_CTX_free(ln->local_ctx);
+		crypto_ctx_put(ln->local_ctx);
 
 	if (ln->server_ctx)
-		EVP_CIPHER_CTX_free(ln->server_ctx);
+		crypto_ctx_put(ln->server_ctx);
+
+	pool_put(&link_pool, ln);
+}
+
+struct link *create_link(int sockfd, const char *type)
+{
+	int i;
+	struct link *ln;
+
+	if (nlinks >= ss_opt.max_conn) {
+		sock_warn(sockfd, "%s: too many links(%d)", __func__, nlinks);
+		return NULL;
+	}
+
+	if (sockfd < 0 || sockfd >= nfds) {
+		sock_warn(sockfd, "%s: sockfd not in poll", __func__);
+		return NULL;
+	}
+
+	ln = pool_get(&link_pool);
+	if (ln == NULL) {
+		sock_warn(sockfd, "%s: no memory for link", __func__);
+		return NULL;
+	}
+
+	memset(ln, 0, sizeof(*ln));
+
+	/* cipher to encrypt local data */
+	ln->local_ctx = crypto_ctx_get();
+	if (ln->local_ctx == NULL)
+		goto err;
+
+	/* cipher to decrypt server data */
+	ln->server_ctx = crypto_ctx_get();
+	if (ln->server_ctx == NULL)
+		goto err;
+
+	ln->state |= LOCAL;
+
+	ln->local_sockfd = sockfd;
+	ln->server_sockfd = -1;
+	ln->timer_slot = -1;
+	for (i = 0; i < MAX_SERVER_ADDRS; i++)
+		ln->conn_fds[i] = -1;
+
+	if (link_head[sockfd] != NULL) {
+		sock_warn(sockfd, "%s: link already exist for sockfd %d",
+			  __func__, sockfd);
+		goto err;
+	}
+
+	link_head[sockfd] = ln;
+	link_touch(ln);
+	nlinks++;
+	link_mem += sizeof(struct link);
+
+	return ln;
+err:
+	free_link(ln);
+	sock_warn(sockfd, "%s: failed", __func__);
+	return NULL;
+}
+
+struct link *get_link(int sockfd)
+{
+	if (sockfd < 0 || sockfd >= nfds) {
+		pr_warn("%s: invalid sockfd %d", __func__, sockfd);
+		return NULL;
+	}
+
+	if (link_head[sockfd] == NULL) {
+		sock_warn(sockfd, "%s: link doesn't exist", __func__);
+		return NULL;
+	}
 
-	if (ln)
-		free(ln);
+	return link_head[sockfd];
 }
 
 void destroy_link(int sockfd)
 {
+	int i;
 	struct link *ln;
 
 	ln = get_link(sockfd);
 	if (ln == NULL)
 		return;
 
+	timer_del(ln);
+	resolve_cancel(ln);
+	attempt_dequeue(ln);
+	for (i = 0; i < ln->server_naddrs; i++)
+		if (ln->conn_fds[i] != -1 && ln->conn_fds[i] != ln->server_sockfd)
+			attempt_close(ln, i);
+
 	link_head[ln->local_sockfd] = NULL;
-	link_head[ln->server_sockfd] = NULL;
 	poll_del(ln->local_sockfd);
-	poll_del(ln->server_sockfd);
+
+	if (ln->server_sockfd >= 0) {
+		link_head[ln->server_sockfd] = NULL;
+		poll_del(ln->server_sockfd);
+	}
 
 	if (ln->local_sockfd >= 0)
 		close(ln->local_sockfd);
@@ -669,6 +1649,54 @@ void destroy_link(int sockfd)
 		close(ln->server_sockfd);
 
 	free_link(ln);
+	nlinks--;
+	link_mem -= sizeof(struct link);
+	resume_accept();
+}
+
+/**
+ * do_accept - accept one connection and put it in poll
+ *
+ * When the link table or the memory budget is full, or the process
+ * runs out of fds, the listening sockfd is taken out of poll so the
+ * connections wait in the backlog, until a link is destroyed. Out of
+ * fds or memory, it's also tried again ACCEPT_RETRY later, there may
+ * be no link of ours to go away.
+ *
+ * Return: the non-blocking sockfd, -1 if nothing was accepted
+ */
+int do_accept(int listenfd)
+{
+	int sockfd;
+
+	if (!link_admissible()) {
+		pause_accept(listenfd);
+		return -1;
+	}
+
+	sockfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sockfd == -1) {
+		if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+		    errno == ENOMEM) {
+			/* the connection stays in the backlog, a level
+			 * triggered listenfd would report it over and over */
+			pr_warn("%s: accept4() %s\n", __func__, strerror(errno));
+			pause_accept(listenfd);
+			accept_retry = current_time + ACCEPT_RETRY;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			   errno != EINTR && errno != ECONNABORTED) {
+			pr_warn("%s: accept4() %s\n", __func__, strerror(errno));
+		}
+
+		return -1;
+	}
+
+	if (poll_set(sockfd, POLLIN) == -1) {
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
 }
 
 /* for udp, we just bind it, since udp can't listen */
@@ -695,6 +1723,13 @@ int do_listen(struct addrinfo *info, const char *type_str)
 			if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0)
 				goto err;
 
+			/* every worker binds its own socket, the kernel
+			 * spreads new connections among them */
+			if (ss_opt.workers > 1 &&
+			    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				       &opt, sizeof(opt)) != 0)
+				goto err;
+
 			if (bind(sockfd, lp->ai_addr, lp->ai_addrlen) == -1)
 				goto err;
 
@@ -712,11 +1747,85 @@ err:
 	err_exit("do_listen");
 }
 
+/**
+ * link_set_addrs - ln connects to n addrs, in the order of RFC 8305
+ *
+ * The families take turns, starting with that of the first address,
+ * so a family which doesn't work costs one attempt delay instead of
+ * one for each of its addresses.
+ */
+void link_set_addrs(struct link *ln, union ss_sockaddr *addrs, int n)
+{
+	int i, family;
+	unsigned int taken = 0;
+
+	ln->server_naddrs = 0;
+	family = n > 0 ? addrs[0].sa.sa_family : AF_UNSPEC;
+	while (ln->server_naddrs < MAX_SERVER_ADDRS) {
+		/* the next one of family, or of any if it has run out */
+		for (i = 0; i < n; i++)
+			if (!(taken & 1U << i) &&
+			    addrs[i].sa.sa_family == family)
+				break;
+
+		/* family has run out, any will do */
+		if (i == n)
+			for (i = 0; i < n; i++)
+				if (!(taken & 1U << i))
+					break;
+
+		if (i == n)
+			break;
+
+		taken |= 1U << i;
+		ln->server_addrs[ln->server_naddrs++] = addrs[i];
+		family = addrs[i].sa.sa_family == AF_INET6 ? AF_INET : AF_INET6;
+	}
+}
+
+/**
+ * link_set_server - ln connects to the addresses of ai
+ *
+ * Those of the socktype ln needs are copied into the link, ai can be
+ * freed afterwards.
+ *
+ * Return: the number of addresses kept
+ */
+int link_set_server(struct link *ln, struct addrinfo *ai)
+{
+	int n = 0;
+	int type = ln->state & SS_UDP ? SOCK_DGRAM : SOCK_STREAM;
+	/* as many as the dns cache keeps to choose from */
+	union ss_sockaddr addrs[DNS_CACHE_MAX_ADDRS];
+
+	for (; ai && n < DNS_CACHE_MAX_ADDRS; ai = ai->ai_next) {
+		if (ai->ai_socktype != type ||
+		    (ai->ai_family != AF_INET && ai->ai_family != AF_INET6))
+			continue;
+
+		memcpy(&addrs[n++], ai->ai_addr, ai->ai_addrlen);
+	}
+
+	link_set_addrs(ln, addrs, n);
+	return ln->server_naddrs;
+}
+
+/**
+ * connect_server - connect the link of sockfd to its server addresses
+ *
+ * Happy eyeballs(RFC 8305): the addresses are tried one after the
+ * other, each CONNECT_ATTEMPT_DELAY after the last or as soon as the
+ * last fails, without giving up those in flight. The first one to
+ * connect becomes server_sockfd, see connect_done(). A connection
+ * sslocal made before it's asked for wins right away, see
+ * preconnect.c.
+ *
+ * Return: 0 if connecting is under way, -1 otherwise
+ */
 int connect_server(int sockfd)
 {
-	int new_sockfd, ret, type;
+	int fd;
 	struct link *ln;
-	struct addrinfo *ai;
 
 	ln = get_link(sockfd);
 	if (ln == NULL)
@@ -729,219 +1838,258 @@ int connect_server(int sockfd)
 		return 0;
 	}
 
-	if (ln->state & SS_UDP)
-		type = SOCK_DGRAM;
-	else
-		type = SOCK_STREAM;
-
-	ai = ln->server;
-	while (ai) {
-		if (ai->ai_socktype == type) {
-			type |= SOCK_NONBLOCK;
-			new_sockfd = socket(ai->ai_family, type, 0);
-			if (new_sockfd == -1)
-				goto err;
-
-			link_head[new_sockfd] = ln;
-			ln->server_sockfd = new_sockfd;
-			ln->time = time(NULL);
-			poll_set(new_sockfd, POLLIN);
-			ret = connect(new_sockfd, ai->ai_addr, ai->ai_addrlen);
-			if (ret == -1) {
-				/* it's ok to return inprogress, will
-				 * handle it later */
-				if (errno == EINPROGRESS) {
-					poll_add(new_sockfd, POLLOUT);
-					return 0;
-				} else {
-					goto err;
-				}
-			}
+	if (ln->server_naddrs == 0) {
+		sock_warn(sockfd, "%s: no server address", __func__);
+		return -1;
+	}
 
-			/* sucessfully connected */
-			ln->state |= SERVER;
-			sock_info(new_sockfd, "%s: connected", __func__);
-			return 0;
-		}
+	if (!(ln->state & SS_UDP) && (fd = preconnect_get()) != -1) {
+		link_head[fd] = ln;
+		ln->conn_fds[0] = fd;
+		ln->nattempts = 1;
+		ln->next_addr = ln->server_naddrs;
+		connect_won(ln, fd);
+		return 0;
+	}
 
-		ai = ai->ai_next;
+	ln->next_addr = 0;
+	if (connect_next(ln) == -1) {
+		sock_warn(sockfd, "%s: no address could be connected",
+			  __func__);
+		return -1;
 	}
 
-err:
-	perror("connect_server");
-	return -1;
+	return 0;
 }
 
-int add_data(int sockfd, struct link *ln,
-	     const char *type, char *data, int size)
+/**
+ * connect_done - the pending connect() on sockfd finished
+ *
+ * Called by the pollout handlers until the link is connected. A
+ * failed attempt is closed and the next address started right away.
+ *
+ * Return: 0 if sockfd won and is server_sockfd now, -1 if the link
+ * still waits for an attempt, -2 if all of them failed and sockfd is
+ * left for the caller to destroy the link with
+ */
+int connect_done(int sockfd, struct link *ln)
 {
-	char *buf;
-	int len;
+	int i, err;
+	socklen_t len = sizeof(err);
+	union ss_sockaddr peer;
 
-	if (strcmp(type, "text") == 0) {
-		buf = ln->text;
-		len = ln->text_len;
+	for (i = 0; i < ln->server_naddrs; i++)
+		if (ln->conn_fds[i] == sockfd)
+			break;
 
-		if (len + size > TEXT_BUF_SIZE) {
-			sock_warn(sockfd, "%s: data exceed max length(%d/%d)",
-				  __func__, len + size, TEXT_BUF_SIZE);
-			return -1;
-		}
+	if (i == ln->server_naddrs)
+		return -1;
 
-		ln->text_len += size;
-	} else if (strcmp(type, "cipher") == 0) {
-		buf = ln->cipher;
-		len = ln->cipher_len;
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
 
-		if (len + size > CIPHER_BUF_SIZE) {
-			sock_warn(sockfd, "%s: data exceed max length(%d/%d)",
-				  __func__, len + size, CIPHER_BUF_SIZE);
+	/* a stale event of a closed attempt whose fd is reused by a
+	 * new one, that is still in progress */
+	len = sizeof(peer);
+	if (err == 0 && getpeername(sockfd, &peer.sa, &len) == -1) {
+		if (errno == ENOTCONN)
 			return -1;
-		}
 
-		ln->cipher_len += size;
-	} else {
-		sock_warn(sockfd, "%s: unknown type", __func__);
-		return -1;
+		err = errno;
 	}
 
-	/* if len == 0, no data need to be moved */
-	if (len > 0)
-		memmove(buf + size, buf, len);
+	if (err == 0) {
+		connect_won(ln, sockfd);
+		return 0;
+	}
 
-	memcpy(buf, data, size);
-	return 0;
+	sock_info(sockfd, "%s: connect() %s", __func__, strerror(err));
+
+	/* the next address doesn't wait for the delay */
+	connect_next(ln);
+
+	/* it connected right away, sockfd went with the other attempts */
+	if (ln->state & SERVER)
+		return -1;
+
+	if (ln->nattempts == 1)
+		return -2;
+
+	attempt_close(ln, i);
+	return -1;
 }
 
-int rm_data(int sockfd, struct link *ln, const char *type, int size)
+/**
+ * add_data - prepend size bytes of data to buf
+ *
+ * The data normally goes into the headroom, the content of buf is
+ * only moved when the headroom is used up.
+ */
+int add_data(int sockfd, struct ss_buf *buf, char *data, int size)
 {
-	char *buf;
-	int len;
+	if (buf_get(buf) == -1)
+		return -1;
 
-	if (strcmp(type, "text") == 0) {
-		buf = ln->text;
+	if (buf->len + size > buf->size) {
+		sock_warn(sockfd, "%s: data exceed max length(%d/%d)",
+			  __func__, buf->len + size, buf->size);
+		return -1;
+	}
 
-		if (ln->text_len < size) {
-			sock_warn(sockfd, "%s: size is too big(%d/%d)",
-				  __func__, size, ln->text_len);
-			return -1;
-		}
+	if (buf->len == 0 && buf->rest == 0)
+		buf_reset(buf);
 
-		ln->text_len -= size;
-		len = ln->text_len;
-	} else if (strcmp(type, "cipher") == 0) {
-		buf = ln->cipher;
-		
-		if (ln->cipher_len < size) {
-			sock_warn(sockfd, "%s: size is too big(%d/%d)",
-				  __func__, size, ln->cipher_len);
-			return -1;
-		}
+	if (buf->head < size) {
+		memmove(buf->data + size, buf_ptr(buf),
+			buf->len + buf->rest);
+		buf->head = size;
+	}
 
-		ln->cipher_len -= size;
-		len = ln->cipher_len;
-	} else {
-		sock_warn(sockfd, "%s: unknown type", __func__);
+	buf->head -= size;
+	buf->len += size;
+	memcpy(buf_ptr(buf), data, size);
+	return 0;
+}
+
+/**
+ * rm_data - consume size bytes from the head of buf
+ */
+int rm_data(int sockfd, struct ss_buf *buf, int size)
+{
+	if (buf->len < size) {
+		sock_warn(sockfd, "%s: size is too big(%d/%d)",
+			  __func__, size, buf->len);
 		return -1;
 	}
 
-	memmove(buf, buf + size, len);
+	buf->head += size;
+	buf->len -= size;
+
+	if (buf->len == 0 && buf->rest == 0)
+		buf_reset(buf);
 
 	return 0;
 }
 
+/**
+ * check_ss_header - find out where the link goes
+ *
+ * A literal ip is put in the link as it is, no lookup and nothing to
+ * allocate. A domain is looked up in the dns cache, or by the
+ * resolver threads if it isn't there.
+ *
+ * Return: 0 on success(the link may be SS_RESOLVING), -1 otherwise
+ */
 int check_ss_header(int sockfd, struct link *ln)
 {
-	int ret;
+	int i, n, socktype;
 	char atyp;
-	char addr[256];
+	char addr[MAX_DOMAIN_LEN + 1];
 	unsigned short port;
-	char port_str[6];
+	char port_str[MAX_PORT_STRING_LEN + 1];
 	short addr_len;
 	struct ss_header *req;
-	struct addrinfo hint;
-	struct addrinfo *res;
+	union ss_sockaddr *sa = &ln->server_addrs[0];
+	union ss_sockaddr addrs[DNS_CACHE_MAX_ADDRS];
 
-	memset(&hint, 0, sizeof(hint));
-	hint.ai_socktype = SOCK_STREAM;
+	req = (void *)buf_ptr(&ln->up);
 
-	req = (void *)ln->text;
+	if (ln->state & SS_UDP)
+		socktype = SOCK_DGRAM;
+	else
+		socktype = SOCK_STREAM;
 
-	if (ln->state & SS_UDP) {
-		hint.ai_socktype = SOCK_DGRAM;
-	} else {
-		hint.ai_socktype = SOCK_STREAM;
-	}
-	
 	atyp = req->atyp;
 	if (atyp == SOCKS5_ADDR_IPV4) {
 		addr_len = 4;
 
 		/* atyp(1) + ipv4_addrlen(4) + port(2) */
-		if (ln->text_len < 7) {
+		if (ln->up.len < 1 + addr_len + 2)
 			goto too_short;
-		}
-
-		hint.ai_family = AF_INET;
 
-		if (inet_ntop(AF_INET, req->dst, addr, sizeof(addr)) == NULL) {
-			sock_warn(sockfd, "%s: inet_ntop() %s",
-				  __func__, strerror(errno));
-			return -1;
-		}
-
-		port = ntohs(*(unsigned short *)(req->dst + addr_len));
+		memset(sa, 0, sizeof(*sa));
+		sa->in.sin_family = AF_INET;
+		memcpy(&sa->in.sin_addr, req->dst, addr_len);
+		memcpy(&sa->in.sin_port, req->dst + addr_len, 2);
+		port = ntohs(sa->in.sin_port);
 	} else if (atyp == SOCKS5_ADDR_DOMAIN) {
-		addr_len = req->dst[0];
+		addr_len = (unsigned char)req->dst[0];
 
 		/* atyp(1) + addr_size(1) + domain_len(addr_len) + port(2) */
-		if (ln->text_len < 1 + 1 + addr_len + 2)
+		if (ln->up.len < 1 + 1 + addr_len + 2)
 			goto too_short;
 
-		hint.ai_family = AF_UNSPEC;
-		strncpy(addr, req->dst + 1, addr_len);
+		memcpy(addr, req->dst + 1, addr_len);
 		addr[addr_len] = '\0';
-		port = ntohs(*(unsigned short *)(req->dst + addr_len + 1));
+		memcpy(&port, req->dst + addr_len + 1, 2);
+		port = ntohs(port);
 		/* to compute the right data length(except header) */
 		addr_len += 1;
 	} else if (atyp == SOCKS5_ADDR_IPV6) {
-		hint.ai_family = AF_INET6;
 		addr_len = 16;
 
-		if (inet_ntop(AF_INET6, req->dst, addr, sizeof(addr)) == NULL) {
-			sock_warn(sockfd, "%s: inet_ntop() %s",
-				  __func__, strerror(errno));
-			return -1;
-		}
+		/* atyp(1) + ipv6_addrlen(16) + port(2) */
+		if (ln->up.len < 1 + addr_len + 2)
+			goto too_short;
 
-		port = ntohs(*(unsigned short *)(req->dst + addr_len));
+		memset(sa, 0, sizeof(*sa));
+		sa->in6.sin6_family = AF_INET6;
+		memcpy(&sa->in6.sin6_addr, req->dst, addr_len);
+		memcpy(&sa->in6.sin6_port, req->dst + addr_len, 2);
+		port = ntohs(sa->in6.sin6_port);
 	} else {
-		sock_warn(sockfd, "%s: ATYP(%d) isn't legal");
+		sock_warn(sockfd, "%s: ATYP(%d) isn't legal", __func__, atyp);
 		return -1;
 	}
 
-	sock_info(sockfd, "%s: remote address: %s; port: %d",
-		  __func__, addr, port);
-	sprintf(port_str, "%d", port);
-	ret = getaddrinfo(addr, port_str, &hint, &res);
-	if (ret != 0) {
-		sock_warn(sockfd, "getaddrinfo error: %s", gai_strerror(ret));
-		return -1;
+	/* only pay for the text if it's logged */
+	if (setlogmask(0) & LOG_MASK(LOG_INFO)) {
+		if (atyp != SOCKS5_ADDR_DOMAIN)
+			sockaddr_str(sa, addr, sizeof(addr));
+
+		sock_info(sockfd, "%s: remote address: %s; port: %d",
+			  __func__, addr, port);
 	}
 
 	if (ln->state & SS_UDP) {
-		ln->ss_header_len = ln->text_len;
+		ln->ss_header_len = ln->up.len;
 	} else {
 		ln->ss_header_len = 1 + addr_len + 2;
-		if (rm_data(sockfd, ln, "text", ln->ss_header_len) == -1)
+		if (rm_data(sockfd, &ln->up, ln->ss_header_len) == -1)
 			return -1;
 	}
 
-	ln->server = res;
+	if (atyp != SOCKS5_ADDR_DOMAIN) {
+		ln->server_naddrs = 1;
+		return connect_server(sockfd);
+	}
 
-	if (connect_server(sockfd) == -1)
+	n = dns_cache_get(addr, AF_UNSPEC, addrs, DNS_CACHE_MAX_ADDRS);
+	if (n == 0) {
+		sock_warn(sockfd, "%s: %s doesn't exist(cached)",
+			  __func__, addr);
+		return -1;
+	} else if (n > 0) {
+		for (i = 0; i < n; i++) {
+			if (addrs[i].sa.sa_family == AF_INET)
+				addrs[i].in.sin_port = htons(port);
+			else
+				addrs[i].in6.sin6_port = htons(port);
+		}
+
+		link_set_addrs(ln, addrs, n);
+		return connect_server(sockfd);
+	}
+
+	/* a lookup mustn't hold up the loop, the link connects when
+	 * the answer comes */
+	sprintf(port_str, "%d", port);
+	if (resolve_start(ln, addr, port_str, socktype) == -1) {
+		sock_warn(sockfd, "%s: resolve_start() failed", __func__);
 		return -1;
+	}
 
+	ln->state |= SS_RESOLVING;
 	return 0;
 
 too_short:
@@ -955,13 +2103,13 @@ int check_socks5_auth_header(int sockfd, struct link *ln)
 	unsigned short i;
 	struct socks5_auth_request *req;
 
-	if (ln->text_len < 3) {
+	if (ln->up.len < 3) {
 		sock_warn(sockfd, "%s: text len is smaller than auth request",
 			  __func__);
 		return -1;
 	}
 
-	req = (void *)ln->text;
+	req = (void *)buf_ptr(&ln->up);
 
 	if (req->ver != 0x05) {
 		sock_warn(sockfd, "%s: VER(%d) is not 5",
@@ -970,7 +2118,7 @@ int check_socks5_auth_header(int sockfd, struct link *ln)
 	}
 
 	i = req->nmethods;
-	if ((i + 2) != ln->text_len) {
+	if ((i + 2) != ln->up.len) {
 		sock_warn(sockfd, "%s: NMETHODS(%d) isn't correct",
 			  __func__, i);
 		return -1;
@@ -990,7 +2138,7 @@ int check_socks5_cmd_header(int sockfd, struct link *ln)
 	int ss_header_len;
 	struct socks5_cmd_request *req;
 
-	req = (void *)ln->text;
+	req = (void *)buf_ptr(&ln->up);
 
 	if (req->ver != 0x05) {
 		sock_warn(sockfd, "%s: VER(%d) is not 5",
@@ -1024,20 +2172,20 @@ int check_socks5_cmd_header(int sockfd, struct link *ln)
 		/* atyp(1) + ipv4(4) + port(2) */
 		ss_header_len = 1 + 4 + 2;
 
-		if (ln->text_len < ss_header_len + 3)
+		if (ln->up.len < ss_header_len + 3)
 			goto too_short;
 	} else if (atyp == SOCKS5_ADDR_DOMAIN) {
 		/* atyp(1) + addr_size(1) + domain_length(req->dst[0]) +
 		 * port(2) */
 		ss_header_len = 1 + 1 + req->dst[0] + 2;
 
-		if (ln->text_len < ss_header_len + 3)
+		if (ln->up.len < ss_header_len + 3)
 			goto too_short;
 	} else if (atyp == SOCKS5_ADDR_IPV6) {
 		/* atyp(1) + ipv6_addrlen(16) + port(2) */
 		ss_header_len = 1 + 16 + 2;
 
-		if (ln->text_len < ss_header_len + 3)
+		if (ln->up.len < ss_header_len + 3)
 			goto too_short;
 	} else {
 		sock_warn(sockfd, "%s: ATYP(%d) isn't legal");
@@ -1046,14 +2194,12 @@ int check_socks5_cmd_header(int sockfd, struct link *ln)
 
 	ln->ss_header_len = ss_header_len;
 
-	/* remove VER, CMD, RSV for shadowsocks protocol */
-	if (rm_data(sockfd, ln, "text", 3) == -1)
+	/* remove VER, CMD, RSV for shadowsocks protocol, the ss tcp
+	 * header left at the head of ln->up will be encrypted and
+	 * sent together with data received from local */
+	if (rm_data(sockfd, &ln->up, 3) == -1)
 		return -1;
 
-        /* copy ss tcp header to cipher buffer, it will be sent
-	 * together with data received from local */
-	memcpy(ln->cipher, ln->text, ln->ss_header_len);
-
 	/* all seem okay, connect to server! */
 	if (connect_server(sockfd) == -1)
 		return -1;
@@ -1077,9 +2223,7 @@ int create_socks5_auth_reply(int sockfd, struct link *ln, bool ok)
 	else
 		rep.method = SOCKS5_METHOD_ERROR;
 
-	ln->text_len = 0;
-
-	if (add_data(sockfd, ln, "text", (void *)&rep, sizeof(rep)) == -1)
+	if (add_data(sockfd, &ln->down, (void *)&rep, sizeof(rep)) == -1)
 		return -1;
 
 	return 0;
@@ -1091,9 +2235,10 @@ int create_socks5_cmd_reply(int sockfd, struct link *ln, int cmd)
 	void *addrptr;
 	int addr_len;
 	struct sockaddr_storage ss_addr;
-	int len = sizeof(struct sockaddr_storage);
-	struct addrinfo *ai = ln->server;
-	struct socks5_cmd_reply *rep = (void *)ln->text;
+	int i, len = sizeof(struct sockaddr_storage);
+	union ss_sockaddr *sa = NULL;
+	char rep_buf[sizeof(struct socks5_cmd_reply) + 16 + 2];
+	struct socks5_cmd_reply *rep = (void *)rep_buf;
 
 	rep->ver = 0x05;
 	rep->rep = cmd;
@@ -1106,114 +2251,191 @@ int create_socks5_cmd_reply(int sockfd, struct link *ln, int cmd)
 		return -1;
 	}
 
-	while (ai) {
-		if (ai->ai_family == ss_addr.ss_family) {
-			if (ai->ai_family == AF_INET) {
-				rep->atyp = SOCKS5_ADDR_IPV4;
-				port = ((SA_IN *)ai->ai_addr)->sin_port;
-				addrptr = &((SA_IN *)ai->ai_addr)->sin_addr;
-				addr_len = sizeof(struct in_addr);
-			} else {
-				rep->atyp = SOCKS5_ADDR_IPV6;
-				port = ((SA_IN6 *)ai->ai_addr)->sin6_port;
-				addrptr = &((SA_IN6 *)ai->ai_addr)->sin6_addr;
-				addr_len = sizeof(struct in6_addr);
-			}
-
+	for (i = 0; i < ln->server_naddrs; i++) {
+		if (ln->server_addrs[i].sa.sa_family == ss_addr.ss_family) {
+			sa = &ln->server_addrs[i];
 			break;
 		}
-
-		ai = ai->ai_next;
 	}
 
-	if (ai == NULL)
+	if (sa == NULL)
 		return -1;
 
+	if (sa->sa.sa_family == AF_INET) {
+		rep->atyp = SOCKS5_ADDR_IPV4;
+		port = sa->in.sin_port;
+		addrptr = &sa->in.sin_addr;
+		addr_len = sizeof(struct in_addr);
+	} else {
+		rep->atyp = SOCKS5_ADDR_IPV6;
+		port = sa->in6.sin6_port;
+		addrptr = &sa->in6.sin6_addr;
+		addr_len = sizeof(struct in6_addr);
+	}
+
 	memcpy(rep->bnd, addrptr, addr_len);
 	memcpy(rep->bnd + addr_len, (void *)&port, sizeof(short));
 
 	len = sizeof(*rep) + addr_len + 2;
-	ln->text_len = 0;
-	if (add_data(sockfd, ln, "text", (void *)rep, len) == -1)
+	if (add_data(sockfd, &ln->down, (void *)rep, len) == -1)
 		return -1;
 
 	return 0;
 }
 
-int do_read(int sockfd, struct link *ln, const char *type, int offset)
+/**
+ * do_read - append what can be read from sockfd to the tail of buf
+ *
+ * At most buf_data_size bytes are kept in buf, the headroom and the
+ * tailroom are left for encryption to grow the data in place. With
+ * io_uring the recv() is queued for poll_flush() instead, and what it
+ * read is taken from the POLLIN event made up for it.
+ */
+int do_read(int sockfd, struct link *ln, struct ss_buf *buf)
 {
 	int ret, len;
-	char *buf;
-
-	if (strcmp(type, "text") == 0) {
-		buf = ln->text + offset;
-		len = TEXT_BUF_SIZE - offset;
-	} else if (strcmp(type, "cipher") == 0) {
-		buf = ln->cipher + offset;
-		/* cipher read only accept text buffer length data, or
-		 * it may overflow text buffer */
-		len = TEXT_BUF_SIZE - offset;
-	} else {
-		sock_warn(sockfd, "%s: unknown type %s",
-			  __func__, type);
+
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING) {
+		switch (uring_recv_result(sockfd, &ret)) {
+		case URING_OP_IDLE:
+			break;
+		case URING_OP_DONE:
+			goto done;
+		default:
+			/* not there yet, buf is left as it is */
+			return -1;
+		}
+	}
+#endif
+
+	/* a partial aead chunk kept by the last decryption gets
+	 * completed by what's read now */
+	buf->len += buf->rest;
+	buf->rest = 0;
+
+	len = buf_data_size - buf->len;
+	if (len <= 0) {
+		sock_warn(sockfd, "%s: buffer is full", __func__);
+		return -2;
+	}
+
+	if (buf_get(buf) == -1)
 		return -2;
+
+	if (buf->len == 0) {
+		buf_reset(buf);
+	} else if (buf->head + buf->len + len + buf_tailroom > buf->size) {
+		/* only after many partial reads, give the consumed
+		 * space at the head back */
+		memmove(buf->data + BUF_HEADROOM, buf_ptr(buf), buf->len);
+		buf->head = BUF_HEADROOM;
 	}
 
-	ret = recv(sockfd, buf, len, 0);
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING &&
+	    uring_queue_recv(sockfd, buf_ptr(buf) + buf->len, len) == 0)
+		return -1;
+#endif
+
+	ret = recv(sockfd, buf_ptr(buf) + buf->len, len, 0);
+#ifdef HAVE_IO_URING
+done:
+#endif
 	if (ret == -1) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			sock_info(sockfd, "%s(%s): recv() %s",
-				  __func__, type, strerror(errno));
+			sock_info(sockfd, "%s: recv() %s",
+				  __func__, strerror(errno));
 			return -2;
 		}
 
+		buf_put(buf);
 		poll_add(sockfd, POLLIN);
 		return -1;
 	} else if (ret == 0) {
 		/* recv() returned 0 means the peer has shut down,
 		 * return -2 to let the caller do the closing work */
-		sock_debug(sockfd, "%s(%s): the peer has shut down",
-			   __func__, type);
+		sock_debug(sockfd, "%s: the peer has shut down",
+			   __func__);
 		return -2;
 	}
 
-	if (strcmp(type, "text") == 0) {
-		ln->text_len = ret + offset;
-	} else if (strcmp(type, "cipher") == 0) {
-		ln->cipher_len = ret + offset;
-	}
+	buf->len += ret;
 
-	ln->time = time(NULL);
-	sock_debug(sockfd, "%s(%s): recv(%d), offset(%d)",
-		   __func__, type, ret, offset);
+	link_touch(ln);
+	sock_debug(sockfd, "%s: recv(%d), buffered(%d)",
+		   __func__, ret, buf->len);
 	pr_link_debug(ln);
 
 	return ret;
 }
 
-int do_send(int sockfd, struct link *ln, const char *type, int offset)
+/**
+ * do_send - send what's in buf to sockfd
+ *
+ * buf->pre(the iv of the first packet) and the data go out in one
+ * sendmsg() without being copied together. Whatever is sent is
+ * consumed, pre first, on a partial send the rest stays and POLLOUT
+ * is added for the pollout handler to retry. With io_uring the
+ * sendmsg() is queued for poll_flush() and -1 returned, the pollout
+ * handler gets what was sent from the POLLOUT event made up for it.
+ *
+ * Until an attempt wins, server_sockfd is only one standing in, see
+ * connect_server(). Nothing is sent on it, one which is refused would
+ * take the link down with it while the others may still connect,
+ * -1 is returned and connect_won() adds POLLOUT to the winner.
+ */
+int do_send(int sockfd, struct link *ln, struct ss_buf *buf)
 {
-	int ret, len;
-	char *buf;
-
-	if (strcmp(type, "text") == 0) {
-		buf = ln->text + offset;
-		len = ln->text_len - offset;
-	} else if (strcmp(type, "cipher") == 0) {
-		buf = ln->cipher + offset;
-		len = ln->cipher_len - offset;
-	} else {
-		sock_warn(sockfd, "%s: unknown type %s",
-			  __func__, type);
-		return -2;
+	int ret, len, n;
+	int iovcnt = 0;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	if (sockfd == ln->server_sockfd && !(ln->state & SERVER))
+		return -1;
+
+	if (buf->pre_len > 0) {
+		iov[iovcnt].iov_base = buf->pre;
+		iov[iovcnt].iov_len = buf->pre_len;
+		iovcnt++;
 	}
 
-	ret = send(sockfd, buf, len, 0);
+	iov[iovcnt].iov_base = buf_ptr(buf);
+	iov[iovcnt].iov_len = buf->len;
+	iovcnt++;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	len = buf->pre_len + buf->len;
+
+#ifdef HAVE_IO_URING
+	if (backend == POLL_BACKEND_URING) {
+		switch (uring_send_result(sockfd, &ret)) {
+		case URING_OP_IDLE:
+			if (uring_queue_send(sockfd, iov, iovcnt) == 0)
+				return -1;
+
+			break;
+		case URING_OP_DONE:
+			goto sent;
+		default:
+			return -1;
+		}
+	}
+#endif
+
+	ret = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+#ifdef HAVE_IO_URING
+sent:
+#endif
 	if (ret == -1) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK &&
-		    errno != ENOTCONN && errno != EPIPE) {
-			sock_warn(sockfd, "%s(%s): send() %s",
-				  __func__, type, strerror(errno));
+		    errno != ENOTCONN) {
+			sock_warn(sockfd, "%s: sendmsg() %s",
+				  __func__, strerror(errno));
 			return -2;
 		} else {
 			/* wait for unblocking send, or wait for
@@ -1223,20 +2445,24 @@ int do_send(int sockfd, struct link *ln, const char *type, int offset)
 		}
 	}
 
-	if (rm_data(sockfd, ln, type, ret) == -1)
+	n = ret < buf->pre_len ? ret : buf->pre_len;
+	buf->pre += n;
+	buf->pre_len -= n;
+
+	if (rm_data(sockfd, buf, ret - n) == -1)
 		return -2;
 
-	ln->time = time(NULL);
+	link_touch(ln);
 
 	if (ret != len) {
 		poll_add(sockfd, POLLOUT);
-		sock_debug(sockfd, "%s(%s): send() partial send(%d/%d)",
-			   __func__, type, ret, len);
+		sock_debug(sockfd, "%s: sendmsg() partial send(%d/%d)",
+			   __func__, ret, len);
 		return -1;
 	}
-		
-	sock_debug(sockfd, "%s(%s): send(%d), offset(%d)",
-		   __func__, type, ret, offset);
+
+	buf_put(buf);
+	sock_debug(sockfd, "%s: send(%d)", __func__, ret);
 	pr_link_debug(ln);
 
 	return ret;
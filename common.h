@@ -22,16 +22,50 @@
 #define SA_IN6 struct sockaddr_in6
 #define SS struct sockaddr_storage
 
+/* an ipv4 or ipv6 address, without the size of sockaddr_storage */
+union ss_sockaddr {
+	SA sa;
+	SA_IN in;
+	SA_IN6 in6;
+};
+
 #define TCP_INACTIVE_TIMEOUT 120
 #define TCP_CONNECT_TIMEOUT 15
+/* RFC 8305 connection attempt delay, in milliseconds */
+#define CONNECT_ATTEMPT_DELAY 250
+/* power of 2, bigger than the longest timeout in seconds */
+#define TIMER_WHEEL_SLOTS 256
 #define DEFAULT_MAX_CONNECTION 1024
+/* upper bound of the fd tables, whatever RLIMIT_NOFILE says */
+#define MAX_FDS (1024 * 1024)
+#define MAX_LISTENFD 4
+/* connections accepted per listening sockfd per loop round */
+#define ACCEPT_BATCH 64
+/* seconds a listening sockfd rests after running out of fds or memory */
+#define ACCEPT_RETRY 1
+/* objects the link and buffer pools grow by */
+#define LINK_SLAB_OBJS 64
+#define BUF_SLAB_OBJS 16
 #define TEXT_BUF_SIZE (1024 * 8)
-#define CIPHER_BUF_SIZE (TEXT_BUF_SIZE + EVP_MAX_BLOCK_LENGTH + \
-			 EVP_MAX_IV_LENGTH)
+/* room reserved in front of the data, enough for a socks5 reply or
+ * udp header to be prepended without moving the data */
+#define BUF_HEADROOM 32
 #define MAX_DOMAIN_LEN 255
 #define MAX_PORT_STRING_LEN 5
 #define MAX_PWD_LEN 16
-#define MAX_METHOD_NAME_LEN 16
+#define MAX_METHOD_NAME_LEN 32
+/* iv of stream methods, or salt of aead methods */
+#define MAX_IV_LEN 32
+/* payload of an aead chunk, the length is 14 bits */
+#define MIN_CHUNK_SIZE 1024
+#define MAX_CHUNK_SIZE 0x3fff
+#define MAX_EVENT_NAME_LEN 8
+/* ipv4:port */
+#define MAX_NAMESERVER_LEN 21
+#define MAX_PATH_LEN 255
+#define MAX_POLL_EVENTS 256
+/* addresses of the server a link keeps, the first ones of a lookup */
+#define MAX_SERVER_ADDRS 4
 
 struct ss_option {
 	char server_addr[MAX_DOMAIN_LEN + 1];
@@ -40,6 +74,17 @@ struct ss_option {
 	char local_port[MAX_PORT_STRING_LEN + 1];
 	char password[MAX_PWD_LEN + 1];
 	char method[MAX_METHOD_NAME_LEN + 1];
+	char event[MAX_EVENT_NAME_LEN + 1];
+	int chunk_size;
+	int max_conn;
+	int mem_budget;
+	int workers;
+	int resolvers;
+	char nameserver[MAX_NAMESERVER_LEN + 1];
+	int dns_cache;
+	char dns_file[MAX_PATH_LEN + 1];
+	int preconnect;
+	bool affinity;
 	bool daemon;
 };
 
@@ -48,9 +93,7 @@ struct ss_option {
 enum link_state {
 	LOCAL = BITS(1),
 	SERVER = BITS(2),
-	LOCAL_READ_PENDING = BITS(3),
 	LOCAL_SEND_PENDING = BITS(4),
-	SERVER_READ_PENDING = BITS(5),
 	SERVER_SEND_PENDING = BITS(6),
 	SOCKS5_AUTH_REQUEST_RECEIVED = BITS(7),
 	SOCKS5_AUTH_REPLY_SENT = BITS(8),
@@ -61,29 +104,87 @@ enum link_state {
 	SS_IV_SENT = BITS(13),
 	SS_IV_RECEIVED = BITS(14),
 	SS_UDP = BITS(15),
+	/* waiting for the address of the ss header, see resolve.c */
+	SS_RESOLVING = BITS(16),
 };
 
 #define	LINKED (LOCAL | SERVER)
-#define LOCAL_PENDING (LOCAL_READ_PENDING | LOCAL_SEND_PENDING)
-#define SERVER_PENDING (SERVER_READ_PENDING | SERVER_SEND_PENDING)
+
+/* valid data is data[head, head + len), size is what's allocated */
+struct ss_buf {
+	char *data;
+	int head;
+	int len;
+	int size;
+	/* sent in front of data without being copied into it */
+	char *pre;
+	int pre_len;
+	/* right behind data, an aead chunk not completely read yet */
+	int rest;
+};
 
 struct link {
 	enum link_state state;
-	time_t time;
+	time_t expire;
+	int timer_slot;
+	struct link *timer_prev;
+	struct link *timer_next;
 	int local_sockfd;
 	int server_sockfd;
-	int text_len;
-	int cipher_len;
 	int ss_header_len;
-	EVP_CIPHER_CTX *local_ctx;
-	EVP_CIPHER_CTX *server_ctx;
-	struct addrinfo *server;
-	void *text;
-	void *cipher;
-	char local_iv[EVP_MAX_IV_LENGTH];
-	char server_iv[EVP_MAX_IV_LENGTH];
+	/* see crypto_ctx_get() */
+	void *local_ctx;
+	void *server_ctx;
+	/* where server_sockfd connects to, port included */
+	union ss_sockaddr server_addrs[MAX_SERVER_ADDRS];
+	int server_naddrs;
+	/* connect() attempts in flight, one per address, server_sockfd
+	 * is one of them until the first wins, see connect_server() */
+	int conn_fds[MAX_SERVER_ADDRS];
+	int nattempts;
+	int next_addr;
+	/* when the next address gets its turn, 0 if it isn't queued */
+	long long attempt_ms;
+	struct link *attempt_prev;
+	struct link *attempt_next;
+	/* the lookup in flight while SS_RESOLVING */
+	struct resolve_req *resolve;
+	/* local to server, en/decrypted in place */
+	struct ss_buf up;
+	/* server to local, en/decrypted in place */
+	struct ss_buf down;
+	char local_iv[MAX_IV_LEN];
+	char server_iv[MAX_IV_LEN];
+	/* aead nonces of local_ctx and server_ctx */
+	unsigned long long local_nonce;
+	unsigned long long server_nonce;
 };
 
+/* where data read from sockfd goes */
+static inline struct ss_buf *link_in(struct link *ln, int sockfd)
+{
+	return sockfd == ln->local_sockfd ? &ln->up : &ln->down;
+}
+
+/* where data sent to sockfd comes from */
+static inline struct ss_buf *link_out(struct link *ln, int sockfd)
+{
+	return sockfd == ln->local_sockfd ? &ln->down : &ln->up;
+}
+
+static inline char *buf_ptr(struct ss_buf *buf)
+{
+	return buf->data + buf->head;
+}
+
+/* drop everything and give the headroom back */
+static inline void buf_reset(struct ss_buf *buf)
+{
+	buf->head = BUF_HEADROOM;
+	buf->len = 0;
+	buf->rest = 0;
+}
+
 #define SOCKS5_METHOD_NOT_REQUIRED 0x00
 #define SOCKS5_METHOD_ERROR 0XFF
 
@@ -131,17 +232,28 @@ struct socks5_udp_header {
 	char dst[];
 };
 
+/* one ready sockfd returned by poll_wait() */
+struct poll_event {
+	int fd;
+	short revents;
+};
+
 struct ss_header {
 	 char atyp;
 	 char dst[];
 };
 
 extern int nfds;
+extern int nlinks;
+extern size_t link_mem;
 extern struct pollfd *clients;
 extern struct ss_option ss_opt;
 extern struct link **link_head;
+extern time_t current_time;
 
 void check_ss_option(int argc, char **argv, const char *type);
+socklen_t sockaddr_len(union ss_sockaddr *sa);
+const char *sockaddr_str(union ss_sockaddr *sa, char *str, int len);
 void pr_data(FILE *fp, const char *name, char *data, int len);
 void pr_link_debug(struct link *ln);
 void pr_link_info(struct link *ln);
@@ -152,21 +264,29 @@ int poll_set(int sockfd, short events);
 int poll_add(int sockfd, short events);
 int poll_rm(int sockfd, short events);
 int poll_del(int sockfd);
+int poll_wait(struct poll_event *events, int maxevents, int timeout);
+int poll_flush(struct poll_event *events, int maxevents);
+void time_update(void);
+void link_touch(struct link *ln);
+int timer_timeout(void);
 void reaper(void);
 struct link *create_link(int sockfd, const char *type);
 struct link *get_link(int sockfd);
 void destroy_link(int sockfd);
+int do_accept(int listenfd);
 int do_listen(struct addrinfo *info, const char *type);
+void link_set_addrs(struct link *ln, union ss_sockaddr *addrs, int n);
+int link_set_server(struct link *ln, struct addrinfo *ai);
 int connect_server(int sockfd);
-int add_data(int sockfd, struct link *ln,
-	     const char *type, char *data, int size);
-int rm_data(int sockfd, struct link *ln, const char *type, int size);
+int connect_done(int sockfd, struct link *ln);
+int add_data(int sockfd, struct ss_buf *buf, char *data, int size);
+int rm_data(int sockfd, struct ss_buf *buf, int size);
 int check_ss_header(int sockfd, struct link *ln);
 int check_socks5_auth_header(int sockfd, struct link *ln);
 int check_socks5_cmd_header(int sockfd, struct link *ln);
 int create_socks5_auth_reply(int sockfd, struct link *ln, bool ok);
 int create_socks5_cmd_reply(int sockfd, struct link *ln, int cmd);
-int do_read(int sockfd, struct link *ln, const char *type, int offset);
-int do_send(int sockfd, struct link *ln, const char *type, int offset);
+int do_read(int sockfd, struct link *ln, struct ss_buf *buf);
+int do_send(int sockfd, struct link *ln, struct ss_buf *buf);
 
 #endif
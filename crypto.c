@@ -4,59 +4,789 @@
  * it under the terms of the MIT license. See COPYING for details.
  */
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <netdb.h>
 #include <openssl/bio.h>
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/kdf.h>
 #include <openssl/rand.h>
 
+#include "aes.h"
+#include "chacha.h"
 #include "common.h"
 #include "crypto.h"
+#include "pool.h"
+
+/* the built-in ciphers a method can also run on */
+enum builtin_cipher {
+	BUILTIN_NONE,
+	/* aes.c */
+	BUILTIN_AES_CFB,
+	/* chacha.c */
+	BUILTIN_CHACHA20,
+};
+
+struct ss_method {
+	const char *name;
+	/* what openssl calls it */
+	const char *evp_name;
+	enum builtin_cipher builtin;
+	int key_len;
+	/* the salt of an aead method, as long as its key */
+	int iv_len;
+	bool aead;
+};
+
+/**
+ * struct crypto_engine - what runs the cipher of a method
+ *
+ * Several engines may run the same method, crypto_init() keeps the
+ * fastest one of those that pass the self-test on this cpu, see
+ * select_engine().
+ */
+struct crypto_engine {
+	const char *name;
+	/* the chacha20 kernel of the built-in chacha20 engines */
+	const char *kernel;
+	/* whether it can run cur_method here */
+	bool (*supports)(const struct crypto_engine *e);
+	/* of a link context, 0 for an EVP_CIPHER_CTX */
+	size_t ctx_size;
+	/* expand the key into the templates */
+	int (*init)(const struct crypto_engine *e);
+	/* free what init() allocated, may be NULL */
+	void (*exit)(void);
+	/* start a link context on a new stream */
+	int (*ctx_init)(void *ctx, const char *iv, bool enc);
+	/* en/decrypt buf in place, nonce is the counter of an aead
+	 * stream */
+	int (*encrypt)(void *ctx, unsigned long long *nonce,
+		       struct ss_buf *buf);
+	int (*decrypt)(void *ctx, unsigned long long *nonce,
+		       struct ss_buf *buf);
+};
 
 int iv_len;
-static const EVP_CIPHER *evp_cipher;
+static const struct ss_method *cur_method;
+static const struct crypto_engine *engine;
 static const EVP_MD *md;
 static char key[EVP_MAX_KEY_LENGTH];
 static int key_len;
+/* the key schedule, expanded once, links copy it and set their iv */
+static const EVP_CIPHER *evp_cipher;
+static EVP_CIPHER_CTX *enc_tmpl;
+static EVP_CIPHER_CTX *dec_tmpl;
+static struct chacha20_ctx chacha_tmpl;
+static struct aes_key aes_key;
+
+/* ivs generated in bulk, handed out from the top of the pool, the
+ * used ones below iv_avail are refilled when the loop is idle */
+static unsigned char iv_pool[IV_POOL_SIZE * MAX_IV_LEN];
+static int iv_avail;
+static bool iv_atfork;
 
-static const char supported_method[][MAX_METHOD_NAME_LEN] = {
-	"aes-128-cfb",
-	"aes-192-cfb",
-	"aes-256-cfb",
-	"bf-cfb",
-	/* "camellia-128-cfb", */
-	/* "camellia-192-cfb", */
-	/* "camellia-256-cfb", */
-	"cast5-cfb",
-	"des-cfb",
-	/* "idea-cfb", */
-	"rc2-cfb",
-	"rc4",
-	"seed-cfb",
-	/* "salsa20-ctr", */
+/* cipher contexts are opaque to us, so they are kept in a stack of
+ * their own and recycled with EVP_CIPHER_CTX_reset() */
+static EVP_CIPHER_CTX **ctx_free;
+static int ctx_nfree;
+static int ctx_nobjs;
+static unsigned long ctx_hits;
+static unsigned long ctx_misses;
+/* the built-in engines have plain structs for contexts, the size is
+ * set by crypto_init() */
+static struct pool builtin_pool = POOL_INIT("builtin cipher ctx", 0,
+					    CTX_SLAB_OBJS);
+
+/* the stream ciphers(block size 1) run in place and cipher text is as
+ * long as plain text, the aead ones are sent in length prefixed
+ * chunks, see aead_encrypt() */
+static const struct ss_method supported_method[] = {
+	{"aes-128-cfb", "aes-128-cfb", BUILTIN_AES_CFB, 16, 16, false},
+	{"aes-192-cfb", "aes-192-cfb", BUILTIN_AES_CFB, 24, 16, false},
+	{"aes-256-cfb", "aes-256-cfb", BUILTIN_AES_CFB, 32, 16, false},
+	{"aes-128-ctr", "aes-128-ctr", BUILTIN_NONE, 16, 16, false},
+	{"aes-192-ctr", "aes-192-ctr", BUILTIN_NONE, 24, 16, false},
+	{"aes-256-ctr", "aes-256-ctr", BUILTIN_NONE, 32, 16, false},
+	{"bf-cfb", "bf-cfb", BUILTIN_NONE, 16, 8, false},
+	{"camellia-128-cfb", "camellia-128-cfb", BUILTIN_NONE, 16, 16, false},
+	{"camellia-192-cfb", "camellia-192-cfb", BUILTIN_NONE, 24, 16, false},
+	{"camellia-256-cfb", "camellia-256-cfb", BUILTIN_NONE, 32, 16, false},
+	{"cast5-cfb", "cast5-cfb", BUILTIN_NONE, 16, 8, false},
+	{"des-cfb", "des-cfb", BUILTIN_NONE, 8, 8, false},
+	/* {"idea-cfb", "idea-cfb", BUILTIN_NONE, 16, 8, false}, */
+	{"rc2-cfb", "rc2-cfb", BUILTIN_NONE, 16, 8, false},
+	{"rc4", "rc4", BUILTIN_NONE, 16, 0, false},
+	{"seed-cfb", "seed-cfb", BUILTIN_NONE, 16, 16, false},
+	/* {"salsa20-ctr", "salsa20-ctr", BUILTIN_NONE, 32, 8, false}, */
+	{"chacha20-ietf", "chacha20", BUILTIN_CHACHA20, 32, 12, false},
+	{"aes-128-gcm", "aes-128-gcm", BUILTIN_NONE, 16, 16, true},
+	{"aes-256-gcm", "aes-256-gcm", BUILTIN_NONE, 32, 32, true},
+	{"chacha20-ietf-poly1305", "chacha20-poly1305", BUILTIN_NONE,
+	 32, 32, true},
 };
 
+#define NR_METHODS (sizeof(supported_method) / sizeof(supported_method[0]))
+
+/* the i-th supported method, NULL after the last one */
+const char *crypto_method(int i)
+{
+	if (i < 0 || i >= NR_METHODS)
+		return NULL;
+
+	return supported_method[i].name;
+}
+
+static const struct ss_method *find_method(const char *method)
+{
+	int i;
+
+	for (i = 0; i < NR_METHODS; i++)
+		if (strcmp(supported_method[i].name, method) == 0)
+			return &supported_method[i];
+
+	return NULL;
+}
+
+bool crypto_aead(void)
+{
+	return cur_method && cur_method->aead;
+}
+
+/* data a link buffer must hold, a whole aead chunk from the peer has
+ * to fit, whatever chunk size it uses */
+int crypto_buf_size(void)
+{
+	if (crypto_aead() &&
+	    MAX_CHUNK_SIZE + AEAD_CHUNK_OVERHEAD > TEXT_BUF_SIZE)
+		return MAX_CHUNK_SIZE + AEAD_CHUNK_OVERHEAD;
+
+	return TEXT_BUF_SIZE;
+}
+
+/* room behind size bytes of plain text for it to be sealed in place,
+ * the length block of the first chunk goes into the headroom */
+int crypto_tailroom(int size)
+{
+	if (!crypto_aead())
+		return 0;
+
+	return (size / ss_opt.chunk_size + 1) * AEAD_CHUNK_OVERHEAD;
+}
+
+/* EVP_BytesToKey() with md5, no salt and one round, which is how
+ * every method gets its key from the password */
+static int bytes_to_key(const char *password, unsigned char *out, int len)
+{
+	int n, ret = -1;
+	unsigned int d_len = 0;
+	unsigned char d[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *mdctx;
+
+	mdctx = EVP_MD_CTX_new();
+	if (mdctx == NULL)
+		return -1;
+
+	for (n = 0; n < len; n += d_len) {
+		if (EVP_DigestInit_ex(mdctx, md, NULL) != 1 ||
+		    (n > 0 && EVP_DigestUpdate(mdctx, d, d_len) != 1) ||
+		    EVP_DigestUpdate(mdctx, password, strlen(password)) != 1 ||
+		    EVP_DigestFinal_ex(mdctx, d, &d_len) != 1)
+			goto out;
+
+		memcpy(out + n, d, len - n < d_len ? len - n : d_len);
+	}
+
+	ret = 0;
+out:
+	EVP_MD_CTX_free(mdctx);
+	return ret;
+}
+
+/* subkey = HKDF-SHA1(key, salt, "ss-subkey"), one per aead stream */
+static int derive_subkey(const char *salt, unsigned char *subkey)
+{
+	int ret = -1;
+	size_t len = key_len;
+	EVP_PKEY_CTX *pctx;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (pctx == NULL)
+		return -1;
+
+	if (EVP_PKEY_derive_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha1()) <= 0 ||
+	    EVP_PKEY_CTX_set1_hkdf_salt(pctx, (void *)salt, iv_len) <= 0 ||
+	    EVP_PKEY_CTX_set1_hkdf_key(pctx, (void *)key, key_len) <= 0 ||
+	    EVP_PKEY_CTX_add1_hkdf_info(pctx, (void *)AEAD_SUBKEY_INFO,
+					strlen(AEAD_SUBKEY_INFO)) <= 0 ||
+	    EVP_PKEY_derive(pctx, subkey, &len) <= 0)
+		goto out;
+
+	ret = 0;
+out:
+	EVP_PKEY_CTX_free(pctx);
+	return ret;
+}
+
+/**
+ * aead_op - seal or open one message of len bytes in place
+ *
+ * The nonce is the little endian counter n, the tag goes to or comes
+ * from tag. in and out may be the same.
+ */
+static int aead_op(EVP_CIPHER_CTX *ctx, unsigned long long n,
+		   unsigned char *out, unsigned char *in, int len,
+		   unsigned char *tag, bool enc)
+{
+	int i, outl;
+	unsigned char nonce[AEAD_NONCE_LEN] = {0};
+
+	for (i = 0; i < sizeof(n); i++)
+		nonce[i] = n >> (i * 8);
+
+	if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, -1) != 1)
+		return -1;
+
+	if (!enc && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG,
+					AEAD_TAG_LEN, tag) != 1)
+		return -1;
+
+	if (EVP_CipherUpdate(ctx, out, &outl, in, len) != 1 || outl != len)
+		return -1;
+
+	/* it's where a forged or corrupted message fails */
+	if (EVP_CipherFinal_ex(ctx, out + outl, &outl) != 1)
+		return -1;
+
+	if (enc && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG,
+				       AEAD_TAG_LEN, tag) != 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * aead_encrypt - turn the plain text in buf into chunks in place
+ *
+ * A chunk is [encrypted length][tag][encrypted payload][tag], the
+ * payload is at most chunk_size bytes and every seal takes the next
+ * nonce. The chunks are built from the last one backwards, so a chunk
+ * only overwrites plain text already sealed. The length block of the
+ * first chunk goes into the headroom, a packet of one chunk isn't
+ * moved at all.
+ */
+static int aead_encrypt(EVP_CIPHER_CTX *ctx, unsigned long long *nonce,
+			struct ss_buf *buf)
+{
+	int i, n, len;
+	int chunk = ss_opt.chunk_size;
+	unsigned char *p = (void *)buf_ptr(buf);
+	unsigned char *c;
+	unsigned char len_be[2];
+
+	n = (buf->len + chunk - 1) / chunk;
+	if (buf->head < AEAD_LEN_BLOCK ||
+	    buf->head + buf->len + n * AEAD_CHUNK_OVERHEAD -
+	    AEAD_LEN_BLOCK > buf->size)
+		return -1;
+
+	for (i = n - 1; i >= 0; i--) {
+		len = i == n - 1 ? buf->len - i * chunk : chunk;
+		/* where chunk i starts, its payload follows the
+		 * length block */
+		c = p + i * (chunk + AEAD_CHUNK_OVERHEAD) - AEAD_LEN_BLOCK;
+		memmove(c + AEAD_LEN_BLOCK, p + i * chunk, len);
+
+		len_be[0] = len >> 8;
+		len_be[1] = len;
+		if (aead_op(ctx, *nonce + 2 * i, c, len_be, 2,
+			    c + 2, true) == -1)
+			return -1;
+
+		c += AEAD_LEN_BLOCK;
+		if (aead_op(ctx, *nonce + 2 * i + 1, c, c, len,
+			    c + len, true) == -1)
+			return -1;
+	}
+
+	*nonce += 2 * n;
+	buf->head -= AEAD_LEN_BLOCK;
+	buf->len += n * AEAD_CHUNK_OVERHEAD;
+	return 0;
+}
+
+/**
+ * aead_decrypt - open the complete chunks in buf in place
+ *
+ * The payloads are moved together behind the first one. An incomplete
+ * chunk is kept right behind them in buf->rest, do_read() appends the
+ * rest of it. The nonces of a chunk are only used up once the whole
+ * chunk is there.
+ */
+static int aead_decrypt(EVP_CIPHER_CTX *ctx, unsigned long long *nonce,
+			struct ss_buf *buf)
+{
+	int len, in = 0, out = 0;
+	unsigned char *p = (void *)buf_ptr(buf);
+	unsigned char len_be[2];
+
+	while (buf->len - in >= AEAD_LEN_BLOCK) {
+		if (aead_op(ctx, *nonce, len_be, p + in, 2,
+			    p + in + 2, false) == -1)
+			return -1;
+
+		len = (len_be[0] << 8 | len_be[1]) & MAX_CHUNK_SIZE;
+		if (len == 0)
+			return -1;
+
+		if (buf->len - in < len + AEAD_CHUNK_OVERHEAD)
+			break;
+
+		if (aead_op(ctx, *nonce + 1, p + in + AEAD_LEN_BLOCK,
+			    p + in + AEAD_LEN_BLOCK, len,
+			    p + in + AEAD_LEN_BLOCK + len, false) == -1)
+			return -1;
+
+		*nonce += 2;
+		memmove(p + AEAD_LEN_BLOCK + out, p + in + AEAD_LEN_BLOCK, len);
+		out += len;
+		in += len + AEAD_CHUNK_OVERHEAD;
+	}
+
+	buf->rest = buf->len - in;
+	buf->len = out;
+	if (in > 0) {
+		memmove(p + AEAD_LEN_BLOCK + out, p + in, buf->rest);
+		buf->head += AEAD_LEN_BLOCK;
+	}
+
+	return 0;
+}
+
+/* openssl runs every method it has a cipher for */
+static bool evp_supports(const struct crypto_engine *e)
+{
+	const EVP_CIPHER *cipher;
+
+	cipher = EVP_get_cipherbyname(cur_method->evp_name);
+	if (cipher == NULL)
+		return false;
+
+	/* in place en/decryption relies on a block size of 1 */
+	return EVP_CIPHER_block_size(cipher) == 1 &&
+		EVP_CIPHER_key_length(cipher) == key_len &&
+		(cur_method->aead || EVP_CIPHER_iv_length(cipher) >= iv_len);
+}
+
+static int evp_init(const struct crypto_engine *e)
+{
+	evp_cipher = EVP_get_cipherbyname(cur_method->evp_name);
+	enc_tmpl = EVP_CIPHER_CTX_new();
+	dec_tmpl = EVP_CIPHER_CTX_new();
+	if (evp_cipher == NULL || enc_tmpl == NULL || dec_tmpl == NULL)
+		return -1;
+
+	if (EVP_EncryptInit_ex(enc_tmpl, evp_cipher, NULL,
+			       (void *)key, NULL) != 1)
+		return -1;
+
+	if (EVP_DecryptInit_ex(dec_tmpl, evp_cipher, NULL,
+			       (void *)key, NULL) != 1)
+		return -1;
+
+	return 0;
+}
+
+static void evp_exit(void)
+{
+	EVP_CIPHER_CTX_free(enc_tmpl);
+	EVP_CIPHER_CTX_free(dec_tmpl);
+	enc_tmpl = dec_tmpl = NULL;
+}
+
+/**
+ * evp_ctx_init - start ctx on a new stream
+ *
+ * The key schedule is copied from the template, only the iv is set,
+ * so the key isn't expanded again for every link. Aead methods have
+ * a key of their own for every stream, derived from the salt(iv), the
+ * nonce is set per chunk.
+ */
+static int evp_ctx_init(void *ctx, const char *iv, bool enc)
+{
+	int n;
+	unsigned char subkey[EVP_MAX_KEY_LENGTH];
+	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+
+	if (EVP_CIPHER_CTX_copy(ctx, enc ? enc_tmpl : dec_tmpl) != 1)
+		return -1;
+
+	if (cur_method->aead) {
+		if (derive_subkey(iv, subkey) == -1)
+			return -1;
+
+		if (EVP_CipherInit_ex(ctx, NULL, NULL, subkey, NULL, -1) != 1)
+			return -1;
+
+		return 0;
+	}
+
+	/* openssl's chacha20 wants the 32 bit block counter, 0, in
+	 * front of the nonce */
+	n = EVP_CIPHER_iv_length(evp_cipher) - iv_len;
+	memcpy(evp_iv + n, iv, iv_len);
+
+	/* -1 keeps the direction of the template */
+	if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, evp_iv, -1) != 1)
+		return -1;
+
+	return 0;
+}
+
+static int evp_encrypt(void *ctx, unsigned long long *nonce,
+		       struct ss_buf *buf)
+{
+	int len;
+
+	if (cur_method->aead)
+		return aead_encrypt(ctx, nonce, buf);
+
+	if (EVP_EncryptUpdate(ctx, (void *)buf_ptr(buf), &len,
+			      (void *)buf_ptr(buf), buf->len) != 1)
+		return -1;
+
+	return len == buf->len ? 0 : -1;
+}
+
+static int evp_decrypt(void *ctx, unsigned long long *nonce,
+		       struct ss_buf *buf)
+{
+	int len;
+
+	if (cur_method->aead)
+		return aead_decrypt(ctx, nonce, buf);
+
+	if (EVP_DecryptUpdate(ctx, (void *)buf_ptr(buf), &len,
+			      (void *)buf_ptr(buf), buf->len) != 1)
+		return -1;
+
+	return len == buf->len ? 0 : -1;
+}
+
+/* cfb only ever runs aes forwards, see aes.c */
+static bool aesni_supports(const struct crypto_engine *e)
+{
+	return cur_method->builtin == BUILTIN_AES_CFB && aesni_usable();
+}
+
+static int aesni_init(const struct crypto_engine *e)
+{
+	return aes_set_key(&aes_key, (void *)key, key_len);
+}
+
+static int aesni_ctx_init(void *ctx, const char *iv, bool enc)
+{
+	aes_cfb_init(ctx, &aes_key, (void *)iv);
+	return 0;
+}
+
+static int aesni_encrypt(void *ctx, unsigned long long *nonce,
+			 struct ss_buf *buf)
+{
+	aes_cfb_encrypt(ctx, (void *)buf_ptr(buf), (void *)buf_ptr(buf),
+			buf->len);
+	return 0;
+}
+
+/* the downstream bulk, see aes_cfb_decrypt() */
+static int aesni_decrypt(void *ctx, unsigned long long *nonce,
+			 struct ss_buf *buf)
+{
+	aes_cfb_decrypt(ctx, (void *)buf_ptr(buf), (void *)buf_ptr(buf),
+			buf->len);
+	return 0;
+}
+
+/* one engine per chacha20 kernel this cpu can run, see chacha.c */
+static bool chacha20_supports(const struct crypto_engine *e)
+{
+	return cur_method->builtin == BUILTIN_CHACHA20 &&
+		chacha20_kernel_usable(e->kernel);
+}
+
+static int chacha20_engine_init(const struct crypto_engine *e)
+{
+	if (chacha20_use_kernel(e->kernel) == -1)
+		return -1;
+
+	chacha20_init(&chacha_tmpl, (void *)key);
+	return 0;
+}
+
+static int chacha20_ctx_init(void *ctx, const char *iv, bool enc)
+{
+	memcpy(ctx, &chacha_tmpl, sizeof(chacha_tmpl));
+	chacha20_set_nonce(ctx, (void *)iv, 0);
+	return 0;
+}
+
+/* the same keystream both ways */
+static int chacha20_crypt(void *ctx, unsigned long long *nonce,
+			  struct ss_buf *buf)
+{
+	chacha20_xor(ctx, (void *)buf_ptr(buf), (void *)buf_ptr(buf),
+		     buf->len);
+	return 0;
+}
+
+#define CHACHA20_ENGINE(k)						\
+	{"chacha20-" k, k, chacha20_supports,				\
+	 sizeof(struct chacha20_ctx), chacha20_engine_init, NULL,	\
+	 chacha20_ctx_init, chacha20_crypt, chacha20_crypt}
+
+/* openssl first, it's what the others are checked against */
+static const struct crypto_engine engines[] = {
+	{"openssl", NULL, evp_supports, 0, evp_init, evp_exit,
+	 evp_ctx_init, evp_encrypt, evp_decrypt},
+	{"aes-ni", NULL, aesni_supports, sizeof(struct aes_cfb_ctx),
+	 aesni_init, NULL, aesni_ctx_init, aesni_encrypt, aesni_decrypt},
+	CHACHA20_ENGINE("avx2"),
+	CHACHA20_ENGINE("sse2"),
+	CHACHA20_ENGINE("vector"),
+	CHACHA20_ENGINE("scalar"),
+};
+
+#define NR_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/* name of the engine in use */
+const char *crypto_engine(void)
+{
+	return engine ? engine->name : NULL;
+}
+
+static void *engine_ctx_new(const struct crypto_engine *e)
+{
+	if (e->ctx_size == 0)
+		return EVP_CIPHER_CTX_new();
+
+	return malloc(e->ctx_size);
+}
+
+static void engine_ctx_free(const struct crypto_engine *e, void *ctx)
+{
+	if (e->ctx_size == 0)
+		EVP_CIPHER_CTX_free(ctx);
+	else
+		free(ctx);
+}
+
+/* cut at block and pipeline boundaries and off them */
+static const int test_pieces[] = {1, 15, 16, 17, 63, 129, 1000, 2871};
+
+#define ENGINE_TEST_LEN 4112
+
+/**
+ * engine_test - en/decrypt a known stream in pieces with e
+ *
+ * The cipher text of every piece must decrypt to its plain text. It
+ * goes to ref, or is checked against ref if the stream of an engine
+ * is already there.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int engine_test(const struct crypto_engine *e, unsigned char *ref,
+		       bool have_ref, struct ss_buf *buf)
+{
+	int i, n, off = 0, pos = 0, ret = -1;
+	char iv[MAX_IV_LEN];
+	unsigned char plain[ENGINE_TEST_LEN];
+	unsigned long long enc_nonce = 0, dec_nonce = 0;
+	void *enc_ctx, *dec_ctx;
+
+	for (i = 0; i < MAX_IV_LEN; i++)
+		iv[i] = i;
+
+	for (i = 0; i < ENGINE_TEST_LEN; i++)
+		plain[i] = i * 7;
+
+	enc_ctx = engine_ctx_new(e);
+	dec_ctx = engine_ctx_new(e);
+	if (enc_ctx == NULL || dec_ctx == NULL ||
+	    e->ctx_init(enc_ctx, iv, true) == -1 ||
+	    e->ctx_init(dec_ctx, iv, false) == -1)
+		goto out;
+
+	for (i = 0; i < sizeof(test_pieces) / sizeof(test_pieces[0]); i++) {
+		n = test_pieces[i];
+		buf_reset(buf);
+		memcpy(buf_ptr(buf), plain + off, n);
+		buf->len = n;
+		if (e->encrypt(enc_ctx, &enc_nonce, buf) == -1)
+			goto out;
+
+		if (have_ref && memcmp(ref + pos, buf_ptr(buf), buf->len))
+			goto out;
+
+		memcpy(ref + pos, buf_ptr(buf), buf->len);
+		pos += buf->len;
+
+		if (e->decrypt(dec_ctx, &dec_nonce, buf) == -1 ||
+		    buf->len != n || buf->rest != 0 ||
+		    memcmp(buf_ptr(buf), plain + off, n))
+			goto out;
+
+		off += n;
+	}
+
+	ret = 0;
+out:
+	if (enc_ctx)
+		engine_ctx_free(e, enc_ctx);
+	if (dec_ctx)
+		engine_ctx_free(e, dec_ctx);
+	return ret;
+}
+
+#define ENGINE_BENCH_ROUNDS 32
+
+/* ns e takes to encrypt and decrypt ENGINE_BENCH_ROUNDS packets */
+static double engine_bench(const struct crypto_engine *e,
+			   struct ss_buf *buf)
+{
+	int i;
+	char iv[MAX_IV_LEN] = {0};
+	unsigned long long enc_nonce = 0, dec_nonce = 0;
+	struct timespec start, end;
+	void *enc_ctx, *dec_ctx;
+	double ns = -1;
+
+	enc_ctx = engine_ctx_new(e);
+	dec_ctx = engine_ctx_new(e);
+	if (enc_ctx == NULL || dec_ctx == NULL ||
+	    e->ctx_init(enc_ctx, iv, true) == -1 ||
+	    e->ctx_init(dec_ctx, iv, false) == -1)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ENGINE_BENCH_ROUNDS; i++) {
+		buf_reset(buf);
+		buf->len = TEXT_BUF_SIZE;
+		if (e->encrypt(enc_ctx, &enc_nonce, buf) == -1 ||
+		    e->decrypt(dec_ctx, &dec_nonce, buf) == -1)
+			goto out;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec);
+out:
+	if (enc_ctx)
+		engine_ctx_free(e, enc_ctx);
+	if (dec_ctx)
+		engine_ctx_free(e, dec_ctx);
+	return ns;
+}
+
+/**
+ * select_engine - the fastest engine that runs cur_method right
+ *
+ * Every engine that supports the method is initialized and has its
+ * cipher text checked against the first one's, the ones that pass
+ * are timed if there is more than one. Only the winner stays
+ * initialized.
+ */
+static const struct crypto_engine *select_engine(void)
+{
+	int i, nr = 0;
+	bool have_ref = false;
+	double ns, best_ns = 0;
+	unsigned char *ref;
+	struct ss_buf buf = {0};
+	const struct crypto_engine *e, *best = NULL;
+
+	for (i = 0; i < NR_ENGINES; i++)
+		if (engines[i].supports(&engines[i]))
+			nr++;
+
+	buf.size = BUF_HEADROOM + TEXT_BUF_SIZE +
+		crypto_tailroom(TEXT_BUF_SIZE);
+	buf.data = malloc(buf.size);
+	ref = malloc(ENGINE_TEST_LEN + crypto_tailroom(ENGINE_TEST_LEN) +
+		     AEAD_CHUNK_OVERHEAD * sizeof(test_pieces) /
+		     sizeof(test_pieces[0]));
+	if (buf.data == NULL || ref == NULL)
+		goto out;
+
+	for (i = 0; i < NR_ENGINES; i++) {
+		e = &engines[i];
+		if (!e->supports(e))
+			continue;
+
+		if (e->init(e) == -1) {
+			/* e.g. a cipher of the legacy provider */
+			ERR_clear_error();
+			pr_info("%s: %s can't run %s\n",
+				__func__, e->name, cur_method->name);
+			goto next;
+		}
+
+		if (engine_test(e, ref, have_ref, &buf) == -1) {
+			ERR_print_errors_fp(stderr);
+			pr_warn("%s: %s failed the %s self-test\n",
+				__func__, e->name, cur_method->name);
+			goto next;
+		}
+
+		have_ref = true;
+		ns = nr > 1 ? engine_bench(e, &buf) : 0;
+		if (ns < 0)
+			goto next;
+
+		if (nr > 1)
+			pr_info("%s: %s: %.1f MB/s\n", __func__, e->name,
+				2e3 * TEXT_BUF_SIZE * ENGINE_BENCH_ROUNDS / ns);
+
+		if (best == NULL || ns < best_ns) {
+			best = e;
+			best_ns = ns;
+		}
+next:
+		if (e->exit)
+			e->exit();
+	}
+
+	if (best && best->init(best) == -1) {
+		if (best->exit)
+			best->exit();
+		best = NULL;
+	}
+out:
+	free(buf.data);
+	free(ref);
+	return best;
+}
+
 int get_method(char *password, char *method)
 {
-	int ret;
+	cur_method = find_method(ss_opt.method);
+	if (cur_method == NULL) {
+		pr_warn("%s: method %s isn't supported\n",
+			__func__, ss_opt.method);
+		goto err;
+	}
 
 	md = EVP_get_digestbyname("MD5");
 	if (md == NULL)
 		goto err;
 
-	evp_cipher = EVP_get_cipherbyname(ss_opt.method);
-	if (evp_cipher == NULL)
-		goto err;
-
-	key_len = EVP_CIPHER_key_length(evp_cipher);
-	iv_len = EVP_CIPHER_iv_length(evp_cipher);
-
-	ret = EVP_BytesToKey(evp_cipher, md, NULL,
-			     (void *)password, strlen(password), 1,
-			     (void *)key, NULL);
-	if (ret == 0)
+	key_len = cur_method->key_len;
+	iv_len = cur_method->iv_len;
+	if (bytes_to_key(password, (void *)key, key_len) == -1)
 		goto err;
 
 	key[key_len] = '\0';
@@ -69,27 +799,197 @@ err:
 	pr_exit("%s: failed\n", __func__);
 }
 
+/* add CTX_SLAB_OBJS new contexts to the free stack */
+static int ctx_pool_grow(void)
+{
+	int i;
+	EVP_CIPHER_CTX **p;
+
+	p = realloc(ctx_free, (ctx_nobjs + CTX_SLAB_OBJS) * sizeof(*p));
+	if (p == NULL)
+		goto err;
+
+	ctx_free = p;
+
+	for (i = 0; i < CTX_SLAB_OBJS; i++) {
+		ctx_free[ctx_nfree] = EVP_CIPHER_CTX_new();
+		if (ctx_free[ctx_nfree] == NULL)
+			goto err;
+
+		ctx_nfree++;
+		ctx_nobjs++;
+	}
+
+	return 0;
+err:
+	pr_warn("%s: failed\n", __func__);
+	return -1;
+}
+
+/* an EVP_CIPHER_CTX, or the context of a built-in engine */
+void *crypto_ctx_get(void)
+{
+	if (engine->ctx_size != 0)
+		return pool_get(&builtin_pool);
+
+	if (ctx_nfree > 0) {
+		ctx_hits++;
+	} else {
+		ctx_misses++;
+		if (ctx_pool_grow() == -1 && ctx_nfree == 0)
+			return NULL;
+	}
+
+	return ctx_free[--ctx_nfree];
+}
+
+void crypto_ctx_put(void *ctx)
+{
+	if (engine->ctx_size != 0) {
+		pool_put(&builtin_pool, ctx);
+		return;
+	}
+
+	EVP_CIPHER_CTX_reset(ctx);
+	ctx_free[ctx_nfree++] = ctx;
+}
+
+void crypto_pr_pool(void)
+{
+	if (engine->ctx_size != 0) {
+		pr_pool(&builtin_pool);
+		return;
+	}
+
+	pr_notice("pool cipher ctx: objects: %d(free %d), "
+		  "hits: %lu, misses: %lu\n",
+		  ctx_nobjs, ctx_nfree, ctx_hits, ctx_misses);
+}
+
+/**
+ * crypto_iv_refill - generate the ivs handed out since the last refill
+ *
+ * One RAND_bytes() call for all of them. Called when the loop is
+ * idle, and by crypto_iv_get() if the pool runs dry before that.
+ */
+int crypto_iv_refill(void)
+{
+	int used = IV_POOL_SIZE - iv_avail;
+
+	if (used == 0 || iv_len == 0)
+		return 0;
+
+	if (RAND_bytes(iv_pool + iv_avail * iv_len, used * iv_len) != 1) {
+		ERR_print_errors_fp(stderr);
+		pr_warn("%s: RAND_bytes failed\n", __func__);
+		return -1;
+	}
+
+	iv_avail = IV_POOL_SIZE;
+	return 0;
+}
+
+/* a forked child has its parent's pool, whose ivs the parent and its
+ * other children hand out as well, so it starts with an empty one */
+static void iv_pool_forget(void)
+{
+	memset(iv_pool, 0, sizeof(iv_pool));
+	iv_avail = 0;
+}
+
+/* take a fresh iv out of the pool, the slot is wiped so it can't be
+ * handed out twice. A method without iv has an empty pool which is
+ * never refilled, there is nothing to take */
+int crypto_iv_get(char *iv)
+{
+	unsigned char *p;
+
+	if (iv_len == 0)
+		return 0;
+
+	if (iv_avail == 0 && crypto_iv_refill() == -1)
+		return -1;
+
+	p = iv_pool + --iv_avail * iv_len;
+	memcpy(iv, p, iv_len);
+	memset(p, 0, iv_len);
+	return 0;
+}
+
+/* start ctx on a new stream, the engine only sets the iv on a copy of
+ * the key schedule */
+int crypto_ctx_init(void *ctx, const char *iv, bool enc)
+{
+	return engine->ctx_init(ctx, iv, enc);
+}
+
 int crypto_init(char *password, char *method)
 {
 	ERR_load_crypto_strings();
 	OpenSSL_add_all_algorithms();
 	OPENSSL_config(NULL);
 
+	if (ss_opt.chunk_size == 0)
+		ss_opt.chunk_size = MAX_CHUNK_SIZE;
+
 	if (get_method(password, method) == -1)
 		return -1;
 
+	engine = select_engine();
+	if (engine == NULL) {
+		pr_warn("%s: method %s can't be initialized\n",
+			__func__, ss_opt.method);
+		return -1;
+	}
+
+	pr_notice("%s: %s on %s\n", __func__, ss_opt.method, engine->name);
+
+	if (!iv_atfork) {
+		if (pthread_atfork(NULL, NULL, iv_pool_forget) != 0) {
+			pr_warn("%s: pthread_atfork failed\n", __func__);
+			return -1;
+		}
+
+		iv_atfork = true;
+	}
+
+	iv_avail = 0;
+	if (crypto_iv_refill() == -1)
+		return -1;
+
+	if (engine->ctx_size != 0) {
+		builtin_pool.obj_size = engine->ctx_size;
+		return pool_grow(&builtin_pool);
+	}
+
+	if (ctx_pool_grow() == -1)
+		return -1;
+
 	return 0;
 }
 
 void crypto_exit(void)
 {
+	if (engine && engine->exit)
+		engine->exit();
+
+	engine = NULL;
+
+	while (ctx_nfree > 0)
+		EVP_CIPHER_CTX_free(ctx_free[--ctx_nfree]);
+
+	free(ctx_free);
+	ctx_free = NULL;
+	ctx_nobjs = 0;
+	pool_destroy(&builtin_pool);
+
 	EVP_cleanup();
 	ERR_free_strings();
 }
 
 int add_iv(int sockfd, struct link *ln)
 {
-	int ret;
+	struct ss_buf *buf;
 	char *iv_p;
 
 	if (sockfd == ln->local_sockfd)
@@ -99,9 +999,10 @@ int add_iv(int sockfd, struct link *ln)
 	else
 		goto err;
 
-	ret = add_data(sockfd, ln, "cipher", iv_p, iv_len);
-	if (ret != 0)
-		goto err;
+	/* do_send() sends it in front of the first packet */
+	buf = link_in(ln, sockfd);
+	buf->pre = iv_p;
+	buf->pre_len = iv_len;
 
 	ln->state |= SS_IV_SENT;
 
@@ -124,8 +1025,8 @@ int receive_iv(int sockfd, struct link *ln)
 	else
 		goto err;
 
-	memcpy(iv_p, ln->cipher, iv_len);
-	ret = rm_data(sockfd, ln, "cipher", iv_len);
+	memcpy(iv_p, buf_ptr(link_in(ln, sockfd)), iv_len);
+	ret = rm_data(sockfd, link_in(ln, sockfd), iv_len);
 	if (ret != 0)
 		goto err;
 
@@ -139,44 +1040,40 @@ err:
 
 static int check_cipher(int sockfd, struct link *ln, const char *type)
 {
-	int ret;
 	char *iv_p;
-	EVP_CIPHER_CTX *ctx_p;
+	void *ctx_p;
+	unsigned long long *nonce_p;
 
 	if (sockfd == ln->local_sockfd) {
 		iv_p = ln->local_iv;
 		ctx_p = ln->local_ctx;
+		nonce_p = &ln->local_nonce;
 	} else if (sockfd == ln->server_sockfd) {
 		iv_p = ln->server_iv;
 		ctx_p = ln->server_ctx;
+		nonce_p = &ln->server_nonce;
 	} else {
 		goto err;
 	}
 
 	if (strcmp(type, "encrypt") == 0 &&
 	    !(ln->state & SS_IV_SENT)) {
-		if (RAND_bytes((void *)iv_p, iv_len) == -1)
+		if (crypto_iv_get(iv_p) == -1)
 			goto err;
 
-		iv_p[iv_len] = '\0';
-
-		ret = EVP_EncryptInit_ex(ctx_p, evp_cipher,
-					 NULL, (void *)key,
-					 (void *)iv_p);
-
-		if (ret != 1)
+		if (crypto_ctx_init(ctx_p, iv_p, true) == -1)
 			goto err;
+
+		*nonce_p = 0;
 	} else if (strcmp(type, "decrypt") == 0 &&
 		   !(ln->state & SS_IV_RECEIVED)) {
 		if (receive_iv(sockfd, ln) == -1)
 			goto err;
 
-		ret = EVP_DecryptInit_ex(ctx_p, evp_cipher,
-					 NULL, (void *)key,
-					 (void *)iv_p);
-
-		if (ret != 1)
+		if (crypto_ctx_init(ctx_p, iv_p, false) == -1)
 			goto err;
+
+		*nonce_p = 0;
 	}
 
 	return 0;
@@ -185,37 +1082,35 @@ err:
 	return -1;
 }
 
+/* encrypt the data read from sockfd in place, prepend the iv to the
+ * first packet */
 int crypto_encrypt(int sockfd, struct link *ln)
 {
-	int len, cipher_len;
-	EVP_CIPHER_CTX *ctx_p;
+	void *ctx_p;
+	unsigned long long *nonce_p;
+	struct ss_buf *buf = link_in(ln, sockfd);
 
 	if (check_cipher(sockfd, ln, "encrypt") == -1)
 		goto err;
 
 	if (sockfd == ln->local_sockfd) {
 		ctx_p = ln->local_ctx;
+		nonce_p = &ln->local_nonce;
 	} else if (sockfd == ln->server_sockfd) {
 		ctx_p = ln->server_ctx;
+		nonce_p = &ln->server_nonce;
 	} else {
 		goto err;
 	}
 
-	if (EVP_EncryptUpdate(ctx_p, ln->cipher, &len,
-			      ln->text, ln->text_len) != 1)
+	if (engine->encrypt(ctx_p, nonce_p, buf) == -1)
 		goto err;
 
-	cipher_len = len;
-	ln->cipher_len = cipher_len;
-
 	if (!(ln->state & SS_IV_SENT))
 		if (add_iv(sockfd, ln) == -1)
 			goto err;
 
-	/* encryption succeeded, so text buffer is not needed */
-	ln->text_len = 0;
-
-	return ln->cipher_len;
+	return buf->len;
 err:
 	ERR_print_errors_fp(stderr);
 	pr_link_warn(ln);
@@ -223,33 +1118,32 @@ err:
 	return -1;
 }
 
+/* strip the iv of the first packet, decrypt the data read from
+ * sockfd in place, with an aead method it may be 0 bytes until a
+ * whole chunk is read */
 int crypto_decrypt(int sockfd, struct link *ln)
 {
-	int len, text_len;
-	EVP_CIPHER_CTX *ctx_p;
+	void *ctx_p;
+	unsigned long long *nonce_p;
+	struct ss_buf *buf = link_in(ln, sockfd);
 
 	if (check_cipher(sockfd, ln, "decrypt") == -1)
 		goto err;
 
 	if (sockfd == ln->local_sockfd) {
 		ctx_p = ln->local_ctx;
+		nonce_p = &ln->local_nonce;
 	} else if (sockfd == ln->server_sockfd) {
 		ctx_p = ln->server_ctx;
+		nonce_p = &ln->server_nonce;
 	} else {
 		goto err;
 	}
 
-	if (EVP_DecryptUpdate(ctx_p, ln->text, &len,
-			      ln->cipher, ln->cipher_len) != 1) {
+	if (engine->decrypt(ctx_p, nonce_p, buf) == -1)
 		goto err;
-	}
-
-	text_len = len;
-	ln->text_len = text_len;
-	/* decryption succeeded, so cipher buffer is not needed */
-	ln->cipher_len = 0;
 
-	return text_len;
+	return buf->len;
 err:
 	ERR_print_errors_fp(stderr);
 	pr_link_warn(ln);
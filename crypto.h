@@ -9,12 +9,36 @@
 
 #include <openssl/evp.h>
 
+/* cipher contexts the pool grows by */
+#define CTX_SLAB_OBJS 64
+/* ivs generated by one refill */
+#define IV_POOL_SIZE 256
+
+#define AEAD_TAG_LEN 16
+#define AEAD_NONCE_LEN 12
+#define AEAD_SUBKEY_INFO "ss-subkey"
+/* encrypted 2 bytes length and its tag */
+#define AEAD_LEN_BLOCK (2 + AEAD_TAG_LEN)
+/* what a chunk adds to its payload */
+#define AEAD_CHUNK_OVERHEAD (AEAD_LEN_BLOCK + AEAD_TAG_LEN)
+
 extern char password[MAX_PWD_LEN + 1];
 extern char method[MAX_METHOD_NAME_LEN + 1];
 extern int iv_len;
 
+const char *crypto_method(int i);
+const char *crypto_engine(void);
+bool crypto_aead(void);
+int crypto_buf_size(void);
+int crypto_tailroom(int size);
 int crypto_init(char *key, char *method);
 void crypto_exit(void);
+void *crypto_ctx_get(void);
+void crypto_ctx_put(void *ctx);
+void crypto_pr_pool(void);
+int crypto_ctx_init(void *ctx, const char *iv, bool enc);
+int crypto_iv_refill(void);
+int crypto_iv_get(char *iv);
 int crypto_encrypt(int sockfd, struct link *ln);
 int crypto_decrypt(int sockfd, struct link *ln);
 
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "dns.h"
+#include "log.h"
+#include "pool.h"
+
+/*
+ * The answers of resolve.c, so a hot name is looked up once a ttl
+ * instead of once a link. Entries are hashed by (name, family) and
+ * kept in least recently used order, the oldest one makes room when
+ * the cache is full. An entry without addresses is a name which
+ * doesn't exist. The addresses are stored without port, the link
+ * puts its own in. Only the event loop touches the cache.
+ */
+struct dns_entry {
+	char name[MAX_DOMAIN_LEN + 1];
+	int family;
+	time_t expire;
+	int naddrs;
+	union ss_sockaddr addrs[DNS_CACHE_MAX_ADDRS];
+	struct dns_entry *hash_next;
+	/* lru_head is the most recently used */
+	struct dns_entry *lru_prev;
+	struct dns_entry *lru_next;
+};
+
+static struct dns_entry **buckets;
+static unsigned int nbuckets;
+static int max_entries;
+static int nentries;
+static struct dns_entry *lru_head;
+static struct dns_entry *lru_tail;
+
+static unsigned long hits, neg_hits, misses, expired, evictions;
+
+static struct pool entry_pool = POOL_INIT("dns entry",
+					  sizeof(struct dns_entry),
+					  DNS_CACHE_SLAB_OBJS);
+
+/* names are case insensitive, the cache only sees them lower case */
+static void lower_name(char *key, const char *name)
+{
+	int i;
+
+	for (i = 0; i < MAX_DOMAIN_LEN && name[i]; i++)
+		key[i] = tolower((unsigned char)name[i]);
+
+	key[i] = '\0';
+}
+
+/* fnv-1a */
+static unsigned int hash(const char *key, int family)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 16777619;
+	}
+
+	h ^= family;
+	h *= 16777619;
+	return h & (nbuckets - 1);
+}
+
+/* the chain pointer to the entry of key, or to the NULL at the end of
+ * its chain */
+static struct dns_entry **find(const char *key, int family)
+{
+	struct dns_entry **pp = &buckets[hash(key, family)];
+
+	for (; *pp; pp = &(*pp)->hash_next)
+		if ((*pp)->family == family && strcmp((*pp)->name, key) == 0)
+			break;
+
+	return pp;
+}
+
+static void lru_del(struct dns_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+}
+
+static void lru_add(struct dns_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+
+	lru_head = e;
+}
+
+static void remove_entry(struct dns_entry **pp)
+{
+	struct dns_entry *e = *pp;
+
+	*pp = e->hash_next;
+	lru_del(e);
+	pool_put(&entry_pool, e);
+	nentries--;
+}
+
+/* the entry of key, emptied and made the most recent, NULL if there
+ * is no memory for it */
+static struct dns_entry *insert(const char *key, int family, time_t ttl)
+{
+	struct dns_entry **pp, *e;
+
+	pp = find(key, family);
+	e = *pp;
+	if (e) {
+		lru_del(e);
+	} else {
+		if (nentries >= max_entries) {
+			remove_entry(find(lru_tail->name, lru_tail->family));
+			evictions++;
+			/* the eviction may have changed the chain */
+			pp = find(key, family);
+		}
+
+		e = pool_get(&entry_pool);
+		if (e == NULL)
+			return NULL;
+
+		strcpy(e->name, key);
+		e->family = family;
+		e->hash_next = NULL;
+		*pp = e;
+		nentries++;
+	}
+
+	e->expire = current_time + ttl;
+	e->naddrs = 0;
+	lru_add(e);
+	return e;
+}
+
+static bool has_addr(struct dns_entry *e, union ss_sockaddr *sa)
+{
+	int i;
+
+	for (i = 0; i < e->naddrs; i++)
+		if (memcmp(&e->addrs[i], sa, sizeof(*sa)) == 0)
+			return true;
+
+	return false;
+}
+
+static int parse_addr(const char *str, union ss_sockaddr *sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	if (inet_pton(AF_INET, str, &sa->in.sin_addr) == 1) {
+		sa->in.sin_family = AF_INET;
+		return 0;
+	}
+
+	if (inet_pton(AF_INET6, str, &sa->in6.sin6_addr) == 1) {
+		sa->in6.sin6_family = AF_INET6;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * dns_cache_init - make room for size names
+ *
+ * Until it's called the cache is off, every lookup misses and
+ * nothing is kept.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+int dns_cache_init(int size)
+{
+	if (size < 1 || size > DNS_CACHE_MAX_SIZE)
+		size = DNS_CACHE_SIZE;
+
+	for (nbuckets = 1; nbuckets < size; nbuckets <<= 1)
+		;
+
+	buckets = calloc(nbuckets, sizeof(void *));
+	if (buckets == NULL) {
+		pr_warn("%s: calloc failed\n", __func__);
+		nbuckets = 0;
+		return -1;
+	}
+
+	max_entries = size;
+	return 0;
+}
+
+void dns_cache_exit(void)
+{
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+	nentries = 0;
+	lru_head = lru_tail = NULL;
+	hits = neg_hits = misses = expired = evictions = 0;
+	pool_destroy(&entry_pool);
+}
+
+/**
+ * dns_cache_get - the cached addresses of name
+ *
+ * Up to max addresses are copied to addrs, their port is 0.
+ *
+ * Return: the number of addresses, 0 if name is known not to exist,
+ * -1 if it isn't cached or its entry expired
+ */
+int dns_cache_get(const char *name, int family, union ss_sockaddr *addrs,
+		  int max)
+{
+	char key[MAX_DOMAIN_LEN + 1];
+	struct dns_entry **pp, *e;
+	int n;
+
+	if (nbuckets == 0)
+		return -1;
+
+	lower_name(key, name);
+	pp = find(key, family);
+	e = *pp;
+	if (e == NULL) {
+		misses++;
+		return -1;
+	}
+
+	if (e->expire <= current_time) {
+		remove_entry(pp);
+		expired++;
+		misses++;
+		return -1;
+	}
+
+	lru_del(e);
+	lru_add(e);
+
+	if (e->naddrs == 0) {
+		neg_hits++;
+		return 0;
+	}
+
+	hits++;
+	n = e->naddrs < max ? e->naddrs : max;
+	memcpy(addrs, e->addrs, n * sizeof(*addrs));
+	return n;
+}
+
+/**
+ * dns_cache_put - keep the answer of getaddrinfo() for name
+ *
+ * @res: the answer, NULL if name doesn't exist
+ *
+ * A name already cached gets the new answer.
+ */
+void dns_cache_put(const char *name, int family, struct addrinfo *res)
+{
+	char key[MAX_DOMAIN_LEN + 1];
+	union ss_sockaddr sa;
+	struct addrinfo *ai;
+	struct dns_entry *e;
+
+	if (nbuckets == 0)
+		return;
+
+	lower_name(key, name);
+	e = insert(key, family, res ? DNS_CACHE_TTL : DNS_CACHE_NEG_TTL);
+	if (e == NULL)
+		return;
+
+	for (ai = res; ai && e->naddrs < DNS_CACHE_MAX_ADDRS;
+	     ai = ai->ai_next) {
+		if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+		    ai->ai_addrlen > sizeof(sa))
+			continue;
+
+		memset(&sa, 0, sizeof(sa));
+		memcpy(&sa, ai->ai_addr, ai->ai_addrlen);
+		if (sa.sa.sa_family == AF_INET)
+			sa.in.sin_port = 0;
+		else
+			sa.in6.sin6_port = 0;
+
+		/* one per socktype getaddrinfo() was asked for */
+		if (!has_addr(e, &sa))
+			e->addrs[e->naddrs++] = sa;
+	}
+
+	/* an answer without usable address isn't a name which doesn't
+	 * exist */
+	if (res && e->naddrs == 0)
+		remove_entry(find(key, family));
+}
+
+/**
+ * dns_cache_save - write the live entries to path
+ *
+ * One name a line: name, family, when it expires in wall clock
+ * seconds and the addresses. The expiry is absolute, so a file loaded
+ * long after it was saved doesn't bring old answers back. The file is
+ * written aside and renamed over path, so the workers of sserver can
+ * save to the same one.
+ *
+ * Return: the number of names written, -1 on error
+ */
+int dns_cache_save(const char *path)
+{
+	char tmp[MAX_PATH_LEN + 16], addr[INET6_ADDRSTRLEN];
+	int i, err, n = 0;
+	time_t now;
+	struct dns_entry *e;
+	FILE *fp;
+
+	if (nbuckets == 0)
+		return -1;
+
+	/* expire is on the monotonic clock of this process */
+	now = time(NULL);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		pr_warn("%s: %s: %s\n", __func__, tmp, strerror(errno));
+		return -1;
+	}
+
+	/* oldest first, loading it back keeps the lru order */
+	for (e = lru_tail; e; e = e->lru_prev) {
+		if (e->expire <= current_time)
+			continue;
+
+		fprintf(fp, "%s %d %ld", e->name, e->family,
+			(long)(now + e->expire - current_time));
+		for (i = 0; i < e->naddrs; i++)
+			if (sockaddr_str(&e->addrs[i], addr, sizeof(addr)))
+				fprintf(fp, " %s", addr);
+
+		fputc('\n', fp);
+		n++;
+	}
+
+	err = ferror(fp);
+	if (fclose(fp) == EOF || err || rename(tmp, path) == -1) {
+		pr_warn("%s: %s: %s\n", __func__, path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	pr_info("%s: %d names saved to %s\n", __func__, n, path);
+	return n;
+}
+
+/**
+ * dns_cache_load - add the entries saved by dns_cache_save()
+ *
+ * They live until they would have expired had they stayed in the
+ * cache, those expired since are skipped. A missing file is an empty
+ * cache.
+ *
+ * Return: the number of names loaded, -1 on error
+ */
+int dns_cache_load(const char *path)
+{
+	char line[1024], name[MAX_DOMAIN_LEN + 1], *tok, *save;
+	int i, family, off, ntok, naddrs, n = 0;
+	long expire, ttl;
+	time_t now;
+	union ss_sockaddr addrs[DNS_CACHE_MAX_ADDRS];
+	struct dns_entry *e;
+	FILE *fp;
+
+	if (nbuckets == 0)
+		return -1;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno == ENOENT)
+			return 0;
+
+		pr_warn("%s: %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	now = time(NULL);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%255s %d %ld%n",
+			   name, &family, &expire, &off) != 3)
+			continue;
+
+		ttl = expire - now;
+		if (ttl <= 0)
+			continue;
+
+		ntok = naddrs = 0;
+		for (tok = strtok_r(line + off, " \n", &save); tok;
+		     tok = strtok_r(NULL, " \n", &save)) {
+			ntok++;
+			if (naddrs < DNS_CACHE_MAX_ADDRS &&
+			    parse_addr(tok, &addrs[naddrs]) == 0)
+				naddrs++;
+		}
+
+		/* addresses, but none we can use */
+		if (ntok > 0 && naddrs == 0)
+			continue;
+
+		/* nor does a clock set back make them live longer */
+		if (naddrs == 0 && ttl > DNS_CACHE_NEG_TTL)
+			ttl = DNS_CACHE_NEG_TTL;
+		else if (ttl > DNS_CACHE_TTL)
+			ttl = DNS_CACHE_TTL;
+
+		lower_name(name, name);
+		e = insert(name, family, ttl);
+		if (e == NULL)
+			break;
+
+		for (i = 0; i < naddrs; i++)
+			e->addrs[i] = addrs[i];
+
+		e->naddrs = naddrs;
+		n++;
+	}
+
+	fclose(fp);
+	pr_info("%s: %d names loaded from %s\n", __func__, n, path);
+	return n;
+}
+
+void dns_cache_pr_stats(void)
+{
+	if (nbuckets == 0)
+		return;
+
+	pr_notice("dns cache: names: %d/%d, hits: %lu(negative %lu), "
+		  "misses: %lu(expired %lu), evictions: %lu\n",
+		  nentries, max_entries, hits, neg_hits,
+		  misses, expired, evictions);
+	pr_pool(&entry_pool);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_DNS_H
+#define SS_DNS_H
+
+#include <netdb.h>
+
+#include "common.h"
+
+/* names the cache holds unless -D says otherwise */
+#define DNS_CACHE_SIZE 1024
+#define DNS_CACHE_MAX_SIZE (1024 * 1024)
+/* addresses kept for a name, the first ones getaddrinfo() gives */
+#define DNS_CACHE_MAX_ADDRS 8
+/*
+ * Every answer lives this long, a name that doesn't exist a shorter
+ * time. This is a deliberate limitation, not the ttl of the records:
+ * getaddrinfo() doesn't tell it, and asking the nameserver again with
+ * res_query() just for it would double the lookups. A record with a
+ * shorter ttl may be used up to this long after it changed, one with a
+ * longer ttl is looked up more often than needed. dns_cache_load()
+ * clamps what it reads from -F to it as well.
+ */
+#define DNS_CACHE_TTL 60
+#define DNS_CACHE_NEG_TTL 15
+/* how often a worker writes the cache to -F */
+#define DNS_CACHE_SAVE_INTERVAL 300
+/* entries the pool grows by */
+#define DNS_CACHE_SLAB_OBJS 64
+
+int dns_cache_init(int size);
+void dns_cache_exit(void);
+int dns_cache_get(const char *name, int family, union ss_sockaddr *addrs,
+		  int max);
+void dns_cache_put(const char *name, int family, struct addrinfo *res);
+int dns_cache_save(const char *path);
+int dns_cache_load(const char *path);
+void dns_cache_pr_stats(void);
+
+#endif
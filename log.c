@@ -143,6 +143,11 @@ static void sock_print(int sockfd, int level, const char *fmt, va_list ap)
 	char str[INET6_ADDRSTRLEN] = {'\0'};
 	char log[1024];
 
+	/* don't pay for getpeername()/getsockname() if the message
+	 * is going to be dropped anyway */
+	if (!(setlogmask(0) & LOG_MASK(level)))
+		return;
+
 	if (get_sock_addr(sockfd, str, &port, "peer") == 0)
 		type = "peer";
 	else if (get_sock_addr(sockfd, str, &port, "sock") == 0)
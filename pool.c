@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#include <stdlib.h>
+
+#include "log.h"
+#include "pool.h"
+
+/* keep every object suitably aligned for anything put in it */
+#define POOL_ALIGN 16
+#define POOL_ROUNDUP(x) (((x) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+/* a slab starts with a pointer to the next slab, then the objects */
+#define SLAB_HEADER_SIZE POOL_ROUNDUP(sizeof(void *))
+
+/**
+ * pool_grow - add a slab of slab_objs objects to the free list
+ */
+int pool_grow(struct pool *pool)
+{
+	int i;
+	size_t size;
+	char *slab, *obj;
+
+	size = POOL_ROUNDUP(pool->obj_size);
+	slab = malloc(SLAB_HEADER_SIZE + size * pool->slab_objs);
+	if (slab == NULL) {
+		pr_warn("%s: %s: malloc failed\n", __func__, pool->name);
+		return -1;
+	}
+
+	*(void **)slab = pool->slabs;
+	pool->slabs = slab;
+
+	obj = slab + SLAB_HEADER_SIZE;
+	for (i = 0; i < pool->slab_objs; i++, obj += size) {
+		*(void **)obj = pool->free_list;
+		pool->free_list = obj;
+	}
+
+	pool->nobjs += pool->slab_objs;
+	pool->nfree += pool->slab_objs;
+
+	return 0;
+}
+
+/**
+ * pool_get - take an object out of the pool
+ *
+ * The content of the object is whatever its last user left.
+ */
+void *pool_get(struct pool *pool)
+{
+	void *obj;
+
+	if (pool->free_list) {
+		pool->hits++;
+	} else {
+		pool->misses++;
+		if (pool_grow(pool) == -1)
+			return NULL;
+	}
+
+	obj = pool->free_list;
+	pool->free_list = *(void **)obj;
+	pool->nfree--;
+
+	return obj;
+}
+
+void pool_put(struct pool *pool, void *obj)
+{
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->nfree++;
+}
+
+/* all the objects must have been put back, or they are gone too */
+void pool_destroy(struct pool *pool)
+{
+	void *slab;
+
+	while (pool->slabs) {
+		slab = pool->slabs;
+		pool->slabs = *(void **)slab;
+		free(slab);
+	}
+
+	pool->free_list = NULL;
+	pool->nobjs = 0;
+	pool->nfree = 0;
+}
+
+void pr_pool(struct pool *pool)
+{
+	pr_notice("pool %s: objects: %d(free %d), size: %zu, "
+		  "hits: %lu, misses: %lu\n",
+		  pool->name, pool->nobjs, pool->nfree, pool->obj_size,
+		  pool->hits, pool->misses);
+}
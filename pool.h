@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_POOL_H
+#define SS_POOL_H
+
+#include <stddef.h>
+
+/* a free list of fixed size objects, which grows a slab at a time
+ * and never gives memory back until pool_destroy() */
+struct pool {
+	const char *name;
+	size_t obj_size;
+	int slab_objs;
+	void *free_list;
+	void *slabs;
+	int nobjs;
+	int nfree;
+	/* gets served by the free list, and those which had to grow */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+#define POOL_INIT(_name, _size, _slab_objs) {	\
+		.name = (_name),		\
+		.obj_size = (_size),		\
+		.slab_objs = (_slab_objs),	\
+	}
+
+int pool_grow(struct pool *pool);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *obj);
+void pool_destroy(struct pool *pool);
+void pr_pool(struct pool *pool);
+
+#endif
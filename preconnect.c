@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "log.h"
+#include "preconnect.h"
+
+/*
+ * Connections to the server sslocal opens before a link needs one, so
+ * a link is connected as soon as its socks5 request is parsed, without
+ * waiting a round trip for the handshake. The pool is sized to the
+ * links asked for in the last seconds, and refilled by the event loop
+ * after connect_server() took one. Nothing is sent on an idle
+ * connection, sserver waits for the ss header, so those which linger
+ * are dropped before it gives up on them. Pool sockfds are polled like
+ * those of the links, but have no link in link_head[].
+ */
+struct upstream {
+	int fd;
+	bool connected;
+	/* when it connected, or started to */
+	time_t since;
+};
+
+static struct upstream conns[PRECONNECT_MAX_SIZE];
+static int nconns;
+static int nidle;
+static int max_size;
+
+static union ss_sockaddr addrs[MAX_SERVER_ADDRS];
+static int naddrs;
+/* the address connected to, the next one after a failure */
+static int cur_addr;
+static time_t retry_time;
+
+/* links which asked for a connection in the current second, and the
+ * recent rate the pool is sized to */
+static int demand;
+static int rate;
+static time_t rate_tick;
+/* when a link last asked for one */
+static time_t last_get;
+
+static unsigned long hits, misses, stale, expired, failed;
+
+/* a burst of links raises the rate at once, it decays by a quarter
+ * every second after */
+static void rate_update(void)
+{
+	int i;
+
+	for (i = 0; rate_tick < current_time && i < 32; i++) {
+		rate_tick++;
+		if (demand > rate)
+			rate = demand;
+		else
+			rate -= (rate + 3) / 4;
+
+		demand = 0;
+	}
+
+	rate_tick = current_time;
+}
+
+/* one is kept ready unless no link asked for PRECONNECT_IDLE_PERIOD,
+ * the next link gets it going again. The links being asked for right
+ * now count before the rate catches up with them */
+static int pool_target(void)
+{
+	int want = demand > rate ? demand : rate;
+
+	if (want < 1 && last_get + PRECONNECT_IDLE_PERIOD > current_time)
+		want = 1;
+
+	return want < max_size ? want : max_size;
+}
+
+/* take conns[i] out of the pool, its sockfd is left alone */
+static void conn_remove(int i)
+{
+	if (conns[i].connected)
+		nidle--;
+
+	conns[i] = conns[--nconns];
+}
+
+static void conn_del(int i)
+{
+	poll_del(conns[i].fd);
+	close(conns[i].fd);
+	conn_remove(i);
+}
+
+/* the connect() failed, the next address gets a go a bit later */
+static void conn_failed(int i)
+{
+	failed++;
+	conn_del(i);
+	cur_addr = (cur_addr + 1) % naddrs;
+	retry_time = current_time + PRECONNECT_RETRY;
+}
+
+/* an idle connection is readable only when the server closed it */
+static bool conn_alive(int fd)
+{
+	char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+	       (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int conn_add(void)
+{
+	int fd;
+	union ss_sockaddr *sa = &addrs[cur_addr];
+	struct upstream *up;
+
+	fd = socket(sa->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		pr_warn("%s: socket() %s\n", __func__, strerror(errno));
+		retry_time = current_time + PRECONNECT_RETRY;
+		return -1;
+	}
+
+	if (poll_set(fd, POLLOUT) == -1) {
+		close(fd);
+		retry_time = current_time + PRECONNECT_RETRY;
+		return -1;
+	}
+
+	up = &conns[nconns++];
+	up->fd = fd;
+	up->connected = false;
+	up->since = current_time;
+
+	if (connect(fd, &sa->sa, sockaddr_len(sa)) == 0) {
+		up->connected = true;
+		nidle++;
+		poll_set(fd, POLLIN);
+		return 0;
+	}
+
+	if (errno != EINPROGRESS) {
+		sock_info(fd, "%s: connect() %s", __func__, strerror(errno));
+		conn_failed(nconns - 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * preconnect_init - keep up to size connections to server_ai ready
+ *
+ * A size of 0 leaves the pool off, preconnect_get() always misses.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+int preconnect_init(struct addrinfo *server_ai, int size)
+{
+	struct addrinfo *ai;
+
+	if (size > PRECONNECT_MAX_SIZE)
+		size = PRECONNECT_MAX_SIZE;
+
+	max_size = 0;
+	if (size <= 0)
+		return 0;
+
+	for (naddrs = 0, ai = server_ai; ai && naddrs < MAX_SERVER_ADDRS;
+	     ai = ai->ai_next) {
+		if (ai->ai_socktype != SOCK_STREAM ||
+		    (ai->ai_family != AF_INET && ai->ai_family != AF_INET6))
+			continue;
+
+		memcpy(&addrs[naddrs++], ai->ai_addr, ai->ai_addrlen);
+	}
+
+	if (naddrs == 0) {
+		pr_warn("%s: no server address\n", __func__);
+		return -1;
+	}
+
+	max_size = size;
+	cur_addr = 0;
+	retry_time = 0;
+	rate_tick = current_time;
+	last_get = current_time;
+	pr_info("%s: up to %d idle connections\n", __func__, max_size);
+	return 0;
+}
+
+void preconnect_exit(void)
+{
+	while (nconns > 0)
+		conn_del(nconns - 1);
+
+	max_size = 0;
+	demand = rate = 0;
+	hits = misses = stale = expired = failed = 0;
+}
+
+/**
+ * preconnect_get - a connected sockfd to the server
+ *
+ * The newest idle connection is taken, it's the least likely to be
+ * closed by the server already. The sockfd stays in poll for POLLIN,
+ * the caller puts its link in link_head[] for it.
+ *
+ * Return: the sockfd, -1 if there isn't one ready
+ */
+int preconnect_get(void)
+{
+	int i, newest, fd;
+
+	if (max_size == 0)
+		return -1;
+
+	rate_update();
+	demand++;
+	last_get = current_time;
+
+	while (nidle > 0) {
+		newest = -1;
+		for (i = 0; i < nconns; i++)
+			if (conns[i].connected &&
+			    (newest == -1 ||
+			     conns[i].since > conns[newest].since))
+				newest = i;
+
+		fd = conns[newest].fd;
+		if (!conn_alive(fd)) {
+			sock_info(fd, "%s: closed by server", __func__);
+			stale++;
+			conn_del(newest);
+			continue;
+		}
+
+		conn_remove(newest);
+		hits++;
+		return fd;
+	}
+
+	misses++;
+	return -1;
+}
+
+/**
+ * preconnect_event - handle revents of sockfd if it's in the pool
+ *
+ * Return: 0 if sockfd is one of the pool, -1 otherwise
+ */
+int preconnect_event(int sockfd, short revents)
+{
+	int i, err;
+	socklen_t len = sizeof(err);
+	union ss_sockaddr peer;
+
+	for (i = 0; i < nconns; i++)
+		if (conns[i].fd == sockfd)
+			break;
+
+	if (i == nconns)
+		return -1;
+
+	if (conns[i].connected) {
+		/* a stale event of an earlier user of the sockfd */
+		if (!(revents & (POLLERR | POLLHUP)) && conn_alive(sockfd))
+			return 0;
+
+		sock_info(sockfd, "%s: closed by server", __func__);
+		stale++;
+		conn_del(i);
+		return 0;
+	}
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+
+	len = sizeof(peer);
+	if (err == 0 && getpeername(sockfd, &peer.sa, &len) == -1) {
+		/* still in progress */
+		if (errno == ENOTCONN)
+			return 0;
+
+		err = errno;
+	}
+
+	if (err != 0) {
+		sock_info(sockfd, "%s: connect() %s", __func__, strerror(err));
+		conn_failed(i);
+		return 0;
+	}
+
+	conns[i].connected = true;
+	conns[i].since = current_time;
+	nidle++;
+	poll_set(sockfd, POLLIN);
+	return 0;
+}
+
+/**
+ * preconnect_refill - drop the connections idle for too long and
+ * connect new ones up to what the recent links ask for
+ *
+ * Called once per event loop round, like reaper().
+ */
+void preconnect_refill(void)
+{
+	int i, want;
+
+	if (max_size == 0)
+		return;
+
+	rate_update();
+
+	/* conn_del() moves the last one to i, which is checked already */
+	for (i = nconns - 1; i >= 0; i--) {
+		if (!conns[i].connected) {
+			if (conns[i].since + TCP_CONNECT_TIMEOUT <= current_time)
+				conn_failed(i);
+		} else if (conns[i].since + PRECONNECT_IDLE_TIMEOUT <=
+			   current_time) {
+			expired++;
+			conn_del(i);
+		}
+	}
+
+	want = pool_target();
+	while (nconns < want && retry_time <= current_time)
+		if (conn_add() == -1)
+			break;
+}
+
+/**
+ * preconnect_timeout - the smaller of timeout and the milliseconds
+ * until preconnect_refill() has something to do
+ *
+ * Return: the timeout for poll_wait(), -1 means no timer at all
+ */
+int preconnect_timeout(int timeout)
+{
+	int i, ms;
+	time_t t, deadline = 0;
+
+	if (max_size == 0)
+		return timeout;
+
+	for (i = 0; i < nconns; i++) {
+		t = conns[i].since + (conns[i].connected ?
+				      PRECONNECT_IDLE_TIMEOUT :
+				      TCP_CONNECT_TIMEOUT);
+		if (deadline == 0 || t < deadline)
+			deadline = t;
+	}
+
+	/* short of connections, only because connecting failed */
+	if (nconns < pool_target() && retry_time > current_time &&
+	    (deadline == 0 || retry_time < deadline))
+		deadline = retry_time;
+
+	if (deadline == 0)
+		return timeout;
+
+	ms = deadline <= current_time ? 0 : (deadline - current_time) * 1000;
+	return timeout == -1 || ms < timeout ? ms : timeout;
+}
+
+void preconnect_pr_stats(void)
+{
+	if (max_size == 0)
+		return;
+
+	pr_notice("preconnect: idle: %d, connecting: %d, target: %d/%d, "
+		  "hits: %lu, misses: %lu, closed by server: %lu, "
+		  "expired: %lu, failed: %lu\n",
+		  nidle, nconns - nidle, pool_target(), max_size,
+		  hits, misses, stale, expired, failed);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_PRECONNECT_H
+#define SS_PRECONNECT_H
+
+#include <netdb.h>
+
+/* idle connections to the server sslocal keeps at most, unless -P
+ * says otherwise, 0 turns the pool off */
+#define PRECONNECT_SIZE 8
+#define PRECONNECT_MAX_SIZE 64
+/* an idle connection is dropped before sserver gives up on it, which
+ * is TCP_CONNECT_TIMEOUT after accepting it */
+#define PRECONNECT_IDLE_TIMEOUT 10
+/* no connection is kept once no link asked for one this long, an idle
+ * sslocal doesn't reconnect every PRECONNECT_IDLE_TIMEOUT forever */
+#define PRECONNECT_IDLE_PERIOD 60
+/* seconds to wait before connecting again after a failure */
+#define PRECONNECT_RETRY 1
+
+int preconnect_init(struct addrinfo *server_ai, int size);
+void preconnect_exit(void);
+int preconnect_get(void);
+int preconnect_event(int sockfd, short revents);
+void preconnect_refill(void);
+int preconnect_timeout(int timeout);
+void preconnect_pr_stats(void);
+
+#endif
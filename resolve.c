@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "dns.h"
+#include "log.h"
+#include "pool.h"
+#include "resolve.h"
+
+/*
+ * getaddrinfo() blocks, so it runs in a pool of threads. The event
+ * loop queues a request on todo, a thread resolves it and moves it to
+ * done, then wakes the loop up through an eventfd, which is polled
+ * like any sockfd. Requests are only allocated and freed by the loop,
+ * the threads only move them between the two lists.
+ */
+struct resolve_req {
+	/* NULL once the link is gone, see resolve_cancel() */
+	struct link *ln;
+	char host[MAX_DOMAIN_LEN + 1];
+	char port[MAX_PORT_STRING_LEN + 1];
+	int socktype;
+	struct addrinfo *res;
+	int err;
+	struct resolve_req *next;
+};
+
+struct req_list {
+	struct resolve_req *head;
+	struct resolve_req **tail;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t todo_cond = PTHREAD_COND_INITIALIZER;
+static struct req_list todo = {NULL, &todo.head};
+static struct req_list done = {NULL, &done.head};
+static bool stopping;
+
+static pthread_t threads[MAX_RESOLVERS];
+static int nthreads;
+static int efd = -1;
+static resolve_cb_t done_cb;
+/* the nameserver of -N, used instead of resolv.conf's if set */
+static struct sockaddr_in ns_addr;
+
+static struct pool req_pool = POOL_INIT("resolve request",
+					sizeof(struct resolve_req),
+					RESOLVE_SLAB_OBJS);
+
+static void list_add(struct req_list *list, struct resolve_req *req)
+{
+	req->next = NULL;
+	*list->tail = req;
+	list->tail = &req->next;
+}
+
+static struct resolve_req *list_pop(struct req_list *list)
+{
+	struct resolve_req *req = list->head;
+
+	if (req == NULL)
+		return NULL;
+
+	list->head = req->next;
+	if (list->head == NULL)
+		list->tail = &list->head;
+
+	return req;
+}
+
+/* the resolver state is per thread, so every thread points its own
+ * at the nameserver */
+static void use_nameserver(void)
+{
+	if (ns_addr.sin_family != AF_INET)
+		return;
+
+	res_init();
+	_res.nscount = 1;
+	_res.nsaddr_list[0] = ns_addr;
+}
+
+static void *resolver(void *arg)
+{
+	uint64_t one = 1;
+	struct addrinfo hint;
+	struct resolve_req *req;
+
+	use_nameserver();
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (todo.head == NULL && !stopping)
+			pthread_cond_wait(&todo_cond, &lock);
+
+		if (stopping)
+			break;
+
+		req = list_pop(&todo);
+		/* nobody waits for it any more */
+		if (req->ln == NULL) {
+			req->err = EAI_CANCELED;
+			goto done;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		memset(&hint, 0, sizeof(hint));
+		hint.ai_family = AF_UNSPEC;
+		hint.ai_socktype = req->socktype;
+		req->err = getaddrinfo(req->host, req->port, &hint, &req->res);
+		if (req->err != 0)
+			req->res = NULL;
+
+		pthread_mutex_lock(&lock);
+done:
+		list_add(&done, req);
+		if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			pr_warn("%s: write() %s\n", __func__, strerror(errno));
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/* ip or ip:port, port 53 if it's left out */
+static int parse_nameserver(const char *nameserver)
+{
+	char addr[INET_ADDRSTRLEN];
+	const char *colon;
+	int port = 53;
+	size_t len;
+
+	colon = strchr(nameserver, ':');
+	len = colon ? colon - nameserver : strlen(nameserver);
+	if (len >= sizeof(addr))
+		return -1;
+
+	memcpy(addr, nameserver, len);
+	addr[len] = '\0';
+	if (colon) {
+		port = atoi(colon + 1);
+		if (port < 1 || port > 65535)
+			return -1;
+	}
+
+	memset(&ns_addr, 0, sizeof(ns_addr));
+	ns_addr.sin_family = AF_INET;
+	ns_addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &ns_addr.sin_addr) != 1)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * resolve_init - start n resolver threads
+ *
+ * @nameserver: an ipv4 nameserver to ask instead of the ones in
+ * resolv.conf, NULL or "" for those
+ * @cb: called by resolve_done() with the answer of every request
+ *
+ * The threads don't survive fork(), every worker starts its own.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+int resolve_init(int n, const char *nameserver, resolve_cb_t cb)
+{
+	int i, ret;
+	sigset_t all, old;
+
+	if (nameserver && nameserver[0] &&
+	    parse_nameserver(nameserver) == -1) {
+		pr_warn("%s: illegal nameserver %s\n", __func__, nameserver);
+		return -1;
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd == -1) {
+		pr_warn("%s: eventfd() %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	if (n > MAX_RESOLVERS)
+		n = MAX_RESOLVERS;
+
+	done_cb = cb;
+	stopping = false;
+	/* signals are for the event loop, the threads inherit the mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < n; i++) {
+		ret = pthread_create(&threads[i], NULL, resolver, NULL);
+		if (ret != 0) {
+			pr_warn("%s: pthread_create() %s\n",
+				__func__, strerror(ret));
+			break;
+		}
+
+		nthreads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (nthreads == 0) {
+		resolve_exit();
+		return -1;
+	}
+
+	pr_info("%s: %d resolver threads\n", __func__, nthreads);
+	return 0;
+}
+
+/* stop the threads, a lookup in progress is waited for */
+void resolve_exit(void)
+{
+	struct resolve_req *req;
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&todo_cond);
+	pthread_mutex_unlock(&lock);
+
+	while (nthreads > 0)
+		pthread_join(threads[--nthreads], NULL);
+
+	while ((req = list_pop(&todo)) != NULL)
+		pool_put(&req_pool, req);
+
+	while ((req = list_pop(&done)) != NULL) {
+		if (req->res)
+			freeaddrinfo(req->res);
+		pool_put(&req_pool, req);
+	}
+
+	if (efd != -1)
+		close(efd);
+
+	efd = -1;
+	pool_destroy(&req_pool);
+}
+
+/* the eventfd readable when answers are waiting for resolve_done() */
+int resolve_fd(void)
+{
+	return efd;
+}
+
+/**
+ * resolve_start - look host up for ln in the background
+ *
+ * The answer comes through the callback of resolve_init(), called by
+ * resolve_done(), unless resolve_cancel() is called before it.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+int resolve_start(struct link *ln, const char *host, const char *port,
+		  int socktype)
+{
+	struct resolve_req *req;
+
+	if (efd == -1 || ln->resolve)
+		return -1;
+
+	req = pool_get(&req_pool);
+	if (req == NULL)
+		return -1;
+
+	memset(req, 0, sizeof(*req));
+	req->ln = ln;
+	strncpy(req->host, host, MAX_DOMAIN_LEN);
+	strncpy(req->port, port, MAX_PORT_STRING_LEN);
+	req->socktype = socktype;
+	ln->resolve = req;
+
+	pthread_mutex_lock(&lock);
+	list_add(&todo, req);
+	pthread_cond_signal(&todo_cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+/* ln is going away, its answer is dropped when it comes */
+void resolve_cancel(struct link *ln)
+{
+	if (ln->resolve == NULL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	ln->resolve->ln = NULL;
+	pthread_mutex_unlock(&lock);
+	ln->resolve = NULL;
+}
+
+/* keep the answers in the dns cache, even those nobody waits for any
+ * more, and hand them to their links, called when resolve_fd() is
+ * readable */
+void resolve_done(void)
+{
+	uint64_t n;
+	struct req_list list;
+	struct resolve_req *req;
+	struct link *ln;
+
+	if (read(efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		pr_warn("%s: read() %s\n", __func__, strerror(errno));
+
+	pthread_mutex_lock(&lock);
+	list = done;
+	if (list.head == NULL)
+		list.tail = &list.head;
+	done.head = NULL;
+	done.tail = &done.head;
+	pthread_mutex_unlock(&lock);
+
+	while ((req = list_pop(&list)) != NULL) {
+		if (req->err == 0)
+			dns_cache_put(req->host, AF_UNSPEC, req->res);
+		else if (req->err == EAI_NONAME)
+			dns_cache_put(req->host, AF_UNSPEC, NULL);
+
+		ln = req->ln;
+		if (ln == NULL) {
+			if (req->res)
+				freeaddrinfo(req->res);
+		} else {
+			ln->resolve = NULL;
+			done_cb(ln, req->res, req->err);
+		}
+
+		pool_put(&req_pool, req);
+	}
+}
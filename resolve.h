@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_RESOLVE_H
+#define SS_RESOLVE_H
+
+#include "common.h"
+
+/* resolver threads unless -r says otherwise */
+#define DEFAULT_RESOLVERS 4
+#define MAX_RESOLVERS 64
+/* requests the pool grows by */
+#define RESOLVE_SLAB_OBJS 64
+
+/* the answer for ln, res is NULL and err a getaddrinfo() error code
+ * if there is none */
+typedef void (*resolve_cb_t)(struct link *ln, struct addrinfo *res,
+			     int err);
+
+int resolve_init(int nthreads, const char *nameserver, resolve_cb_t cb);
+void resolve_exit(void);
+int resolve_fd(void);
+int resolve_start(struct link *ln, const char *host, const char *port,
+		  int socktype);
+void resolve_cancel(struct link *ln);
+void resolve_done(void);
+
+#endif
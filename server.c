@@ -4,28 +4,42 @@
  * it under the terms of the MIT license. See COPYING for details.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <netdb.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #include "common.h"
 #include "crypto.h"
+#include "dns.h"
 #include "log.h"
+#include "resolve.h"
+
+static volatile sig_atomic_t stop_requested;
+static time_t dns_save_time;
 
 /* read text from remote, encrypt and send to local */
 int server_do_remote_read(int sockfd, struct link *ln)
 {
 	int ret;
 
-	if (ln->state & SERVER_SEND_PENDING)
+	/* local hasn't drained the last chunk, apply backpressure */
+	if (ln->state & LOCAL_SEND_PENDING) {
+		poll_rm(sockfd, POLLIN);
 		return 0;
+	}
 
-	ret = do_read(sockfd, ln, "text", 0);
+	ret = do_read(sockfd, ln, &ln->down);
 	if (ret == -2) {
 		goto out;
 	} else if (ret == -1) {
@@ -39,11 +53,12 @@ int server_do_remote_read(int sockfd, struct link *ln)
 	if (crypto_encrypt(sockfd, ln) == -1)
 		goto out;
 
-	ret = do_send(ln->local_sockfd, ln, "cipher", 0);
+	ret = do_send(ln->local_sockfd, ln, &ln->down);
 	if (ret == -2) {
 		goto out;
 	} else if (ret == -1) {
 		ln->state |= LOCAL_SEND_PENDING;
+		poll_rm(sockfd, POLLIN);
 	}
 
 	return 0;
@@ -51,49 +66,53 @@ out:
 	return -1;
 }
 
+/* send the plain text read from local to the server */
+static int server_send_up(int sockfd, struct link *ln)
+{
+	int ret;
+
+	ret = do_send(ln->server_sockfd, ln, &ln->up);
+	if (ret == -2) {
+		return -1;
+	} else if (ret == -1) {
+		ln->state |= SERVER_SEND_PENDING;
+		poll_rm(sockfd, POLLIN);
+	}
+
+	return 0;
+}
+
 /* read cipher from local, decrypt and send to server */
 int server_do_local_read(int sockfd, struct link *ln)
 {
 	int ret;
 
-	if (ln->state & LOCAL_SEND_PENDING) {
+	/* remote hasn't drained the last chunk, or there is no remote
+	 * yet, apply backpressure */
+	if (ln->state & (SERVER_SEND_PENDING | SS_RESOLVING)) {
+		poll_rm(sockfd, POLLIN);
 		return 0;
 	}
 
-	/* if iv isn't received, wait to receive bigger than iv_len
-	 * bytes before go to next step */
-	if (ln->state & LOCAL_READ_PENDING) {
-		ret = do_read(sockfd, ln, "cipher", ln->cipher_len);
-		if (ret == -2) {
-			goto out;
-		} else if (ret == -1) {
-			return 0;
-		}
-
-		if (ln->cipher_len <= iv_len) {
-			return 0;
-		} else {
-			ln->state &= ~SERVER_READ_PENDING;
-		}
-	} else {
-		ret = do_read(sockfd, ln, "cipher", 0);
-		if (ret == -2) {
-			goto out;
-		} else if (ret == -1) {
-			return 0;
-		}
-
-		if (!(ln->state & SS_IV_RECEIVED)) {
-			if (ln->cipher_len <= iv_len) {
-				ln->state |= LOCAL_READ_PENDING;
-				return 0;
-			}
-		}
+	/* if iv isn't received, keep what we have and wait to
+	 * receive bigger than iv_len bytes before go to next step */
+	ret = do_read(sockfd, ln, &ln->up);
+	if (ret == -2) {
+		goto out;
+	} else if (ret == -1) {
+		return 0;
 	}
 
+	if (!(ln->state & SS_IV_RECEIVED) && ln->up.len <= iv_len)
+		return 0;
+
 	if (crypto_decrypt(sockfd, ln) == -1)
 		goto out;
 
+	/* an aead chunk isn't complete yet */
+	if (ln->up.len == 0)
+		return 0;
+
 	if (ln->state & SS_UDP) {
 		if (check_ss_header(sockfd, ln) == -1)
 			goto out;
@@ -103,47 +122,66 @@ int server_do_local_read(int sockfd, struct link *ln)
 
 		ln->state |= SS_TCP_HEADER_RECEIVED;
 
-		if (ln->text_len == 0)
+		/* what's left is sent once the server is known */
+		if (ln->state & SS_RESOLVING)
+			return 0;
+
+		if (ln->up.len == 0)
 			return 0;
 	}
 
-	ret = do_send(ln->server_sockfd, ln, "text", 0);
-	if (ret == -2) {
+	if (server_send_up(sockfd, ln) == -1)
 		goto out;
-	} else if (ret == -1) {
-		ln->state |= SERVER_SEND_PENDING;
-	}
 
 	return 0;
 out:
 	return -1;
 }
 
+/**
+ * server_do_resolved - the address of the ss header is there
+ *
+ * Connect to it and send what local sent behind the header, local
+ * is read again from now on. res has been put in the dns cache, the
+ * link keeps its own copy of the addresses.
+ */
+static void server_do_resolved(struct link *ln, struct addrinfo *res,
+			       int err)
+{
+	int sockfd = ln->local_sockfd;
+
+	ln->state &= ~SS_RESOLVING;
+	if (err != 0) {
+		sock_warn(sockfd, "%s: getaddrinfo error: %s",
+			  __func__, gai_strerror(err));
+		goto clean;
+	}
+
+	link_set_server(ln, res);
+	freeaddrinfo(res);
+	if (connect_server(sockfd) == -1)
+		goto clean;
+
+	poll_add(sockfd, POLLIN);
+	if (ln->up.len > 0 && server_send_up(sockfd, ln) == -1)
+		goto clean;
+
+	return;
+clean:
+	sock_info(sockfd, "%s: close", __func__);
+	destroy_link(sockfd);
+}
+
 int server_do_pollin(int sockfd, struct link *ln)
 {
 	if (sockfd == ln->local_sockfd) {
-		if (ln->state & SERVER_PENDING) {
-			sock_info(sockfd, "%s: server pending",
-				  __func__);
-			goto out;
-		} else if (server_do_local_read(sockfd, ln) == -1) {
+		if (server_do_local_read(sockfd, ln) == -1)
 			goto clean;
-		} else {
-			goto out;
-		}
 	} else if (sockfd == ln->server_sockfd) {
-		if (ln->state & LOCAL_PENDING) {
-			sock_info(sockfd, "%s: local pending",
-				  __func__);
-			goto out;
-		} else if (server_do_remote_read(sockfd, ln) == -1) {
+		if (server_do_remote_read(sockfd, ln) == -1)
 			goto clean;
-		} else {
-			goto out;
-		}
 	}
 
-out:
 	return 0;
 clean:
 	sock_info(sockfd, "%s: close", __func__);
@@ -153,58 +191,55 @@ clean:
 
 int server_do_pollout(int sockfd, struct link *ln)
 {
-	int optval, ret;
-	int optlen = sizeof(optval);
+	int ret;
 
 	/* write to local */
 	if (sockfd == ln->local_sockfd) {
 		if (ln->state & LOCAL_SEND_PENDING) {
-			ret = do_send(sockfd, ln, "cipher", 0);
+			ret = do_send(sockfd, ln, &ln->down);
 			if (ret == -2) {
 				goto clean;
 			} else if (ret == -1) {
 				goto out;
-			} else {
-				ln->state &= ~LOCAL_SEND_PENDING;
-				goto out;
 			}
+
+			ln->state &= ~LOCAL_SEND_PENDING;
+			poll_rm(sockfd, POLLOUT);
+
+			/* local has room again, resume reading remote */
+			if (ln->server_sockfd >= 0)
+				poll_add(ln->server_sockfd, POLLIN);
+			goto out;
 		} else {
 			poll_rm(sockfd, POLLOUT);
 		}
 	} else {
 		/* pending connect finished */
 		if (!(ln->state & SERVER)) {
-			if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
-				       &optval, (void *)&optlen) == -1) {
-				sock_warn(sockfd, "%s: getsockopt() %s",
-					  __func__, strerror(errno));
-				return -1;
-			}
-
-			if (optval == 0) {
-				sock_info(sockfd,
-					  "%s: pending connect() finished",
-					  __func__);
-				ln->time = time(NULL);
-				ln->state |= SERVER;
-			} else {
-				sock_warn(sockfd,
-					  "%s: pending connect() failed",
+			ret = connect_done(sockfd, ln);
+			if (ret == -2) {
+				sock_warn(sockfd, "%s: connect() failed",
 					  __func__);
 				goto clean;
+			} else if (ret == -1) {
+				goto out;
 			}
 		}
 
 		if (ln->state & SERVER_SEND_PENDING) {
-			ret = do_send(sockfd, ln, "text", 0);
+			ret = do_send(sockfd, ln, &ln->up);
 			if (ret == -2) {
 				goto clean;
 			} else if (ret == -1) {
 				goto out;
-			} else {
-				ln->state &= ~SERVER_SEND_PENDING;
-				goto out;
 			}
+
+			ln->state &= ~SERVER_SEND_PENDING;
+			poll_rm(sockfd, POLLOUT);
+
+			/* remote has room again, resume reading local */
+			poll_add(ln->local_sockfd, POLLIN);
+			goto out;
 		} else {
 			poll_rm(sockfd, POLLOUT);
 		}
@@ -218,11 +253,144 @@ clean:
 	return -1;
 }
 
+static void server_do_accept(int listenfd)
+{
+	int i, sockfd;
+	struct link *ln;
+
+	/* drain the backlog, but leave some time for the links */
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		sockfd = do_accept(listenfd);
+		if (sockfd == -1)
+			break;
+
+		ln = create_link(sockfd, "server");
+		if (ln == NULL) {
+			poll_del(sockfd);
+			close(sockfd);
+			continue;
+		}
+	}
+}
+
+static void stop_handler(int signo)
+{
+	stop_requested = 1;
+}
+
+/* write the dns cache to -F every DNS_CACHE_SAVE_INTERVAL */
+static void dns_cache_autosave(void)
+{
+	if (ss_opt.dns_file[0] == '\0' || current_time < dns_save_time)
+		return;
+
+	dns_cache_save(ss_opt.dns_file);
+	dns_save_time = current_time + DNS_CACHE_SAVE_INTERVAL;
+}
+
+static void pin_worker(int id)
+{
+	int ncpu;
+	cpu_set_t set;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(id % ncpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		pr_warn("%s: sched_setaffinity() %s\n",
+			__func__, strerror(errno));
+}
+
+static pid_t fork_worker(int id)
+{
+	pid_t pid, master = getpid();
+
+	pid = fork();
+	if (pid == -1) {
+		pr_err("%s: fork() %s\n", __func__, strerror(errno));
+		return -1;
+	} else if (pid > 0) {
+		return pid;
+	}
+
+	/* don't outlive the master, not even if it died before prctl() */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != master)
+		_exit(0);
+
+	if (ss_opt.affinity)
+		pin_worker(id);
+
+	/* the pool was emptied by fork(), ivs of our own */
+	if (crypto_iv_refill() == -1)
+		pr_warn("%s: crypto_iv_refill failed\n", __func__);
+
+	pr_info("worker %d started, pid %d\n", id, getpid());
+	return 0;
+}
+
+/**
+ * start_workers - fork ss_opt.workers workers, restart dead ones
+ *
+ * Only returns in the workers. Each worker binds its own listening
+ * sockets(SO_REUSEPORT) and owns its own link table and event loop,
+ * nothing is shared between them.
+ */
+static void start_workers(void)
+{
+	int i, status;
+	pid_t pid, *pids;
+
+	pids = calloc(ss_opt.workers, sizeof(pid_t));
+	if (pids == NULL)
+		pr_exit("%s: calloc failed\n", __func__);
+
+	/* kill -USR1 the process group for stats, only workers have
+	 * any to report */
+	signal(SIGUSR1, SIG_IGN);
+
+	for (i = 0; i < ss_opt.workers; i++) {
+		pids[i] = fork_worker(i);
+		if (pids[i] == 0)
+			return;
+		else if (pids[i] == -1)
+			pr_exit("%s: can't start worker %d\n", __func__, i);
+	}
+
+	while (1) {
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+
+			pr_exit("%s: wait() %s\n", __func__, strerror(errno));
+		}
+
+		for (i = 0; i < ss_opt.workers; i++) {
+			if (pids[i] != pid)
+				continue;
+
+			pr_warn("%s: worker %d(pid %d) exited, restart it\n",
+				__func__, i, pid);
+			sleep(1);
+			pids[i] = fork_worker(i);
+			if (pids[i] == 0)
+				return;
+
+			break;
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	short revents;
-	int i, listenfd, sockfd;
+	int i, nevents, listenfd, udpfd, resolvefd, sockfd;
 	int ret = 0;
+	struct poll_event events[MAX_POLL_EVENTS];
 	struct link *ln;
 	struct addrinfo *local_ai_tcp = NULL;
 	struct addrinfo *local_ai_udp = NULL;
@@ -260,65 +428,109 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
+	/* before the fork, every worker starts with what was saved */
+	time_update();
+	if (dns_cache_init(ss_opt.dns_cache) == -1) {
+		ret = -1;
+		goto out;
+	}
+
+	if (ss_opt.dns_file[0])
+		dns_cache_load(ss_opt.dns_file);
+
+	if (ss_opt.workers > 1)
+		start_workers();
+
+	/* a worker gets SIGTERM when the master dies, see fork_worker() */
+	signal(SIGTERM, stop_handler);
+	signal(SIGINT, stop_handler);
 	ss_init();
+	time_update();
+	dns_save_time = current_time + DNS_CACHE_SAVE_INTERVAL;
+	if (resolve_init(ss_opt.resolvers, ss_opt.nameserver,
+			 server_do_resolved) == -1) {
+		ret = -1;
+		goto out;
+	}
+
+	resolvefd = resolve_fd();
 	listenfd = do_listen(local_ai_tcp, "tcp");
-	clients[0].fd = listenfd;
-	clients[0].events = POLLIN;
-	listenfd = do_listen(local_ai_udp, "udp");
-	clients[1].fd = listenfd;
-	clients[1].events = POLLIN;
+	udpfd = do_listen(local_ai_udp, "udp");
+	if (poll_set(listenfd, POLLIN) == -1 ||
+	    poll_set(udpfd, POLLIN) == -1 ||
+	    poll_set(resolvefd, POLLIN) == -1) {
+		ret = -1;
+		goto out;
+	}
 
-	while (1) {
+	while (!stop_requested) {
 		pr_debug("start polling\n");
-		ret = poll(clients, nfds, TCP_INACTIVE_TIMEOUT * 1000);
-		if (ret == -1) {
+		nevents = poll_wait(events, MAX_POLL_EVENTS,
+				    timer_timeout());
+		time_update();
+		if (nevents == -1) {
 			err_exit("poll error");
-		} else if (ret == 0) {
+		} else if (nevents == 0) {
+			/* idle, a good time to make ivs */
+			crypto_iv_refill();
 			reaper();
+			dns_cache_autosave();
 			continue;
 		}
 
-		if (clients[0].revents & POLLIN) {
-			sockfd = accept(clients[0].fd, NULL, NULL);
-			if (sockfd == -1) {
-				pr_warn("accept error\n");
-			} else if (poll_set(sockfd, POLLIN) == -1) {
-				close(sockfd);
-			} else {
-				ln = create_link(sockfd, "server");
-				if (ln == NULL) {
-					poll_del(sockfd);
-					close(sockfd);
-				}
+handle:
+		for (i = 0; i < nevents; i++) {
+			sockfd = events[i].fd;
+			revents = events[i].revents;
+
+			if (sockfd == listenfd) {
+				if (revents & POLLIN)
+					server_do_accept(listenfd);
+
+				continue;
 			}
-		}
 
-		if (clients[1].revents & POLLIN) {
-			pr_warn("udp socks5 not supported(for now)\n");
-			/* ln = create_link(sockfd, "server"); */
-			/* if (ln != NULL) { */
-			/* 	check_ss_header(sockfd, ln); */
-			/* } */
-		}
+			if (sockfd == resolvefd) {
+				if (revents & POLLIN)
+					resolve_done();
 
-		for (i = 2; i < nfds; i++) {
-			sockfd = clients[i].fd;
-			if (sockfd == -1)
 				continue;
+			}
 
-			revents = clients[i].revents;
-			if (revents == 0)
+			if (sockfd == udpfd) {
+				if (revents & POLLIN)
+					pr_warn("udp socks5 not supported(for now)\n");
+				/* ln = create_link(sockfd, "server"); */
+				/* if (ln != NULL) { */
+				/* 	check_ss_header(sockfd, ln); */
+				/* } */
 				continue;
+			}
 
+			/* the link may have been destroyed through its
+			 * other sockfd earlier in this round */
 			ln = get_link(sockfd);
-			if (ln == NULL) {
-				sock_warn(sockfd, "close: can't get link");
-				close(sockfd);
+			if (ln == NULL)
+				continue;
+
+			/* a connect() attempt finished or failed, nothing
+			 * is read before one has won, see connect_done() */
+			if (!(ln->state & SERVER) &&
+			    sockfd != ln->local_sockfd)
+				revents = POLLOUT;
+
+			/* a sockfd whose reading is paused still reports
+			 * errors and hangups, don't spin on them */
+			if (!(revents & (POLLIN | POLLOUT)) &&
+			    revents & (POLLERR | POLLHUP)) {
+				sock_info(sockfd, "error or hangup, close");
+				destroy_link(sockfd);
 				continue;
 			}
 
 			if (revents & POLLIN) {
-				server_do_pollin(sockfd, ln);
+				if (server_do_pollin(sockfd, ln) == -1)
+					continue;
 			}
 
 			if (revents & POLLOUT) {
@@ -337,10 +549,24 @@ int main(int argc, char **argv)
 			/* } */
 		}
 
+		/* the recv()s and send()s queued by the handlers complete
+		 * in events of their own, still in this round */
+		nevents = poll_flush(events, MAX_POLL_EVENTS);
+		if (nevents == -1)
+			err_exit("poll error");
+		else if (nevents > 0)
+			goto handle;
+
 		reaper();
+		dns_cache_autosave();
 	}
 
+	if (ss_opt.dns_file[0])
+		dns_cache_save(ss_opt.dns_file);
+
 out:
+	resolve_exit();
+	dns_cache_exit();
 	crypto_exit();
 
 	if (local_ai_tcp)
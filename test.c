@@ -4,23 +4,2646 @@
  * it under the terms of the MIT license. See COPYING for details.
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <netdb.h>
 
 
+#include "aes.h"
+#include "chacha.h"
 #include "common.h"
 #include "crypto.h"
+#include "dns.h"
 #include "log.h"
+#include "preconnect.h"
+#include "resolve.h"
 
-int main(int argc, char **argv)
+#define BENCH_ROUNDS 200000
+/* a typical partial send on a loaded socket */
+#define BENCH_SEND_CHUNK 1448
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the flat buffer relay path: prepend and consume move the data */
+static void flat_add(char *buf, int *len, char *data, int size)
+{
+	memmove(buf + size, buf, *len);
+	memcpy(buf, data, size);
+	*len += size;
+}
+
+static void flat_rm(char *buf, int *len, int size)
+{
+	*len -= size;
+	memmove(buf, buf + size, *len);
+}
+
+/**
+ * bench_relay_buf - prepend an iv, then consume the packet in partial
+ * sends, the way one relayed packet goes through a link buffer
+ */
+static void bench_relay_buf(void)
+{
+	int i, n, len;
+	double start, flat_ns, ring_ns;
+	char iv[EVP_MAX_IV_LENGTH] = {0};
+	char *flat;
+	struct ss_buf buf;
+
+	memset(&buf, 0, sizeof(buf));
+	flat = malloc(TEXT_BUF_SIZE + EVP_MAX_IV_LENGTH);
+	buf.size = BUF_HEADROOM + TEXT_BUF_SIZE;
+	buf.data = malloc(buf.size);
+	if (flat == NULL || buf.data == NULL)
+		pr_exit("%s: malloc failed\n", __func__);
+
+	memset(flat, 'x', TEXT_BUF_SIZE + EVP_MAX_IV_LENGTH);
+	memset(buf.data, 'x', buf.size);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		len = TEXT_BUF_SIZE;
+		flat_add(flat, &len, iv, sizeof(iv));
+		while (len > 0) {
+			n = len < BENCH_SEND_CHUNK ? len : BENCH_SEND_CHUNK;
+			flat_rm(flat, &len, n);
+		}
+	}
+	flat_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		buf_reset(&buf);
+		buf.len = TEXT_BUF_SIZE;
+		add_data(-1, &buf, iv, sizeof(iv));
+		while (buf.len > 0) {
+			n = buf.len < BENCH_SEND_CHUNK ?
+				buf.len : BENCH_SEND_CHUNK;
+			rm_data(-1, &buf, n);
+		}
+	}
+	ring_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+	printf("relay buffer, %d byte packet, %d byte sends:\n",
+	       TEXT_BUF_SIZE, BENCH_SEND_CHUNK);
+	printf("  flat buffer:     %8.1f ns/packet\n", flat_ns);
+	printf("  headroom buffer: %8.1f ns/packet\n", ring_ns);
+
+	free(flat);
+	free(buf.data);
+}
+
+#define IV_TEST_COUNT (IV_POOL_SIZE * 64)
+
+/* wakeups measured at each size, the slow ones get fewer */
+#define BENCH_POLL_WAKEUPS (4 * 1000 * 1000)
+
+/**
+ * bench_poll_idle_one - microseconds a wakeup with one ready sockfd
+ * costs the backend of ss_opt.event among nidle idle ones
+ *
+ * An idle connection is stood in for by an eventfd, which costs the
+ * backend as much as an idle socket and the process one fd instead of
+ * two.
+ *
+ * Return: microseconds per wakeup, -1 if the fds aren't there
+ */
+static double bench_poll_idle_one(int nidle)
+{
+	int i, n, rounds, sv[2];
+	int *fds;
+	char c = 'x';
+	double start, us = -1;
+	struct poll_event events[MAX_POLL_EVENTS];
+
+	fds = malloc(nidle * sizeof(int));
+	if (fds == NULL)
+		pr_exit("%s: malloc failed\n", __func__);
+
+	ss_init();
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1)
+		pr_exit("%s: socketpair %s\n", __func__, strerror(errno));
+
+	for (n = 0; n < nidle; n++) {
+		fds[n] = eventfd(0, EFD_NONBLOCK);
+		if (fds[n] == -1 || poll_set(fds[n], POLLIN) == -1)
+			goto out;
+	}
+
+	if (poll_set(sv[0], POLLIN) == -1)
+		goto out;
+
+	rounds = BENCH_POLL_WAKEUPS / nidle;
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		if (write(sv[1], &c, 1) != 1 ||
+		    poll_wait(events, MAX_POLL_EVENTS, -1) != 1 ||
+		    read(sv[0], &c, 1) != 1)
+			pr_exit("%s: wakeup failed\n", __func__);
+	}
+
+	us = (now_ns() - start) / rounds / 1e3;
+out:
+	if (n < nidle && fds[n] != -1)
+		close(fds[n]);
+
+	while (n-- > 0) {
+		poll_del(fds[n]);
+		close(fds[n]);
+	}
+
+	poll_del(sv[0]);
+	close(sv[0]);
+	close(sv[1]);
+	ss_exit();
+	free(fds);
+	return us;
+}
+
+/* the cost of a wakeup is what epoll is for, poll scans every fd */
+static void bench_poll_idle(void)
+{
+	int i, j;
+	double us;
+	static const int sizes[] = {1000, 10000, 50000};
+	static const char *const backends[] = {"poll", "epoll"};
+
+	printf("event loop wakeup, one ready sockfd among idle ones:\n");
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 2; j++) {
+			strcpy(ss_opt.event, backends[j]);
+			us = bench_poll_idle_one(sizes[i]);
+			if (us < 0)
+				printf("  %-5s %6d idle: fd limit too low, "
+				       "skipped\n", backends[j], sizes[i]);
+			else
+				printf("  %-5s %6d idle: %10.2f us/wakeup\n",
+				       backends[j], sizes[i], us);
+		}
+	}
+}
+
+static int iv_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, iv_len);
+}
+
+/**
+ * test_iv_unique - no iv comes out of the pool twice, whether it's
+ * refilled when idle or runs dry
+ *
+ * Return: 0 if all ivs are unique, -1 otherwise
+ */
+static int test_iv_unique(void)
+{
+	int i, ret = 0;
+	char *ivs;
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	ivs = malloc(IV_TEST_COUNT * iv_len);
+	if (ivs == NULL)
+		pr_exit("%s: malloc failed\n", __func__);
+
+	for (i = 0; i < IV_TEST_COUNT; i++) {
+		/* an idle loop now and then */
+		if (i % 100 == 0)
+			crypto_iv_refill();
+
+		if (crypto_iv_get(ivs + i * iv_len) == -1)
+			pr_exit("%s: crypto_iv_get failed\n", __func__);
+	}
+
+	qsort(ivs, IV_TEST_COUNT, iv_len, iv_cmp);
+	for (i = 1; i < IV_TEST_COUNT; i++)
+		if (memcmp(ivs + (i - 1) * iv_len, ivs + i * iv_len,
+			   iv_len) == 0)
+			ret = -1;
+
+	printf("iv pool: %d ivs, %s\n", IV_TEST_COUNT,
+	       ret ? "REUSED" : "all unique");
+
+	free(ivs);
+	crypto_exit();
+	return ret;
+}
+
+/**
+ * test_iv_fork - a forked worker doesn't hand out the ivs of the pool
+ * it inherited, which its parent and siblings hand out too
+ *
+ * Return: 0 if the two processes drew different ivs, -1 otherwise
+ */
+static int test_iv_fork(void)
+{
+	int i, n, status, pipefd[2], ret = 0;
+	char *ivs;
+	pid_t pid;
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	/* the parent's ivs first, the child's after them */
+	ivs = malloc(2 * IV_POOL_SIZE * iv_len);
+	if (ivs == NULL || pipe(pipefd) == -1)
+		pr_exit("%s: malloc or pipe failed\n", __func__);
+
+	pid = fork();
+	if (pid == -1)
+		pr_exit("%s: fork %s\n", __func__, strerror(errno));
+
+	if (pid == 0) {
+		close(pipefd[0]);
+		for (i = 0; i < IV_POOL_SIZE; i++)
+			if (crypto_iv_get(ivs + i * iv_len) == -1)
+				_exit(1);
+
+		n = IV_POOL_SIZE * iv_len;
+		_exit(write(pipefd[1], ivs, n) == n ? 0 : 1);
+	}
+
+	close(pipefd[1]);
+	for (i = 0; i < IV_POOL_SIZE; i++)
+		if (crypto_iv_get(ivs + i * iv_len) == -1)
+			pr_exit("%s: crypto_iv_get failed\n", __func__);
+
+	for (n = 0; n < IV_POOL_SIZE * iv_len; n += i) {
+		i = read(pipefd[0], ivs + IV_POOL_SIZE * iv_len + n,
+			 IV_POOL_SIZE * iv_len - n);
+		if (i <= 0)
+			break;
+	}
+
+	close(pipefd[0]);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0 || n != IV_POOL_SIZE * iv_len)
+		pr_exit("%s: child failed\n", __func__);
+
+	qsort(ivs, 2 * IV_POOL_SIZE, iv_len, iv_cmp);
+	for (i = 1; i < 2 * IV_POOL_SIZE; i++)
+		if (memcmp(ivs + (i - 1) * iv_len, ivs + i * iv_len,
+			   iv_len) == 0)
+			ret = -1;
+
+	printf("iv pool: %d ivs from a parent and its child, %s\n",
+	       2 * IV_POOL_SIZE, ret ? "REUSED" : "all unique");
+
+	free(ivs);
+	crypto_exit();
+	return ret;
+}
+
+/* a link of its own on each side, local_sockfd 0 reads into up */
+/* a link whose up buffer takes packets of size bytes */
+static void fake_link_size(struct link *ln, int size)
+{
+	memset(ln, 0, sizeof(*ln));
+	ln->local_sockfd = 0;
+	ln->server_sockfd = 1;
+	ln->local_ctx = crypto_ctx_get();
+	ln->server_ctx = crypto_ctx_get();
+	/* a whole packet is put in at once, the iv of the first one
+	 * too */
+	ln->up.size = BUF_HEADROOM + size + crypto_tailroom(size) +
+		MAX_IV_LEN;
+	ln->up.data = malloc(ln->up.size);
+	if (ln->local_ctx == NULL || ln->server_ctx == NULL ||
+	    ln->up.data == NULL)
+		pr_exit("%s: failed\n", __func__);
+
+	buf_reset(&ln->up);
+}
+
+static void fake_link(struct link *ln)
+{
+	fake_link_size(ln, crypto_buf_size());
+}
+
+static void free_fake_link(struct link *ln)
+{
+	crypto_ctx_put(ln->local_ctx);
+	crypto_ctx_put(ln->server_ctx);
+	free(ln->up.data);
+}
+
+/* what do_send() would send: the iv of the first packet, then data */
+static int take_cipher(struct ss_buf *buf, char *out)
+{
+	int len = buf->pre_len;
+
+	memcpy(out, buf->pre, buf->pre_len);
+	memcpy(out + len, buf_ptr(buf), buf->len);
+	len += buf->len;
+	buf->pre_len = 0;
+	buf_reset(buf);
+	return len;
+}
+
+/* what do_read() would do with size bytes received */
+static void put_cipher(struct ss_buf *buf, char *data, int size)
+{
+	buf->len += buf->rest;
+	buf->rest = 0;
+	if (buf->len == 0) {
+		buf_reset(buf);
+	} else if (buf->head + buf->len + size > buf->size) {
+		memmove(buf->data + BUF_HEADROOM, buf_ptr(buf), buf->len);
+		buf->head = BUF_HEADROOM;
+	}
+
+	memcpy(buf_ptr(buf) + buf->len, data, size);
+	buf->len += size;
+}
+
+#define STREAM_TEST_PACKETS 16
+/* cuts the stream across packet, block and chunk boundaries */
+#define STREAM_TEST_PIECE 1000
+
+/**
+ * test_stream - packets encrypted by one link come out of another
+ * intact, however the stream is cut up on the way. Aead methods seal
+ * in chunks of MIN_CHUNK_SIZE and must refuse a flipped bit.
+ *
+ * Return: 0 on success or if the method is unavailable, -1 otherwise
+ */
+static int test_stream(const char *method)
+{
+	int i, n, len, mask, clen = 0, plen = 0, ret = -1;
+	struct link a, b;
+	char *plain, *cipher, *out;
+	int size = STREAM_TEST_PACKETS * TEXT_BUF_SIZE;
+
+	strcpy(ss_opt.method, method);
+	ss_opt.chunk_size = MIN_CHUNK_SIZE;
+	if (crypto_init("test", ss_opt.method) == -1) {
+		printf("stream %s: unavailable\n", method);
+		crypto_exit();
+		return 0;
+	}
+
+	plain = malloc(size);
+	out = malloc(size);
+	/* the packets aren't multiples of the chunk, leave room for a
+	 * partial chunk each */
+	cipher = malloc(size + MAX_IV_LEN + (size / MIN_CHUNK_SIZE +
+			STREAM_TEST_PACKETS * 2) * AEAD_CHUNK_OVERHEAD);
+	if (plain == NULL || out == NULL || cipher == NULL)
+		pr_exit("%s: malloc failed\n", __func__);
+
+	for (i = 0; i < size; i++)
+		plain[i] = rand();
+
+	fake_link(&a);
+	fake_link(&b);
+
+	/* packets of different sizes, not multiples of the chunk */
+	for (i = 0; i < size; i += len) {
+		len = TEXT_BUF_SIZE - i % 4099;
+		if (len > size - i)
+			len = size - i;
+
+		memcpy(buf_ptr(&a.up), plain + i, len);
+		a.up.len = len;
+		if (crypto_encrypt(0, &a) == -1)
+			goto out;
+
+		clen += take_cipher(&a.up, cipher + clen);
+	}
+
+	for (i = 0; i < clen; i += n) {
+		n = clen - i < STREAM_TEST_PIECE ? clen - i : STREAM_TEST_PIECE;
+		put_cipher(&b.up, cipher + i, n);
+		if (!(b.state & SS_IV_RECEIVED) && b.up.len <= iv_len)
+			continue;
+
+		if (crypto_decrypt(0, &b) == -1)
+			goto out;
+
+		memcpy(out + plen, buf_ptr(&b.up), b.up.len);
+		plen += b.up.len;
+		rm_data(0, &b.up, b.up.len);
+	}
+
+	if (plen != size || b.up.rest != 0 || memcmp(plain, out, size))
+		goto out;
+
+	if (!crypto_aead()) {
+		ret = 0;
+		goto out;
+	}
+
+	/* a flipped bit in the next packet fails the tag */
+	memcpy(buf_ptr(&a.up), plain, TEXT_BUF_SIZE);
+	a.up.len = TEXT_BUF_SIZE;
+	if (crypto_encrypt(0, &a) == -1)
+		goto out;
+
+	clen = take_cipher(&a.up, cipher);
+	cipher[clen / 2] ^= 1;
+	put_cipher(&b.up, cipher, clen);
+	/* the failure is expected, keep it out of the log */
+	mask = setlogmask(LOG_UPTO(LOG_ERR));
+	n = crypto_decrypt(0, &b);
+	setlogmask(mask);
+	if (n != -1)
+		goto out;
+
+	ret = 0;
+out:
+	printf("stream %s on %s: %d bytes in %d byte pieces, %s\n",
+	       method, crypto_engine(), size, STREAM_TEST_PIECE,
+	       ret ? "FAILED" : "ok");
+	free_fake_link(&a);
+	free_fake_link(&b);
+	free(plain);
+	free(out);
+	free(cipher);
+	crypto_exit();
+	return ret;
+}
+
+#define BENCH_SETUP_ROUNDS 20000
+
+/**
+ * bench_cipher_setup - per stream cipher setup of every stream
+ * method, full key expansion against what crypto_ctx_init() does,
+ * and the keystream of a link checked against the full init
+ */
+static void bench_cipher_setup(void)
+{
+	int i, n, len;
+	const char *method;
+	const EVP_CIPHER *cipher;
+	double start, full_ns, tmpl_ns;
+	char pwd[] = "bench";
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	unsigned char iv[MAX_IV_LEN] = {0x42};
+	unsigned char out_full[64];
+	EVP_CIPHER_CTX *evp;
+	struct link a;
+	void *ctx;
+
+	evp = EVP_CIPHER_CTX_new();
+	if (evp == NULL)
+		pr_exit("%s: EVP_CIPHER_CTX_new failed\n", __func__);
+
+	printf("cipher setup per stream:\n");
+	for (i = 0; (method = crypto_method(i)) != NULL; i++) {
+		strcpy(ss_opt.method, method);
+		if (crypto_init(pwd, ss_opt.method) == -1) {
+			printf("  %-16s unavailable\n", method);
+			crypto_exit();
+			continue;
+		}
+
+		/* aead streams derive a key of their own, and the
+		 * built-in chacha20 has nothing in openssl to compare
+		 * with */
+		cipher = EVP_get_cipherbyname(method);
+		if (crypto_aead() || cipher == NULL) {
+			crypto_exit();
+			continue;
+		}
+
+		EVP_BytesToKey(cipher, EVP_md5(), NULL, (void *)pwd,
+			       strlen(pwd), 1, key, NULL);
+
+		start = now_ns();
+		for (n = 0; n < BENCH_SETUP_ROUNDS; n++)
+			EVP_EncryptInit_ex(evp, cipher, NULL, key, iv);
+		full_ns = (now_ns() - start) / BENCH_SETUP_ROUNDS;
+
+		ctx = crypto_ctx_get();
+		start = now_ns();
+		for (n = 0; n < BENCH_SETUP_ROUNDS; n++)
+			crypto_ctx_init(ctx, (void *)iv, true);
+		tmpl_ns = (now_ns() - start) / BENCH_SETUP_ROUNDS;
+		crypto_ctx_put(ctx);
+
+		fake_link(&a);
+		memset(buf_ptr(&a.up), 0, sizeof(out_full));
+		a.up.len = sizeof(out_full);
+		crypto_encrypt(0, &a);
+
+		memset(out_full, 0, sizeof(out_full));
+		EVP_EncryptInit_ex(evp, cipher, NULL, key, (void *)a.local_iv);
+		EVP_EncryptUpdate(evp, out_full, &len, out_full,
+				  sizeof(out_full));
+
+		printf("  %-16s full init: %8.1f ns, template: %8.1f ns%s\n",
+		       method, full_ns, tmpl_ns,
+		       memcmp(out_full, buf_ptr(&a.up), sizeof(out_full)) ?
+		       " MISMATCH" : "");
+		free_fake_link(&a);
+		crypto_exit();
+	}
+
+	EVP_CIPHER_CTX_free(evp);
+}
+
+#define WRITE_ALL_CHUNK (64 * 1024)
+
+#define BENCH_CRYPT_ROUNDS 20000
+
+/**
+ * crypt_packets - push rounds packets of size bytes through a pair of
+ * links, the ns per packet it takes to encrypt and to decrypt them
+ * end up in enc_ns and dec_ns
+ */
+static void crypt_packets(int size, int rounds, double *enc_ns,
+			  double *dec_ns)
+{
+	int i, clen;
+	double start;
+	struct link a, b;
+	char *cipher;
+
+	*enc_ns = *dec_ns = 0;
+	fake_link_size(&a, size);
+	fake_link_size(&b, size);
+	cipher = malloc(a.up.size + MAX_IV_LEN);
+	if (cipher == NULL)
+		pr_exit("%s: malloc failed\n", __func__);
+
+	memset(buf_ptr(&a.up), 'x', size);
+	for (i = 0; i < rounds; i++) {
+		a.up.len = size;
+		start = now_ns();
+		if (crypto_encrypt(0, &a) == -1)
+			pr_exit("%s: encrypt failed\n", __func__);
+		*enc_ns += now_ns() - start;
+
+		clen = take_cipher(&a.up, cipher);
+		put_cipher(&b.up, cipher, clen);
+
+		start = now_ns();
+		if (crypto_decrypt(0, &b) != size)
+			pr_exit("%s: decrypt failed\n", __func__);
+		*dec_ns += now_ns() - start;
+
+		rm_data(0, &b.up, b.up.len);
+	}
+
+	*enc_ns /= rounds;
+	*dec_ns /= rounds;
+	free(cipher);
+	free_fake_link(&a);
+	free_fake_link(&b);
+}
+
+/**
+ * bench_crypt - en/decryption throughput of full packets through a
+ * pair of links, chunk size of 0 means the default
+ */
+static void bench_crypt(const char *method, int chunk_size)
+{
+	double enc_ns, dec_ns;
+
+	strcpy(ss_opt.method, method);
+	ss_opt.chunk_size = chunk_size;
+	if (crypto_init("bench", ss_opt.method) == -1) {
+		printf("  %-24s unavailable\n", method);
+		crypto_exit();
+		return;
+	}
+
+	crypt_packets(TEXT_BUF_SIZE, BENCH_CRYPT_ROUNDS, &enc_ns, &dec_ns);
+	printf("  %-24s chunk %5d: encrypt %7.1f MB/s, decrypt %7.1f MB/s\n",
+	       method, crypto_aead() ? ss_opt.chunk_size : 0,
+	       1e3 * TEXT_BUF_SIZE / enc_ns, 1e3 * TEXT_BUF_SIZE / dec_ns);
+	crypto_exit();
+}
+
+static void bench_crypt_all(void)
+{
+	int i;
+	const char *method;
+
+	printf("en/decryption of %d byte packets:\n", TEXT_BUF_SIZE);
+	for (i = 0; (method = crypto_method(i)) != NULL; i++)
+		bench_crypt(method, 0);
+
+	/* the cost of small chunks */
+	bench_crypt("aes-256-gcm", MIN_CHUNK_SIZE);
+	bench_crypt("chacha20-ietf-poly1305", MIN_CHUNK_SIZE);
+}
+
+/* bytes each packet size of the csv bench is timed over */
+#define BENCH_CSV_BYTES (32 << 20)
+#define BENCH_CSV_SETUP_ROUNDS 100000
+
+static const int bench_csv_sizes[] = {64, 1500, 8192, 65536};
+
+/* ns a new link takes to get a cipher context started on a fresh iv */
+static double link_setup_ns(void)
+{
+	int i;
+	double start;
+	char iv[MAX_IV_LEN];
+	void *ctx;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_CSV_SETUP_ROUNDS; i++) {
+		ctx = crypto_ctx_get();
+		if (ctx == NULL || crypto_iv_get(iv) == -1 ||
+		    crypto_ctx_init(ctx, iv, true) == -1)
+			pr_exit("%s: failed\n", __func__);
+
+		crypto_ctx_put(ctx);
+	}
+
+	return (now_ns() - start) / BENCH_CSV_SETUP_ROUNDS;
+}
+
+/* the csv rows of method with chunk size chunk_size, whether it's an
+ * aead method */
+static bool bench_csv_method(const char *method, int chunk_size)
+{
+	int i, size;
+	bool aead;
+	double enc_ns, dec_ns;
+
+	strcpy(ss_opt.method, method);
+	ss_opt.chunk_size = chunk_size;
+	if (crypto_init("bench", ss_opt.method) == -1) {
+		crypto_exit();
+		return false;
+	}
+
+	chunk_size = crypto_aead() ? ss_opt.chunk_size : 0;
+	printf("%s,%s,%d,setup,0,%.1f,ns\n", method, crypto_engine(),
+	       chunk_size, link_setup_ns());
+
+	for (i = 0; i < sizeof(bench_csv_sizes) / sizeof(bench_csv_sizes[0]);
+	     i++) {
+		size = bench_csv_sizes[i];
+		crypt_packets(size, BENCH_CSV_BYTES / size, &enc_ns, &dec_ns);
+		printf("%s,%s,%d,encrypt,%d,%.1f,MB/s\n", method,
+		       crypto_engine(), chunk_size, size, 1e3 * size / enc_ns);
+		printf("%s,%s,%d,decrypt,%d,%.1f,MB/s\n", method,
+		       crypto_engine(), chunk_size, size, 1e3 * size / dec_ns);
+	}
+
+	aead = crypto_aead();
+	crypto_exit();
+	return aead;
+}
+
+/**
+ * bench_csv - what make bench runs, every available method as csv
+ *
+ * A row is one measurement: the engine chosen for the method, the
+ * chunk size of an aead method, then either the per link setup cost
+ * or the en/decryption throughput of packets of a size. Unavailable
+ * methods have no rows.
+ */
+static void bench_csv(void)
+{
+	int i;
+	const char *method;
+
+	printf("method,engine,chunk_size,op,bytes,value,unit\n");
+	for (i = 0; (method = crypto_method(i)) != NULL; i++)
+		if (bench_csv_method(method, 0))
+			bench_csv_method(method, MIN_CHUNK_SIZE);
+}
+
+static int unhex(const char *hex, unsigned char *out)
+{
+	int n;
+
+	for (n = 0; hex[n * 2]; n++)
+		sscanf(hex + n * 2, "%2hhx", &out[n]);
+
+	return n;
+}
+
+/* RFC 7539 2.4.2, the sunscreen text, and A.2 #2 */
+static const struct {
+	const char *key;
+	const char *nonce;
+	uint32_t counter;
+	const char *plain;
+	const char *cipher;
+} chacha20_vectors[] = {
+	{
+		"000102030405060708090a0b0c0d0e0f"
+		"101112131415161718191a1b1c1d1e1f",
+		"000000000000004a00000000", 1,
+		"4c616469657320616e642047656e746c"
+		"656d656e206f662074686520636c6173"
+		"73206f66202739393a204966204920636f"
+		"756c64206f6666657220796f75206f6e"
+		"6c79206f6e652074697020666f722074"
+		"686520667574757265"
+		"2c2073756e73637265656e20776f756c"
+		"642062652069742e",
+		"6e2e359a2568f98041ba0728dd0d6981"
+		"e97e7aec1d4360c20a27afccfd9fae0b"
+		"f91b65c5524733ab8f593dabcd62b357"
+		"1639d624e65152ab8f530c359f0861d8"
+		"07ca0dbf500d6a6156a38e088a22b65e"
+		"52bc514d16ccf806818ce91ab7793736"
+		"5af90bbf74a35be6b40b8eedf2785e42"
+		"874d",
+	},
+	{
+		"00000000000000000000000000000000"
+		"00000000000000000000000000000001",
+		"000000000000000000000002", 1,
+		"416e79207375626d697373696f6e2074"
+		"6f20746865204945544620696e74656e"
+		"6465642062792074686520436f6e7472"
+		"696275746f7220666f72207075626c69"
+		"636174696f6e20617320616c6c206f72"
+		"2070617274206f6620616e2049455446"
+		"20496e7465726e65742d447261667420"
+		"6f722052464320616e6420616e792073"
+		"746174656d656e74206d616465207769"
+		"7468696e2074686520636f6e74657874"
+		"206f6620616e20494554462061637469"
+		"7669747920697320636f6e7369646572"
+		"656420616e20224945544620436f6e74"
+		"7269627574696f6e222e205375636820"
+		"73746174656d656e747320696e636c75"
+		"6465206f72616c2073746174656d656e"
+		"747320696e2049455446207365737369"
+		"6f6e732c2061732077656c6c20617320"
+		"7772697474656e20616e6420656c6563"
+		"74726f6e696320636f6d6d756e696361"
+		"74696f6e73206d61646520617420616e"
+		"792074696d65206f7220706c6163652c"
+		"20776869636820617265206164647265"
+		"7373656420746f",
+		"a3fbf07df3fa2fde4f376ca23e827370"
+		"41605d9f4f4f57bd8cff2c1d4b7955ec"
+		"2a97948bd3722915c8f3d337f7d37005"
+		"0e9e96d647b7c39f56e031ca5eb6250d"
+		"4042e02785ececfa4b4bb5e8ead0440e"
+		"20b6e8db09d881a7c6132f420e527950"
+		"42bdfa7773d8a9051447b3291ce1411c"
+		"680465552aa6c405b7764d5e87bea85a"
+		"d00f8449ed8f72d0d662ab052691ca66"
+		"424bc86d2df80ea41f43abf937d3259d"
+		"c4b2d0dfb48a6c9139ddd7f76966e928"
+		"e635553ba76c5c879d7b35d49eb2e62b"
+		"0871cdac638939e25e8a1e0ef9d5280f"
+		"a8ca328b351c3c765989cbcf3daa8b6c"
+		"cc3aaf9f3979c92b3720fc88dc95ed84"
+		"a1be059c6499b9fda236e7e818b04b0b"
+		"c39c1e876b193bfe5569753f88128cc0"
+		"8aaa9b63d1a16f80ef2554d7189c411f"
+		"5869ca52c5b83fa36ff216b9c1d30062"
+		"bebcfd2dc5bce0911934fda79a86f6e6"
+		"98ced759c3ff9b6477338f3da4f9cd85"
+		"14ea9982ccafb341b2384dd902f3d1ab"
+		"7ac61dd29c6f21ba5b862f3730e37cfd"
+		"c4fd806c22f221",
+	},
+};
+
+/**
+ * test_chacha20 - every kernel this cpu runs gives the RFC 7539
+ * answers, and the same stream as the scalar one however the data is
+ * cut up, which is what exercises the multi block paths
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_chacha20(void)
+{
+	int i, k, n, len, ret = 0;
+	const char *name;
+	struct chacha20_ctx ctx;
+	unsigned char key[CHACHA20_KEY_LEN], nonce[CHACHA20_NONCE_LEN];
+	unsigned char plain[512], cipher[512], out[4096], ref[4096];
+
+	/* the stream to compare with, in one go by the scalar kernel */
+	memset(key, 0x5a, sizeof(key));
+	memset(nonce, 0xa5, sizeof(nonce));
+	memset(ref, 0, sizeof(ref));
+	chacha20_use_kernel("scalar");
+	chacha20_init(&ctx, key);
+	chacha20_set_nonce(&ctx, nonce, 0);
+	chacha20_xor(&ctx, ref, ref, sizeof(ref));
+
+	for (k = 0; (name = chacha20_kernel_name(k)) != NULL; k++) {
+		if (chacha20_use_kernel(name) == -1) {
+			printf("chacha20 %s: not supported by this cpu\n",
+			       name);
+			continue;
+		}
+
+		for (i = 0; i < sizeof(chacha20_vectors) /
+			     sizeof(chacha20_vectors[0]); i++) {
+			unhex(chacha20_vectors[i].key, key);
+			unhex(chacha20_vectors[i].nonce, nonce);
+			len = unhex(chacha20_vectors[i].plain, plain);
+			unhex(chacha20_vectors[i].cipher, cipher);
+
+			chacha20_init(&ctx, key);
+			chacha20_set_nonce(&ctx, nonce,
+					   chacha20_vectors[i].counter);
+			chacha20_xor(&ctx, out, plain, len);
+			if (memcmp(out, cipher, len) != 0)
+				ret = -1;
+		}
+
+		/* 4096 bytes in pieces of 1 to 700 bytes */
+		memset(key, 0x5a, sizeof(key));
+		memset(nonce, 0xa5, sizeof(nonce));
+		memset(out, 0, sizeof(out));
+		chacha20_init(&ctx, key);
+		chacha20_set_nonce(&ctx, nonce, 0);
+		for (i = 0; i < sizeof(out); i += n) {
+			n = (i * 7 + 1) % 700 + 1;
+			if (n > sizeof(out) - i)
+				n = sizeof(out) - i;
+
+			chacha20_xor(&ctx, out + i, out + i, n);
+		}
+
+		if (memcmp(out, ref, sizeof(out)) != 0)
+			ret = -1;
+
+		printf("chacha20 %s: %s\n", name, ret ? "FAILED" : "ok");
+		if (ret)
+			break;
+	}
+
+	chacha20_use_kernel(NULL);
+	return ret;
+}
+
+#define BENCH_CHACHA20_ROUNDS 20000
+
+static void bench_chacha20(void)
+{
+	int i, k;
+	double start, ns;
+	const char *name;
+	struct chacha20_ctx ctx;
+	unsigned char key[CHACHA20_KEY_LEN] = {0};
+	unsigned char nonce[CHACHA20_NONCE_LEN] = {0};
+	static unsigned char buf[TEXT_BUF_SIZE];
+
+	printf("chacha20 kernels, %d byte packets:\n", TEXT_BUF_SIZE);
+	for (k = 0; (name = chacha20_kernel_name(k)) != NULL; k++) {
+		if (chacha20_use_kernel(name) == -1)
+			continue;
+
+		chacha20_init(&ctx, key);
+		chacha20_set_nonce(&ctx, nonce, 0);
+		start = now_ns();
+		for (i = 0; i < BENCH_CHACHA20_ROUNDS; i++)
+			chacha20_xor(&ctx, buf, buf, sizeof(buf));
+		ns = now_ns() - start;
+
+		printf("  %-8s %8.1f MB/s\n", name,
+		       1e3 * sizeof(buf) * BENCH_CHACHA20_ROUNDS / ns);
+	}
+
+	chacha20_use_kernel(NULL);
+}
+
+static const struct {
+	const char *name;
+	const EVP_CIPHER *(*cipher)(void);
+} aes_cfb_ciphers[] = {
+	{"aes-128-cfb", EVP_aes_128_cfb128},
+	{"aes-192-cfb", EVP_aes_192_cfb128},
+	{"aes-256-cfb", EVP_aes_256_cfb128},
+};
+
+#define NR_AES_CFB (sizeof(aes_cfb_ciphers) / sizeof(aes_cfb_ciphers[0]))
+/* not a multiple of the pipeline or of a block */
+#define AES_TEST_LEN (TEXT_BUF_SIZE + 77)
+
+/* en/decrypt len bytes in place in pieces of 1 to max bytes */
+static void aes_cfb_pieces(struct aes_cfb_ctx *ctx, unsigned char *buf,
+			   int len, int max, bool enc)
+{
+	int i, n;
+
+	for (i = 0; i < len; i += n) {
+		n = (i * 37 + 1) % max + 1;
+		if (n > len - i)
+			n = len - i;
+
+		if (enc)
+			aes_cfb_encrypt(ctx, buf + i, buf + i, n);
+		else
+			aes_cfb_decrypt(ctx, buf + i, buf + i, n);
+	}
+}
+
+/**
+ * test_aes_cfb - the aes-ni cfb gives what openssl gives, bit for bit,
+ * for every key size, in one go and cut into pieces that start and
+ * end anywhere in a block or a pipeline round
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_aes_cfb(void)
+{
+	int i, k, len, ret = 0;
+	struct aes_key key;
+	struct aes_cfb_ctx ctx;
+	EVP_CIPHER_CTX *evp;
+	unsigned char k_buf[32], iv[AES_BLOCK_LEN];
+	static unsigned char plain[AES_TEST_LEN], cipher[AES_TEST_LEN];
+	static unsigned char buf[AES_TEST_LEN];
+
+	if (!aesni_usable()) {
+		printf("aes-ni cfb: not supported by this cpu\n");
+		return 0;
+	}
+
+	evp = EVP_CIPHER_CTX_new();
+	if (evp == NULL)
+		pr_exit("%s: EVP_CIPHER_CTX_new failed\n", __func__);
+
+	for (i = 0; i < AES_TEST_LEN; i++)
+		plain[i] = rand();
+
+	for (k = 0; k < NR_AES_CFB; k++) {
+		const EVP_CIPHER *cipher_p = aes_cfb_ciphers[k].cipher();
+
+		for (i = 0; i < sizeof(k_buf); i++)
+			k_buf[i] = rand();
+		for (i = 0; i < sizeof(iv); i++)
+			iv[i] = rand();
+
+		EVP_EncryptInit_ex(evp, cipher_p, NULL, k_buf, iv);
+		EVP_EncryptUpdate(evp, cipher, &len, plain, AES_TEST_LEN);
+		aes_set_key(&key, k_buf, EVP_CIPHER_key_length(cipher_p));
+
+		/* whole, then in pieces around the pipeline size */
+		memcpy(buf, plain, AES_TEST_LEN);
+		aes_cfb_init(&ctx, &key, iv);
+		aes_cfb_encrypt(&ctx, buf, buf, AES_TEST_LEN);
+		if (memcmp(buf, cipher, AES_TEST_LEN) != 0)
+			ret = -1;
+
+		memcpy(buf, plain, AES_TEST_LEN);
+		aes_cfb_init(&ctx, &key, iv);
+		aes_cfb_pieces(&ctx, buf, AES_TEST_LEN, 300, true);
+		if (memcmp(buf, cipher, AES_TEST_LEN) != 0)
+			ret = -1;
+
+		memcpy(buf, cipher, AES_TEST_LEN);
+		aes_cfb_init(&ctx, &key, iv);
+		aes_cfb_decrypt(&ctx, buf, buf, AES_TEST_LEN);
+		if (memcmp(buf, plain, AES_TEST_LEN) != 0)
+			ret = -1;
+
+		memcpy(buf, cipher, AES_TEST_LEN);
+		aes_cfb_init(&ctx, &key, iv);
+		aes_cfb_pieces(&ctx, buf, AES_TEST_LEN, 1500, false);
+		if (memcmp(buf, plain, AES_TEST_LEN) != 0)
+			ret = -1;
+
+		printf("aes-ni cfb %s: %s\n", aes_cfb_ciphers[k].name,
+		       ret ? "FAILED" : "same as openssl");
+		if (ret)
+			break;
+	}
+
+	EVP_CIPHER_CTX_free(evp);
+	return ret;
+}
+
+#define BENCH_AES_ROUNDS 20000
+
+/* cfb decryption of full packets, openssl against aes-ni */
+static void bench_aes_cfb(void)
+{
+	int i, k, len;
+	double start, evp_ns, ni_ns;
+	struct aes_key key;
+	struct aes_cfb_ctx ctx;
+	EVP_CIPHER_CTX *evp;
+	unsigned char k_buf[32] = {0}, iv[AES_BLOCK_LEN] = {0};
+	static unsigned char buf[TEXT_BUF_SIZE];
+
+	if (!aesni_usable())
+		return;
+
+	evp = EVP_CIPHER_CTX_new();
+	if (evp == NULL)
+		pr_exit("%s: EVP_CIPHER_CTX_new failed\n", __func__);
+
+	printf("cfb decryption, %d byte packets:\n", TEXT_BUF_SIZE);
+	for (k = 0; k < NR_AES_CFB; k++) {
+		const EVP_CIPHER *cipher_p = aes_cfb_ciphers[k].cipher();
+
+		EVP_DecryptInit_ex(evp, cipher_p, NULL, k_buf, iv);
+		start = now_ns();
+		for (i = 0; i < BENCH_AES_ROUNDS; i++)
+			EVP_DecryptUpdate(evp, buf, &len, buf, sizeof(buf));
+		evp_ns = now_ns() - start;
+
+		aes_set_key(&key, k_buf, EVP_CIPHER_key_length(cipher_p));
+		aes_cfb_init(&ctx, &key, iv);
+		start = now_ns();
+		for (i = 0; i < BENCH_AES_ROUNDS; i++)
+			aes_cfb_decrypt(&ctx, buf, buf, sizeof(buf));
+		ni_ns = now_ns() - start;
+
+		printf("  %-12s openssl %7.1f MB/s, aes-ni x%d %7.1f MB/s\n",
+		       aes_cfb_ciphers[k].name,
+		       1e3 * sizeof(buf) * BENCH_AES_ROUNDS / evp_ns,
+		       AES_CFB_PIPELINE,
+		       1e3 * sizeof(buf) * BENCH_AES_ROUNDS / ni_ns);
+	}
+
+	EVP_CIPHER_CTX_free(evp);
+}
+
+/* names with "slow" in them are answered STUB_DNS_DELAY_MS late */
+#define STUB_DNS_DELAY_MS 500
+#define STUB_DNS_MAX_PENDING 16
+/* the address of every A record */
+#define STUB_DNS_ADDR "127.0.0.7"
+
+struct stub_reply {
+	double due_ns;
+	struct sockaddr_in to;
+	unsigned char msg[512];
+	int len;
+};
+
+static int stub_fd = -1;
+static volatile bool stub_stop;
+
+/* the reply to query q of len bytes, one A record or no answer */
+static int stub_answer(unsigned char *q, int len, unsigned char *r)
+{
+	int i = 12, qtype, rlen;
+	struct in_addr a;
+
+	while (i < len && q[i])
+		i += q[i] + 1;
+
+	if (i + 5 > len)
+		return -1;
+
+	qtype = q[i + 1] << 8 | q[i + 2];
+	rlen = i + 5;
+	memcpy(r, q, rlen);
+	r[2] = 0x81;
+	r[3] = 0x80;
+	/* qdcount 1, ancount, nscount and arcount 0 */
+	memset(r + 4, 0, 8);
+	r[5] = 1;
+	if (qtype != 1)
+		return rlen;
+
+	r[7] = 1;
+	/* pointer to the name, type A, class IN, ttl 60, 4 bytes */
+	memcpy(r + rlen, "\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04",
+	       12);
+	inet_pton(AF_INET, STUB_DNS_ADDR, &a);
+	memcpy(r + rlen + 12, &a, 4);
+	return rlen + 16;
+}
+
+/* a nameserver on 127.0.0.1 which holds back the slow answers */
+static void *stub_dns(void *arg)
+{
+	int i, n, len, npending = 0;
+	unsigned char q[512];
+	struct stub_reply pending[STUB_DNS_MAX_PENDING], *p;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pfd = {stub_fd, POLLIN, 0};
+
+	while (!stub_stop) {
+		poll(&pfd, 1, 10);
+		for (i = 0; i < npending; i++) {
+			if (pending[i].due_ns > now_ns())
+				continue;
+
+			sendto(stub_fd, pending[i].msg, pending[i].len, 0,
+			       (void *)&pending[i].to, sizeof(from));
+			pending[i--] = pending[--npending];
+		}
+
+		fromlen = sizeof(from);
+		len = recvfrom(stub_fd, q, sizeof(q), MSG_DONTWAIT,
+			       (void *)&from, &fromlen);
+		if (len < 12 || npending == STUB_DNS_MAX_PENDING)
+			continue;
+
+		p = &pending[npending];
+		n = stub_answer(q, len, p->msg);
+		if (n == -1)
+			continue;
+
+		p->len = n;
+		p->to = from;
+		p->due_ns = now_ns();
+		if (memmem(q + 12, len - 12, "slow", 4))
+			p->due_ns += STUB_DNS_DELAY_MS * 1e6;
+
+		npending++;
+	}
+
+	return NULL;
+}
+
+#define RESOLVE_TEST_LINKS 3
+
+static struct link *answered[RESOLVE_TEST_LINKS];
+static int nanswered;
+static bool answers_ok = true;
+
+static void test_resolved(struct link *ln, struct addrinfo *res, int err)
 {
+	char addr[INET6_ADDRSTRLEN] = "";
+	struct addrinfo *ai;
+
+	for (ai = res; ai; ai = ai->ai_next)
+		if (ai->ai_family == AF_INET)
+			inet_ntop(AF_INET, &((SA_IN *)ai->ai_addr)->sin_addr,
+				  addr, sizeof(addr));
+
+	if (err != 0 || strcmp(addr, STUB_DNS_ADDR) != 0)
+		answers_ok = false;
+
+	if (nanswered < RESOLVE_TEST_LINKS)
+		answered[nanswered++] = ln;
+
+	if (res)
+		freeaddrinfo(res);
+}
+
+/**
+ * test_resolve - a slow lookup doesn't hold up a fast one
+ *
+ * The stub nameserver answers "slow" names late. The fast name asked
+ * after the slow one must be answered first, the answer of a
+ * cancelled lookup must never show up.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_resolve(void)
+{
+	int ret = -1;
+	char ns[MAX_NAMESERVER_LEN + 1];
+	double start, fast_ms = 0;
+	struct sockaddr_in sin = {0};
+	socklen_t len = sizeof(sin);
+	struct link slow, fast, gone;
+	struct pollfd pfd;
+	pthread_t stub;
+
+	stub_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (stub_fd == -1 || bind(stub_fd, (void *)&sin, sizeof(sin)) == -1 ||
+	    getsockname(stub_fd, (void *)&sin, &len) == -1)
+		pr_exit("%s: stub nameserver %s\n", __func__, strerror(errno));
+
+	if (pthread_create(&stub, NULL, stub_dns, NULL) != 0)
+		pr_exit("%s: pthread_create failed\n", __func__);
+
+	sprintf(ns, "127.0.0.1:%d", ntohs(sin.sin_port));
+	if (resolve_init(2, ns, test_resolved) == -1)
+		goto out;
+
+	memset(&slow, 0, sizeof(slow));
+	memset(&fast, 0, sizeof(fast));
+	memset(&gone, 0, sizeof(gone));
+	start = now_ns();
+	if (resolve_start(&slow, "slow.example", "80", SOCK_STREAM) == -1 ||
+	    resolve_start(&fast, "fast.example", "80", SOCK_STREAM) == -1 ||
+	    resolve_start(&gone, "slow.gone.example", "80",
+			  SOCK_STREAM) == -1)
+		goto out;
+
+	resolve_cancel(&gone);
+
+	pfd.fd = resolve_fd();
+	pfd.events = POLLIN;
+	while (nanswered < 2 && now_ns() - start < 5e9) {
+		if (poll(&pfd, 1, 100) > 0)
+			resolve_done();
+
+		if (nanswered == 1 && fast_ms == 0)
+			fast_ms = (now_ns() - start) / 1e6;
+	}
+
+	/* time for the cancelled one to come back */
+	usleep(2 * STUB_DNS_DELAY_MS * 1000);
+	resolve_done();
+
+	if (answers_ok && nanswered == 2 && answered[0] == &fast &&
+	    answered[1] == &slow && fast_ms < STUB_DNS_DELAY_MS)
+		ret = 0;
+out:
+	printf("resolver: fast answer in %.1f ms behind a %d ms one, "
+	       "%d answers, %s\n", fast_ms, STUB_DNS_DELAY_MS, nanswered,
+	       ret ? "FAILED" : "ok");
+	resolve_exit();
+	stub_stop = true;
+	pthread_join(stub, NULL);
+	close(stub_fd);
+	return ret;
+}
+
+static struct addrinfo *numeric_ai(const char *addr)
+{
+	struct addrinfo hint, *res;
+
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_flags = AI_NUMERICHOST;
+	hint.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr, "80", &hint, &res) != 0)
+		pr_exit("%s: getaddrinfo %s failed\n", __func__, addr);
+
+	return res;
+}
+
+/**
+ * test_dns_cache - hits, expiry, negative entries, lru eviction, a
+ * save and load round trip and a stale file
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_dns_cache(void)
+{
+	int ret = -1;
+	char path[] = "/tmp/ss-dns-XXXXXX";
+	char addr[INET6_ADDRSTRLEN] = "";
+	time_t saved_time = current_time;
+	union ss_sockaddr addrs[DNS_CACHE_MAX_ADDRS];
+	struct addrinfo *v4, *v6;
+	time_t now;
+	FILE *fp;
+	int fd;
+
+	v4 = numeric_ai("10.0.0.1");
+	v6 = numeric_ai("::1");
+	v4->ai_next = v6;
+	current_time = 1000;
+	if (dns_cache_init(4) == -1)
+		goto out;
+
+	dns_cache_put("Example.COM", AF_UNSPEC, v4);
+	dns_cache_put("nx.example", AF_UNSPEC, NULL);
+	if (dns_cache_get("example.com", AF_UNSPEC, addrs, 8) != 2 ||
+	    addrs[0].in.sin_port != 0 ||
+	    addrs[1].sa.sa_family != AF_INET6 ||
+	    dns_cache_get("example.com", AF_INET, addrs, 8) != -1 ||
+	    dns_cache_get("nx.example", AF_UNSPEC, addrs, 8) != 0)
+		goto out;
+
+	current_time += DNS_CACHE_NEG_TTL;
+	if (dns_cache_get("nx.example", AF_UNSPEC, addrs, 8) != -1)
+		goto out;
+
+	/* example.com is used again after a, so a goes first */
+	dns_cache_put("a.example", AF_UNSPEC, v6);
+	dns_cache_put("b.example", AF_UNSPEC, v6);
+	dns_cache_put("c.example", AF_UNSPEC, v6);
+	dns_cache_get("example.com", AF_UNSPEC, addrs, 8);
+	dns_cache_put("d.example", AF_UNSPEC, v6);
+	if (dns_cache_get("a.example", AF_UNSPEC, addrs, 8) != -1 ||
+	    dns_cache_get("b.example", AF_UNSPEC, addrs, 8) != 1)
+		goto out;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		goto out;
+
+	close(fd);
+	if (dns_cache_save(path) != 4)
+		goto out;
+
+	dns_cache_exit();
+	current_time += 1;
+	if (dns_cache_init(4) == -1 || dns_cache_load(path) != 4 ||
+	    dns_cache_get("example.com", AF_UNSPEC, addrs, 8) != 2)
+		goto out;
+
+	inet_ntop(AF_INET, &addrs[0].in.sin_addr, addr, sizeof(addr));
+	if (strcmp(addr, "10.0.0.1") != 0)
+		goto out;
+
+	/* the ttl left when saved is what it lives */
+	current_time += DNS_CACHE_TTL - DNS_CACHE_NEG_TTL;
+	if (dns_cache_get("example.com", AF_UNSPEC, addrs, 8) != -1)
+		goto out;
+
+	/* expiries are wall clock, what expired since the save is
+	 * skipped, and no entry lives longer than its kind's ttl */
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		goto out;
+
+	now = time(NULL);
+	fprintf(fp, "old.example 0 %ld 10.0.0.2\n", (long)now - 10);
+	fprintf(fp, "far.example 0 %ld 10.0.0.3\n", (long)now + 3600);
+	fprintf(fp, "nx.example 0 %ld\n", (long)now + 3600);
+	fclose(fp);
+	dns_cache_exit();
+	if (dns_cache_init(4) == -1 || dns_cache_load(path) != 2 ||
+	    dns_cache_get("old.example", AF_UNSPEC, addrs, 8) != -1 ||
+	    dns_cache_get("nx.example", AF_UNSPEC, addrs, 8) != 0)
+		goto out;
+
+	current_time += DNS_CACHE_NEG_TTL;
+	if (dns_cache_get("nx.example", AF_UNSPEC, addrs, 8) != -1 ||
+	    dns_cache_get("far.example", AF_UNSPEC, addrs, 8) != 1)
+		goto out;
+
+	current_time += DNS_CACHE_TTL - DNS_CACHE_NEG_TTL;
+	if (dns_cache_get("far.example", AF_UNSPEC, addrs, 8) != -1)
+		goto out;
+
+	ret = 0;
+out:
+	printf("dns cache: %s\n", ret ? "FAILED" : "ok");
+	unlink(path);
+	dns_cache_exit();
+	current_time = saved_time;
+	v4->ai_next = NULL;
+	freeaddrinfo(v4);
+	freeaddrinfo(v6);
+	return ret;
+}
+
+#define SOAK_WARMUP 2000
+#define SOAK_LINKS 20000
+/* what rss may still grow by after the warmup */
+#define SOAK_RSS_SLACK (256 * 1024)
+
+static long rss_bytes(void)
+{
+	long size, rss = -1;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp == NULL)
+		return -1;
+
+	if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+		rss = -1;
+
+	fclose(fp);
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * test_soak_rss - links to a literal ip come and go without the
+ * process growing
+ *
+ * Every link gets the ss header of a listener on 127.0.0.1, connects
+ * to it through check_ss_header() and is destroyed again. Once the
+ * pools are warm, rss has to stay where it is.
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_soak_rss(void)
+{
+	int i, fd, sv[2], listenfd, ret = -1;
+	long rss_start = 0, rss_end = 0;
+	char header[1 + 4 + 2];
+	struct sockaddr_in sin = {0};
+	socklen_t len = sizeof(sin);
+	struct linger reset = {1, 0};
+	struct pollfd pfd;
+	struct link *ln;
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	strcpy(ss_opt.event, "epoll");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	ss_init();
+	time_update();
+
+	listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listenfd == -1 || bind(listenfd, (void *)&sin, sizeof(sin)) == -1 ||
+	    listen(listenfd, 128) == -1 ||
+	    getsockname(listenfd, (void *)&sin, &len) == -1)
+		pr_exit("%s: listener %s\n", __func__, strerror(errno));
+
+	header[0] = SOCKS5_ADDR_IPV4;
+	memcpy(header + 1, &sin.sin_addr, 4);
+	memcpy(header + 5, &sin.sin_port, 2);
+	pfd.fd = listenfd;
+	pfd.events = POLLIN;
+
+	for (i = 0; i < SOAK_WARMUP + SOAK_LINKS; i++) {
+		if (i == SOAK_WARMUP)
+			rss_start = rss_bytes();
+
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+			       sv) == -1)
+			goto out;
+
+		close(sv[1]);
+		if (poll_set(sv[0], POLLIN) == -1 ||
+		    (ln = create_link(sv[0], "server")) == NULL) {
+			close(sv[0]);
+			goto out;
+		}
+
+		if (add_data(sv[0], &ln->up, header, sizeof(header)) == -1 ||
+		    check_ss_header(sv[0], ln) == -1) {
+			destroy_link(sv[0]);
+			goto out;
+		}
+
+		/* reset the other end, so no port is left in TIME_WAIT */
+		poll(&pfd, 1, 1000);
+		fd = accept(listenfd, NULL, NULL);
+		if (fd != -1) {
+			setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset,
+				   sizeof(reset));
+			close(fd);
+		}
+
+		destroy_link(sv[0]);
+	}
+
+	rss_end = rss_bytes();
+	if (rss_start > 0 && rss_end - rss_start <= SOAK_RSS_SLACK)
+		ret = 0;
+out:
+	printf("soak: %d links to a literal ip, rss %ld KB -> %ld KB, %s\n",
+	       i, rss_start / 1024, rss_end / 1024, ret ? "FAILED" : "flat");
+	close(listenfd);
+	ss_exit();
+	crypto_exit();
+	return ret;
+}
+
+/**
+ * he_listener - a listener on the loopback address of family
+ *
+ * @hole: fill up its backlog, so it drops every syn from then on and
+ * connect() to it hangs
+ * @sa: filled with its address
+ *
+ * Return: the listening sockfd, -1 if family isn't there
+ */
+static int he_listener(int family, bool hole, union ss_sockaddr *sa)
+{
+	int fd, filler;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sa.sa_family = family;
+	if (family == AF_INET)
+		sa->in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else
+		sa->in6.sin6_addr = in6addr_loopback;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (bind(fd, &sa->sa, sockaddr_len(sa)) == -1 ||
+	    listen(fd, hole ? 0 : 16) == -1 ||
+	    getsockname(fd, &sa->sa, &(socklen_t){sizeof(*sa)}) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	if (!hole)
+		return fd;
+
+	/* never accepted, it goes away with the listener */
+	filler = socket(family, SOCK_STREAM, 0);
+	if (filler == -1 || connect(filler, &sa->sa, sockaddr_len(sa)) == -1)
+		pr_exit("%s: filler %s\n", __func__, strerror(errno));
+
+	return fd;
+}
+
+/* is listenfd reported readable right now */
+static bool listen_ready(int listenfd)
+{
+	int i, nevents;
+	struct poll_event events[16];
+
+	nevents = poll_wait(events, 16, 0);
+	for (i = 0; i < nevents; i++)
+		if (events[i].fd == listenfd && events[i].revents & POLLIN)
+			return true;
+
+	return false;
+}
+
+/**
+ * test_accept_emfile - out of fds without a link, the listening
+ * sockfd rests instead of spinning, and the timer resumes it
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_accept_emfile(void)
+{
+	int i, n, sockfd, client, listenfd, ret = -1;
+	int fds[64];
+	struct rlimit limit, saved;
+	union ss_sockaddr sa;
+
+	listenfd = he_listener(AF_INET, false, &sa);
+	if (listenfd == -1)
+		pr_exit("%s: listener %s\n", __func__, strerror(errno));
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	strcpy(ss_opt.event, "epoll");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	ss_init();
+	time_update();
+	client = socket(AF_INET, SOCK_STREAM, 0);
+	if (poll_set(listenfd, POLLIN) == -1 || client == -1 ||
+	    connect(client, &sa.sa, sizeof(SA_IN)) == -1)
+		pr_exit("%s: connect %s\n", __func__, strerror(errno));
+
+	/* use up what is left of a small fd limit */
+	getrlimit(RLIMIT_NOFILE, &saved);
+	limit = saved;
+	limit.rlim_cur = client + 8;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	for (n = 0; n < 64 && (fds[n] = dup(client)) != -1; n++)
+		;
+
+	sockfd = do_accept(listenfd);
+	if (sockfd != -1 || errno != EMFILE || listen_ready(listenfd))
+		goto out;
+
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+
+	n = 0;
+	setrlimit(RLIMIT_NOFILE, &saved);
+	if (listen_ready(listenfd) || timer_timeout() < 0 ||
+	    timer_timeout() > ACCEPT_RETRY * 1000)
+		goto out;
+
+	current_time += ACCEPT_RETRY;
+	reaper();
+	if (!listen_ready(listenfd))
+		goto out;
+
+	sockfd = do_accept(listenfd);
+	if (sockfd == -1)
+		goto out;
+
+	poll_del(sockfd);
+	close(sockfd);
+	ret = 0;
+out:
+	printf("accept out of fds: %s\n", ret ? "FAILED" : "paused, resumed");
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+
+	setrlimit(RLIMIT_NOFILE, &saved);
+	close(client);
+	ss_exit();
+	crypto_exit();
+	close(listenfd);
+	return ret;
+}
+
+/**
+ * he_connect - connect a link to n addrs in the order given
+ *
+ * @early: sent up right after connect_server() the way a local read
+ * does, before any attempt is done, NULL for nothing
+ * @won: filled with the address the link ended up connected to
+ *
+ * Return: milliseconds it took, -1 if it didn't connect
+ */
+static double he_connect(union ss_sockaddr *addrs, int n,
+			 char *early, union ss_sockaddr *won)
+{
+	int i, fd, nevents, sv[2];
+	double start, ms = -1;
+	struct poll_event events[16];
+	socklen_t len = sizeof(*won);
+	struct link *ln;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1)
+		return -1;
+
+	close(sv[1]);
+	if (poll_set(sv[0], POLLIN) == -1 ||
+	    (ln = create_link(sv[0], "server")) == NULL) {
+		close(sv[0]);
+		return -1;
+	}
+
+	/* as they come, not in the order of link_set_addrs() */
+	memcpy(ln->server_addrs, addrs, n * sizeof(*addrs));
+	ln->server_naddrs = n;
+	start = now_ns();
+	if (connect_server(sv[0]) == -1)
+		goto out;
+
+	if (early && (add_data(sv[0], &ln->up, early, strlen(early)) == -1 ||
+		      do_send(ln->server_sockfd, ln, &ln->up) == -2))
+		goto out;
+
+	while (!(ln->state & SERVER) && now_ns() - start < 3e9) {
+		nevents = poll_wait(events, 16, timer_timeout());
+		time_update();
+		for (i = 0; i < nevents; i++) {
+			fd = events[i].fd;
+			if (fd == sv[0] || link_head[fd] != ln ||
+			    ln->state & SERVER)
+				continue;
+
+			if (connect_done(fd, ln) == -2)
+				goto out;
+		}
+
+		reaper();
+	}
+
+	if (!(ln->state & SERVER) || ln->nattempts != 1 ||
+	    getpeername(ln->server_sockfd, &won->sa, &len) == -1)
+		goto out;
+
+	/* what the pollout handler does once the winner is writable */
+	if (ln->up.len > 0 && do_send(ln->server_sockfd, ln, &ln->up) < 0)
+		goto out;
+
+	ms = (now_ns() - start) / 1e6;
+out:
+	destroy_link(sv[0]);
+	return ms;
+}
+
+/**
+ * test_happy_eyeballs - a family that black-holes costs one attempt
+ * delay, one that refuses costs nothing
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_happy_eyeballs(void)
+{
+	int i, n, fd, ok, ret = 0;
+	int fds[5] = {-1, -1, -1, -1, -1};
+	char buf[5];
+	double ms;
+	union ss_sockaddr good4, good6, hole4, hole6, refused4, won;
+	union ss_sockaddr addrs[2];
+	const struct {
+		const char *name;
+		union ss_sockaddr *first;
+		union ss_sockaddr *second;
+		double min_ms;
+		double max_ms;
+	} cases[] = {
+		{"ipv6 black hole", &hole6, &good4,
+		 CONNECT_ATTEMPT_DELAY - 10, CONNECT_ATTEMPT_DELAY * 2},
+		{"ipv4 black hole", &hole4, &good6,
+		 CONNECT_ATTEMPT_DELAY - 10, CONNECT_ATTEMPT_DELAY * 2},
+		{"ipv4 refused", &refused4, &good6,
+		 0, CONNECT_ATTEMPT_DELAY / 2},
+	};
+
+	fds[0] = he_listener(AF_INET6, false, &good6);
+	fds[1] = he_listener(AF_INET6, true, &hole6);
+	if (fds[0] == -1 || fds[1] == -1) {
+		printf("happy eyeballs: no ipv6 loopback, skipped\n");
+		goto close;
+	}
+
+	fds[2] = he_listener(AF_INET, false, &good4);
+	fds[3] = he_listener(AF_INET, true, &hole4);
+	/* bound, but nobody listens */
+	refused4 = good4;
+	refused4.in.sin_port = 0;
+	fds[4] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[2] == -1 || fds[3] == -1 || fds[4] == -1 ||
+	    bind(fds[4], &refused4.sa, sizeof(SA_IN)) == -1 ||
+	    getsockname(fds[4], &refused4.sa,
+			&(socklen_t){sizeof(SA_IN)}) == -1)
+		pr_exit("%s: listeners %s\n", __func__, strerror(errno));
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	strcpy(ss_opt.event, "epoll");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	ss_init();
+	time_update();
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		addrs[0] = *cases[i].first;
+		addrs[1] = *cases[i].second;
+		ms = he_connect(addrs, 2, NULL, &won);
+		ok = ms >= cases[i].min_ms && ms <= cases[i].max_ms &&
+		     memcmp(&won, cases[i].second,
+			    sockaddr_len(cases[i].second)) == 0;
+		if (!ok)
+			ret = -1;
+
+		printf("happy eyeballs: %s, connected in %.1f ms, %s\n",
+		       cases[i].name, ms, ok ? "ok" : "FAILED");
+	}
+
+	/* local sends before the refused attempt standing in is reaped,
+	 * the payload waits for the winner instead of killing the link */
+	addrs[0] = refused4;
+	addrs[1] = good6;
+	ms = he_connect(addrs, 2, "early", &won);
+	ok = ms >= 0 && (fd = accept(fds[0], NULL, NULL)) != -1;
+	if (ok) {
+		/* the earlier cases are queued in front of it */
+		do {
+			n = recv(fd, buf, sizeof(buf), MSG_WAITALL);
+			close(fd);
+		} while (n == 0 && (fd = accept(fds[0], NULL, NULL)) != -1);
+
+		ok = n == 5 && memcmp(buf, "early", 5) == 0;
+	}
+
+	if (!ok)
+		ret = -1;
+
+	printf("happy eyeballs: payload before refused, %s\n",
+	       ok ? "ok" : "FAILED");
+
+	ss_exit();
+	crypto_exit();
+close:
+	for (i = 0; i < 5; i++)
+		if (fds[i] != -1)
+			close(fds[i]);
+
+	return ret;
+}
+
+/* run the event loop of sslocal for the pool only, ms long */
+static void pc_rounds(int ms)
+{
+	int i, nevents;
+	double start = now_ns();
+	struct poll_event events[16];
+
+	while (now_ns() - start < ms * 1e6) {
+		/* no longer than what is left of ms */
+		nevents = poll_wait(events, 16, preconnect_timeout(
+					    ms - (now_ns() - start) / 1e6));
+		time_update();
+		for (i = 0; i < nevents; i++)
+			preconnect_event(events[i].fd, events[i].revents);
+
+		reaper();
+		preconnect_refill();
+	}
+}
+
+/* a link to sa, true if it was connected at once */
+static bool pc_link(union ss_sockaddr *sa, int *sv)
+{
+	struct link *ln;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1)
+		pr_exit("%s: socketpair %s\n", __func__, strerror(errno));
+
+	if (poll_set(sv[0], POLLIN) == -1 ||
+	    (ln = create_link(sv[0], "client")) == NULL)
+		pr_exit("%s: create_link failed\n", __func__);
+
+	link_set_addrs(ln, sa, 1);
+	if (connect_server(sv[0]) == -1)
+		return false;
+
+	return ln->state & SERVER &&
+	       recv(ln->server_sockfd, &(char){0}, 1,
+		    MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN;
+}
+
+static void pc_unlink(int *sv)
+{
+	destroy_link(sv[0]);
+	close(sv[1]);
+}
+
+/* accept what the pool connected, up to max */
+static int pc_accept(int listenfd, int *fds, int max)
+{
+	int n = 0;
+
+	while (n < max && (fds[n] = accept4(listenfd, NULL, NULL,
+					    SOCK_NONBLOCK)) != -1)
+		n++;
+
+	return n;
+}
+
+/**
+ * test_preconnect - a link gets a connection of the pool without
+ * waiting, a burst grows the pool, connections closed by the server
+ * or idle for too long are dropped, and none are kept without links
+ *
+ * Return: 0 on success, -1 otherwise
+ */
+static int test_preconnect(void)
+{
+	int i, n, listenfd, ret = 0;
+	int sv[4][2], fds[16];
+	bool ok;
+	union ss_sockaddr sa;
+	struct addrinfo ai;
+
+	listenfd = he_listener(AF_INET, false, &sa);
+	if (listenfd == -1)
+		pr_exit("%s: listener %s\n", __func__, strerror(errno));
+
+	fcntl(listenfd, F_SETFL, O_NONBLOCK);
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = AF_INET;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addr = &sa.sa;
+	ai.ai_addrlen = sizeof(SA_IN);
+
+	strcpy(ss_opt.method, "aes-256-cfb");
+	strcpy(ss_opt.event, "epoll");
+	if (crypto_init("test", ss_opt.method) == -1)
+		pr_exit("%s: crypto_init failed\n", __func__);
+
+	ss_init();
+	time_update();
+	if (preconnect_init(&ai, 4) == -1)
+		pr_exit("%s: preconnect_init failed\n", __func__);
+
+	/* one is kept ready before any link asks */
+	pc_rounds(50);
+	ok = pc_link(&sa, sv[0]);
+	pc_unlink(sv[0]);
+	printf("preconnect: first link connected at once, %s\n",
+	       ok ? "ok" : "FAILED");
+	if (!ok)
+		ret = -1;
+
+	/* a burst in this second, the pool grows to its size */
+	for (i = 0; i < 4; i++) {
+		pc_link(&sa, sv[i]);
+		pc_unlink(sv[i]);
+	}
+
+	pc_rounds(50);
+	for (ok = true, i = 0; i < 4; i++)
+		ok = pc_link(&sa, sv[i]) && ok;
+
+	for (i = 0; i < 4; i++)
+		pc_unlink(sv[i]);
+
+	printf("preconnect: burst of 4 links connected at once, %s\n",
+	       ok ? "ok" : "FAILED");
+	if (!ok)
+		ret = -1;
+
+	/* the server closes what is idle, the pool notices */
+	pc_rounds(50);
+	n = pc_accept(listenfd, fds, 16);
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+
+	pc_rounds(50);
+	ok = n > 0 && pc_link(&sa, sv[0]);
+	pc_unlink(sv[0]);
+	printf("preconnect: %d closed by server, dropped, %s\n",
+	       n, ok ? "ok" : "FAILED");
+	if (!ok)
+		ret = -1;
+
+	/* the timer closes what was idle for too long */
+	pc_rounds(50);
+	n = pc_accept(listenfd, fds, 16);
+	current_time += PRECONNECT_IDLE_TIMEOUT;
+	preconnect_refill();
+	for (ok = n > 0, i = 0; i < n; i++) {
+		ok = ok && recv(fds[i], &(char){0}, 1, 0) == 0;
+		close(fds[i]);
+	}
+
+	printf("preconnect: %d idle too long, closed, %s\n",
+	       n, ok ? "ok" : "FAILED");
+	if (!ok)
+		ret = -1;
+
+	/* no link for a while, the last one isn't replaced */
+	pc_rounds(50);
+	current_time += PRECONNECT_IDLE_PERIOD;
+	preconnect_refill();
+	usleep(10000);
+	n = pc_accept(listenfd, fds, 16);
+	for (ok = n > 0, i = 0; i < n; i++) {
+		ok = ok && recv(fds[i], &(char){0}, 1, 0) == 0;
+		close(fds[i]);
+	}
+
+	/* until the next link */
+	ok = !pc_link(&sa, sv[0]) && ok;
+	pc_unlink(sv[0]);
+	pc_rounds(50);
+	ok = pc_link(&sa, sv[0]) && ok;
+	pc_unlink(sv[0]);
+	n = pc_accept(listenfd, fds, 16);
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+
+	printf("preconnect: none kept when idle, refilled by a link, %s\n",
+	       ok ? "ok" : "FAILED");
+	if (!ok)
+		ret = -1;
+
+	preconnect_exit();
+	ss_exit();
+	crypto_exit();
+	close(listenfd);
+	return ret;
+}
+
+static int write_all(int fd, long bytes)
+{
+	static char zeros[WRITE_ALL_CHUNK];
+	ssize_t n;
+
+	for (; bytes > 0; bytes -= n) {
+		n = send(fd, zeros, bytes < (long)sizeof(zeros) ?
+			 bytes : (long)sizeof(zeros), MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int free_port(void)
+{
+	int fd, port = -1;
+	SA_IN sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd != -1 && bind(fd, (SA *)&sa, sizeof(sa)) == 0 &&
+	    getsockname(fd, (SA *)&sa, &(socklen_t){sizeof(sa)}) == 0)
+		port = ntohs(sa.sin_port);
+
+	close(fd);
+	return port;
+}
+
+static pid_t spawn(char *const argv[])
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/* a connection to port on loopback, once something listens there */
+static int wait_port(int port)
+{
+	int i, fd = -1;
+	SA_IN sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	for (i = 0; i < 100; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1 || connect(fd, (SA *)&sa, sizeof(sa)) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+		usleep(20000);
+	}
+
+	return fd;
+}
+
+/* a socks5 connection through sslocal on port to dst */
+static int socks5_connect(int port, SA_IN *dst)
+{
+	int fd;
+	char req[10] = {0x05, 0x01, 0x00, SOCKS5_ADDR_IPV4};
+	char rep[10];
+
+	fd = wait_port(port);
+	if (fd == -1)
+		return -1;
+
+	memcpy(req + 4, &dst->sin_addr, 4);
+	memcpy(req + 8, &dst->sin_port, 2);
+	if (write(fd, "\x05\x01\x00", 3) != 3 ||
+	    read(fd, rep, 2) != 2 || rep[1] != 0x00 ||
+	    write(fd, req, sizeof(req)) != sizeof(req) ||
+	    recv(fd, rep, sizeof(rep), MSG_WAITALL) != sizeof(rep) ||
+	    rep[1] != SOCKS5_CMD_REP_SUCCEEDED) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+#define DUPLEX_DOWN_BYTES (16 * 1024 * 1024)
+#define DUPLEX_UP_BYTES (8 * 1024 * 1024)
+/* the destination reads the upload this much at a time, and rests
+ * between reads, a slow uplink beyond sserver */
+#define DUPLEX_UP_READ (64 * 1024)
+#define DUPLEX_UP_REST_US 5000
+/* seconds a read may wait before the download counts as stalled */
+#define DUPLEX_TIMEOUT 10
+
+/* one connection at the destination, the upload read slowly while the
+ * download is written as fast as it goes */
+struct duplex_dst {
+	int listenfd;
+	long up_bytes;
+	/* when the whole upload was read */
+	double up_done;
+	int ret;
+};
+
+static char duplex_buf[DUPLEX_UP_READ];
+
+static void *duplex_writer(void *arg)
+{
+	return (void *)(long)write_all(*(int *)arg, DUPLEX_DOWN_BYTES);
+}
+
+static void *duplex_dst_run(void *arg)
+{
+	struct duplex_dst *dst = arg;
+	int fd;
+	long left;
+	ssize_t n;
+	pthread_t writer;
+	void *wret;
+
+	dst->ret = -1;
+	fd = accept(dst->listenfd, NULL, NULL);
+	if (fd == -1)
+		return NULL;
+
+	if (pthread_create(&writer, NULL, duplex_writer, &fd) != 0)
+		goto out;
+
+	for (left = dst->up_bytes; left > 0; left -= n) {
+		n = read(fd, duplex_buf, left < DUPLEX_UP_READ ?
+			 left : DUPLEX_UP_READ);
+		if (n <= 0)
+			break;
+
+		usleep(DUPLEX_UP_REST_US);
+	}
+
+	dst->up_done = now_ns();
+	pthread_join(writer, &wret);
+	if (left == 0 && wret == NULL)
+		dst->ret = 0;
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *duplex_uploader(void *arg)
+{
+	return (void *)(long)write_all(*(int *)arg, DUPLEX_UP_BYTES);
+}
+
+/**
+ * duplex_run - download through sslocal and sserver beside an upload
+ * of up_bytes on the same link
+ *
+ * Return: milliseconds the download took, -1 on failure, @up_ms is
+ * how long the upload took
+ */
+static double duplex_run(int port, int listenfd, SA_IN *dst,
+			 long up_bytes, double *up_ms)
+{
+	int fd;
+	long left;
+	ssize_t n;
+	double start, down_ms = -1;
+	pthread_t dst_thread, uploader;
+	void *uret = NULL;
+	/* without an upload, the byte which brings the ss header along,
+	 * left unread it would make the close of dst a reset */
+	struct duplex_dst d = {listenfd, up_bytes ? up_bytes : 1, 0, -1};
+
+	fd = socks5_connect(port, dst);
+	if (fd == -1)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+		   &(struct timeval){DUPLEX_TIMEOUT, 0}, sizeof(struct timeval));
+
+	if (pthread_create(&dst_thread, NULL, duplex_dst_run, &d) != 0)
+		pr_exit("%s: pthread_create failed\n", __func__);
+
+	/* the ss header goes with the first payload, the clock starts
+	 * with it */
+	start = now_ns();
+	if (up_bytes && pthread_create(&uploader, NULL,
+				       duplex_uploader, &fd) != 0)
+		pr_exit("%s: pthread_create failed\n", __func__);
+
+	if (!up_bytes && write(fd, "x", 1) != 1)
+		goto out;
+
+	for (left = DUPLEX_DOWN_BYTES; left > 0; left -= n) {
+		n = read(fd, duplex_buf, sizeof(duplex_buf));
+		if (n <= 0)
+			break;
+	}
+
+	if (left == 0)
+		down_ms = (now_ns() - start) / 1e6;
+out:
+	if (up_bytes)
+		pthread_join(uploader, &uret);
+
+	shutdown(fd, SHUT_RDWR);
+	pthread_join(dst_thread, NULL);
+	close(fd);
+	*up_ms = (d.up_done - start) / 1e6;
+	return d.ret == 0 && uret == NULL ? down_ms : -1;
+}
+
+/**
+ * test_duplex - a download through sslocal and sserver doesn't wait
+ * for a slow upload on the same link to drain
+ *
+ * Uses the sserver and sslocal next to the test, they are built
+ * first by make, both running the event backend.
+ *
+ * Return: 0 on success or when skipped, -1 otherwise
+ */
+static int test_duplex(char *event)
+{
+	int fd, listenfd, ret = -1;
+	char sport[8], lport[8];
+	double alone_ms, down_ms, up_ms;
+	pid_t server, client = -1;
+	SA_IN dst;
+	char *server_argv[] = {"./sserver", "-u", "127.0.0.1", "-b", sport,
+			       "-k", "test", "-m", "aes-256-cfb", "-l", "3",
+			       "-e", event, NULL};
+	char *client_argv[] = {"./sslocal", "-s", "127.0.0.1", "-p", sport,
+			       "-u", "127.0.0.1", "-b", lport, "-k", "test",
+			       "-m", "aes-256-cfb", "-l", "3", "-e", event,
+			       NULL};
+
+	if (access("./sserver", X_OK) == -1 ||
+	    access("./sslocal", X_OK) == -1) {
+		printf("duplex: no ./sserver or ./sslocal, skipped\n");
+		return 0;
+	}
+
+	/* the upload backs up at the destination, not in its buffers */
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF,
+		   &(int){DUPLEX_UP_READ}, sizeof(int));
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listenfd, (SA *)&dst, sizeof(dst)) == -1 ||
+	    listen(listenfd, 4) == -1 ||
+	    getsockname(listenfd, (SA *)&dst,
+			&(socklen_t){sizeof(dst)}))
+		pr_exit("%s: listener %s\n", __func__, strerror(errno));
+
+	snprintf(sport, sizeof(sport), "%d", free_port());
+	snprintf(lport, sizeof(lport), "%d", free_port());
+	/* sslocal connects to sserver as soon as it's up */
+	server = spawn(server_argv);
+	if (server == -1 || (fd = wait_port(atoi(sport))) == -1)
+		goto out;
+
+	close(fd);
+	client = spawn(client_argv);
+	if (client == -1)
+		goto out;
+
+	alone_ms = duplex_run(atoi(lport), listenfd, &dst, 0, &up_ms);
+	down_ms = duplex_run(atoi(lport), listenfd, &dst, DUPLEX_UP_BYTES,
+			     &up_ms);
+
+	/* a stalled download finishes with the upload at best */
+	if (alone_ms > 0 && down_ms > 0 && down_ms < up_ms)
+		ret = 0;
+
+	printf("duplex, %s: %d MB down alone %.0f ms(%.1f MB/s), "
+	       "beside a slow %d MB upload %.0f ms(%.1f MB/s), "
+	       "upload %.0f ms, %s\n",
+	       event, DUPLEX_DOWN_BYTES >> 20, alone_ms,
+	       (DUPLEX_DOWN_BYTES >> 20) / alone_ms * 1e3,
+	       DUPLEX_UP_BYTES >> 20, down_ms,
+	       (DUPLEX_DOWN_BYTES >> 20) / down_ms * 1e3, up_ms,
+	       ret ? "STALLED" : "ok");
+out:
+	if (client > 0)
+		kill(client, SIGTERM);
+
+	if (server > 0)
+		kill(server, SIGTERM);
+
+	waitpid(client, NULL, 0);
+	waitpid(server, NULL, 0);
+	close(listenfd);
+	return ret;
+}
+
+#define WORKERS_TEST 4
+/* enough that a worker left out by SO_REUSEPORT is a bug, not luck */
+#define WORKERS_TEST_CONNS 64
+
+/* sockets open in process pid */
+static int count_sockets(pid_t pid)
+{
+	int n = 0;
+	char path[PATH_MAX], link[64];
+	ssize_t len;
+	DIR *dir;
+	struct dirent *d;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	while ((d = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, d->d_name);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len > 0 && strncmp(link, "socket:", 7) == 0)
+			n++;
+	}
+
+	closedir(dir);
+	return n;
+}
+
+/* the pids of the workers of the sserver master, 0 if not all of
+ * them are up yet */
+static int worker_pids(pid_t master, pid_t *pids, int max)
+{
+	int n = 0;
+	char path[64];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children",
+		 master, master);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (n < max && fscanf(fp, "%d", &pids[n]) == 1)
+		n++;
+
+	fclose(fp);
+	return n;
+}
+
+/**
+ * test_workers_accept - every worker of sserver -w accepts its share
+ * of the connections to the port they share with SO_REUSEPORT
+ *
+ * Return: 0 on success or when skipped, -1 otherwise
+ */
+static int test_workers_accept(void)
+{
+	int i, n, fd, ret = -1;
+	int fds[WORKERS_TEST_CONNS], before[WORKERS_TEST];
+	int accepted[WORKERS_TEST] = {0};
+	char port[8], workers[8];
+	pid_t master, pids[WORKERS_TEST];
+	char *argv[] = {"./sserver", "-u", "127.0.0.1", "-b", port,
+			"-k", "test", "-m", "aes-256-cfb", "-w", workers,
+			"-l", "3", NULL};
+
+	if (access("./sserver", X_OK) == -1) {
+		printf("workers: no ./sserver, skipped\n");
+		return 0;
+	}
+
+	snprintf(port, sizeof(port), "%d", free_port());
+	snprintf(workers, sizeof(workers), "%d", WORKERS_TEST);
+	master = spawn(argv);
+	if (master == -1)
+		return -1;
+
+	/* every worker is listening once all of them accept */
+	for (i = 0; i < 100; i++) {
+		n = worker_pids(master, pids, WORKERS_TEST);
+		if (n == -1) {
+			printf("workers: no /proc children, skipped\n");
+			ret = 0;
+			goto out;
+		}
+
+		if (n == WORKERS_TEST)
+			break;
+
+		usleep(20000);
+	}
+
+	fd = wait_port(atoi(port));
+	if (n != WORKERS_TEST || fd == -1)
+		goto out;
+
+	close(fd);
+	usleep(100000);
+	for (i = 0; i < WORKERS_TEST; i++)
+		before[i] = count_sockets(pids[i]);
+
+	/* they wait for an ss header, and hold the connection meanwhile */
+	for (n = 0; n < WORKERS_TEST_CONNS; n++) {
+		fds[n] = wait_port(atoi(port));
+		if (fds[n] == -1)
+			break;
+	}
+
+	usleep(200000);
+	for (ret = 0, i = 0; i < WORKERS_TEST; i++) {
+		accepted[i] = count_sockets(pids[i]) - before[i];
+		if (accepted[i] <= 0)
+			ret = -1;
+	}
+
+	while (n-- > 0)
+		close(fds[n]);
+
+	printf("workers: %d connections accepted by %d workers as",
+	       WORKERS_TEST_CONNS, WORKERS_TEST);
+	for (i = 0; i < WORKERS_TEST; i++)
+		printf(" %d", accepted[i]);
+
+	printf(", %s\n", ret ? "FAILED" : "ok");
+out:
+	kill(master, SIGTERM);
+	waitpid(master, NULL, 0);
+	return ret;
+}
+
+#define BENCH_WORKERS_BYTES (256L * 1024 * 1024)
+/* links per worker, so the workers have more than one to switch to */
+#define BENCH_WORKERS_LINKS 4
+#define BENCH_WORKERS_MAX 16
+
+struct bench_link {
+	int port;
+	int listenfd;
+	SA_IN *dst;
+	long bytes;
+	int ret;
+};
+
+/* one download, the destination and the client side in one thread
+ * each */
+static void *bench_link_dst(void *arg)
+{
+	struct bench_link *bl = arg;
+	int fd;
+	char c;
+
+	fd = accept(bl->listenfd, NULL, NULL);
+	if (fd == -1)
+		return NULL;
+
+	/* the byte which brought the ss header along */
+	if (read(fd, &c, 1) != 1 || write_all(fd, bl->bytes) == -1)
+		bl->ret = -1;
+
+	close(fd);
+	return NULL;
+}
+
+static void *bench_link_client(void *arg)
+{
+	struct bench_link *bl = arg;
+	char buf[64 * 1024];
+	long left;
+	ssize_t n;
+	int fd;
+
+	fd = socks5_connect(bl->port, bl->dst);
+	if (fd == -1 || write(fd, "x", 1) != 1) {
+		bl->ret = -1;
+		goto out;
+	}
+
+	for (left = bl->bytes; left > 0; left -= n) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			bl->ret = -1;
+			break;
+		}
+	}
+out:
+	if (fd != -1)
+		close(fd);
+
+	return NULL;
+}
+
+/**
+ * bench_workers_one - MB/s sserver -w nworkers relays downloads at
+ *
+ * Each worker gets an sslocal of its own, so the client side scales
+ * with it, and BENCH_WORKERS_LINKS links through it.
+ *
+ * Return: MB/s, -1 on failure
+ */
+static double bench_workers_one(int nworkers, int listenfd,
+				SA_IN *dst)
+{
+	int i, nlinks = nworkers * BENCH_WORKERS_LINKS;
+	char sport[8], workers[8], lports[BENCH_WORKERS_MAX][8];
+	double start, mbps = -1;
+	pid_t server, clients[BENCH_WORKERS_MAX] = {0};
+	pthread_t dst_threads[BENCH_WORKERS_MAX * BENCH_WORKERS_LINKS];
+	pthread_t client_threads[BENCH_WORKERS_MAX * BENCH_WORKERS_LINKS];
+	struct bench_link links[BENCH_WORKERS_MAX * BENCH_WORKERS_LINKS];
+	char *server_argv[] = {"./sserver", "-u", "127.0.0.1", "-b", sport,
+			       "-k", "bench", "-m", "aes-256-cfb",
+			       "-w", workers, "-l", "3", NULL};
+	char *client_argv[] = {"./sslocal", "-s", "127.0.0.1", "-p", sport,
+			       "-u", "127.0.0.1", "-b", NULL, "-k", "bench",
+			       "-m", "aes-256-cfb", "-l", "3", NULL};
+
+	snprintf(sport, sizeof(sport), "%d", free_port());
+	snprintf(workers, sizeof(workers), "%d", nworkers);
+	server = spawn(server_argv);
+	if (server == -1 || (i = wait_port(atoi(sport))) == -1)
+		goto out;
+
+	close(i);
+	for (i = 0; i < nworkers; i++) {
+		snprintf(lports[i], sizeof(lports[i]), "%d", free_port());
+		client_argv[8] = lports[i];
+		clients[i] = spawn(client_argv);
+	}
+
+	for (i = 0; i < nlinks; i++) {
+		links[i].port = atoi(lports[i % nworkers]);
+		links[i].listenfd = listenfd;
+		links[i].dst = dst;
+		links[i].bytes = BENCH_WORKERS_BYTES / nlinks;
+		links[i].ret = 0;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nlinks; i++)
+		if (pthread_create(&dst_threads[i], NULL, bench_link_dst,
+				   &links[i]) != 0 ||
+		    pthread_create(&client_threads[i], NULL,
+				   bench_link_client, &links[i]) != 0)
+			pr_exit("%s: pthread_create failed\n", __func__);
+
+	for (i = 0; i < nlinks; i++) {
+		pthread_join(client_threads[i], NULL);
+		pthread_join(dst_threads[i], NULL);
+		if (links[i].ret == -1)
+			goto out;
+	}
+
+	mbps = (BENCH_WORKERS_BYTES >> 20) / ((now_ns() - start) / 1e9);
+out:
+	for (i = 0; i < nworkers; i++) {
+		if (clients[i] > 0) {
+			kill(clients[i], SIGTERM);
+			waitpid(clients[i], NULL, 0);
+		}
+	}
+
+	if (server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+
+	return mbps;
+}
+
+/* relay throughput as sserver gets more workers, up to one a cpu */
+static void bench_workers(void)
+{
+	int n, ncpu, listenfd;
+	double mbps;
+	SA_IN dst;
+
+	if (access("./sserver", X_OK) == -1 ||
+	    access("./sslocal", X_OK) == -1) {
+		printf("sserver workers: no ./sserver or ./sslocal, "
+		       "skipped\n");
+		return;
+	}
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listenfd, (SA *)&dst, sizeof(dst)) == -1 ||
+	    listen(listenfd, 64) == -1 ||
+	    getsockname(listenfd, (SA *)&dst,
+			&(socklen_t){sizeof(dst)}))
+		pr_exit("%s: listener %s\n", __func__, strerror(errno));
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu > BENCH_WORKERS_MAX)
+		ncpu = BENCH_WORKERS_MAX;
+
+	printf("sserver workers, %ld MB of aes-256-cfb downloads, "
+	       "%d links a worker, %d cpus:\n",
+	       BENCH_WORKERS_BYTES >> 20, BENCH_WORKERS_LINKS, ncpu);
+	for (n = 1; n <= ncpu; n *= 2) {
+		mbps = bench_workers_one(n, listenfd, &dst);
+		printf("  %2d workers: %8.1f MB/s\n", n, mbps);
+	}
+
+	close(listenfd);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	const char *method;
+
+	openlog("test", LOG_CONS | LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_NOTICE));
+
+	/* make bench, csv on stdout and nothing else */
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+		bench_csv();
+		return 0;
+	}
+
+	if (test_iv_unique() == -1 || test_iv_fork() == -1)
+		return 1;
+
+	if (test_chacha20() == -1 || test_aes_cfb() == -1)
+		return 1;
+
+	for (i = 0; (method = crypto_method(i)) != NULL; i++)
+		if (test_stream(method) == -1)
+			return 1;
+
+	if (test_resolve() == -1 || test_dns_cache() == -1)
+		return 1;
+
+	if (test_soak_rss() == -1 || test_accept_emfile() == -1 ||
+	    test_happy_eyeballs() == -1 ||
+	    test_preconnect() == -1 || test_duplex("epoll") == -1 ||
+	    test_duplex("io_uring") == -1 ||
+	    test_workers_accept() == -1)
+		return 1;
+
+	bench_relay_buf();
+	bench_poll_idle();
+	bench_workers();
+	bench_cipher_setup();
+	bench_chacha20();
+	bench_aes_cfb();
+	bench_crypt_all();
 	return 0;
 }
@@ -0,0 +1,886 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+#define URING_ENTRIES 1024
+#define URING_TIMEOUT_DATA ((__u64)-1)
+#define URING_REMOVE_DATA ((__u64)-2)
+/* user_data of the relay's recv() and send(), the sockfd in the lower
+ * half. The generation of a poll is kept below these bits. */
+#define URING_RECV_TAG ((__u64)1 << 63)
+#define URING_SEND_TAG ((__u64)1 << 62)
+#define URING_GEN_MASK 0x3fffffff
+
+struct uring_sq {
+	unsigned *head;
+	unsigned *tail;
+	unsigned *mask;
+	unsigned *entries;
+	unsigned *array;
+};
+
+struct uring_cq {
+	unsigned *head;
+	unsigned *tail;
+	unsigned *mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int ring_fd = -1;
+static unsigned features;
+static struct uring_sq sq;
+static struct uring_cq cq;
+static struct io_uring_sqe *sqes;
+static void *sq_ptr;
+static void *cq_ptr;
+static size_t sq_size;
+static size_t cq_size;
+static size_t sqes_size;
+/* sqes in the ring which io_uring_enter() hasn't consumed yet */
+static unsigned sq_pending;
+
+/* per sockfd state, indexed by sockfd like clients[] */
+static int nslots;
+/* generation in user_data, completions of old polls are dropped */
+static unsigned *gen;
+/* events of the outstanding oneshot poll, 0 means not armed */
+static short *armed;
+/* sockfds whose poll needs to be (re)armed in the next round */
+static bool *dirty;
+static int *dirty_list;
+static int ndirty;
+
+/*
+ * The relay's recv() and send() on a sockfd, at most one of each at a
+ * time. do_read() and do_send() queue them instead of making the
+ * syscall, once the handlers of the round's events are done they all
+ * go to the kernel in one batch, see uring_poll_flush(), and what they
+ * returned is handed back through a POLLIN or POLLOUT event made up
+ * for the sockfd. Nothing touches the buffer meanwhile, the link waits
+ * for that event.
+ */
+struct uring_op {
+	enum uring_op_state state;
+	int res;
+	void *data;
+	int len;
+	struct msghdr msg;
+	struct iovec iov[2];
+	/* the last recv() filled all it was given, there's likely more */
+	bool more;
+};
+
+static struct uring_op *recv_ops;
+static struct uring_op *send_ops;
+/* sockfds with a queued recv() or send() */
+static bool *op_listed;
+static int *op_list;
+static int nops;
+/* submitted and not completed yet */
+static int nflight;
+/* sockfds whose recv() or send() completed this round, and the event
+ * made up for them */
+static short *op_revents;
+static int *ready_list;
+static int nready;
+/* POLLIN events a round may make up for sockfds likely to have more
+ * to read, instead of polling them first */
+#define URING_MORE_MAX 64
+static int more_budget;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+		       unsigned flags, void *arg, size_t argsz)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+		      min_complete, flags, arg, argsz);
+	if (ret > 0)
+		sq_pending -= ret;
+
+	return ret;
+}
+
+/* no SQPOLL, the kernel only looks at the sq ring inside
+ * io_uring_enter(), so publishing the tail early is fine */
+static struct io_uring_sqe *get_sqe(void)
+{
+	unsigned head, tail, idx;
+	struct io_uring_sqe *sqe;
+
+	tail = *sq.tail;
+	head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+	if (tail - head >= *sq.entries) {
+		if (uring_enter(sq_pending, 0, 0, NULL, 0) == -1) {
+			pr_warn("%s: io_uring_enter() %s\n",
+				__func__, strerror(errno));
+			return NULL;
+		}
+
+		head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+		if (tail - head >= *sq.entries)
+			return NULL;
+	}
+
+	idx = tail & *sq.mask;
+	sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq.array[idx] = idx;
+	__atomic_store_n(sq.tail, tail + 1, __ATOMIC_RELEASE);
+	sq_pending++;
+
+	return sqe;
+}
+
+static __u64 poll_data(int sockfd)
+{
+	return ((__u64)(gen[sockfd] & URING_GEN_MASK) << 32) |
+	       (unsigned)sockfd;
+}
+
+static int queue_poll_add(int sockfd, short events)
+{
+	unsigned mask = 0;
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	if (events & POLLIN)
+		mask |= POLLIN;
+
+	if (events & POLLOUT)
+		mask |= POLLOUT;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sockfd;
+	sqe->poll32_events = mask;
+	sqe->user_data = poll_data(sockfd);
+	armed[sockfd] = events;
+
+	return 0;
+}
+
+static int queue_poll_remove(int sockfd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = poll_data(sockfd);
+	sqe->user_data = URING_REMOVE_DATA;
+	armed[sockfd] = 0;
+	gen[sockfd]++;
+
+	return 0;
+}
+
+static void mark_dirty(int sockfd)
+{
+	if (dirty[sockfd])
+		return;
+
+	dirty[sockfd] = true;
+	dirty_list[ndirty++] = sockfd;
+}
+
+/* turn all the interest changes of this round into sqes */
+static void flush_dirty(void)
+{
+	int i, sockfd;
+	short events;
+
+	for (i = 0; i < ndirty; i++) {
+		sockfd = dirty_list[i];
+		dirty[sockfd] = false;
+
+		if (clients[sockfd].fd == sockfd)
+			events = clients[sockfd].events & (POLLIN | POLLOUT);
+		else
+			events = 0;
+
+		if (armed[sockfd] == events)
+			continue;
+
+		if (armed[sockfd] && queue_poll_remove(sockfd) == -1)
+			continue;
+
+		if (events)
+			queue_poll_add(sockfd, events);
+	}
+
+	ndirty = 0;
+}
+
+static void list_op(int sockfd)
+{
+	if (op_listed[sockfd])
+		return;
+
+	op_listed[sockfd] = true;
+	op_list[nops++] = sockfd;
+}
+
+static int submit_recv(int sockfd)
+{
+	struct uring_op *op = &recv_ops[sockfd];
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sockfd;
+	sqe->addr = (unsigned long)op->data;
+	sqe->len = op->len;
+	/* the sockfd is non-blocking, it completes right away */
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = URING_RECV_TAG | (unsigned)sockfd;
+	op->state = URING_OP_INFLIGHT;
+	nflight++;
+
+	return 0;
+}
+
+static int submit_send(int sockfd)
+{
+	struct uring_op *op = &send_ops[sockfd];
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (sqe == NULL)
+		return -1;
+
+	/* set here, send_ops may have been moved by uring_grow() */
+	memset(&op->msg, 0, sizeof(op->msg));
+	op->msg.msg_iov = op->iov;
+	op->msg.msg_iovlen = op->len;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sockfd;
+	sqe->addr = (unsigned long)&op->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+	sqe->user_data = URING_SEND_TAG | (unsigned)sockfd;
+	op->state = URING_OP_INFLIGHT;
+	nflight++;
+
+	return 0;
+}
+
+/* turn the queued recv()s and send()s of up to max sockfds into sqes,
+ * the rest wait for the next flush */
+static int flush_ops(int max)
+{
+	int i, sockfd, n = 0;
+
+	for (i = 0; i < nops && n < max; i++) {
+		sockfd = op_list[i];
+		if (recv_ops[sockfd].state == URING_OP_QUEUED &&
+		    submit_recv(sockfd) == -1)
+			break;
+
+		if (send_ops[sockfd].state == URING_OP_QUEUED &&
+		    submit_send(sockfd) == -1)
+			break;
+
+		op_listed[sockfd] = false;
+		n++;
+	}
+
+	nops -= i;
+	memmove(op_list, op_list + i, nops * sizeof(*op_list));
+
+	return n;
+}
+
+static void add_ready(int sockfd, short revents)
+{
+	if (op_revents[sockfd] == 0 && nready < nslots)
+		ready_list[nready++] = sockfd;
+
+	op_revents[sockfd] |= revents;
+}
+
+static void op_done(struct uring_op *op, int sockfd, int res, short revents)
+{
+	nflight--;
+	if (op->state != URING_OP_INFLIGHT)
+		return;
+
+	op->state = URING_OP_DONE;
+	op->res = res;
+	if (op == &recv_ops[sockfd])
+		op->more = res == op->len;
+
+	add_ready(sockfd, revents);
+}
+
+/* the kernel may be older than the headers it was built with */
+static int probe_ops(void)
+{
+	static const int ops[] = {
+		IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_TIMEOUT,
+		IORING_OP_SENDMSG, IORING_OP_RECV,
+	};
+	struct io_uring_probe *probe;
+	size_t i, size;
+	int ret = -1;
+
+	size = sizeof(*probe) +
+	       IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (probe == NULL)
+		return -1;
+
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+		    probe, IORING_OP_LAST) == -1)
+		goto out;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			errno = EOPNOTSUPP;
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	free(probe);
+	return ret;
+}
+
+int uring_init(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	/* only this thread uses the ring, and only reaps in
+	 * io_uring_enter(), completions needn't interrupt it */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_fd == -1 && errno == EINVAL)
+		memset(&p, 0, sizeof(p));
+#endif
+	if (ring_fd == -1)
+		ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+
+	if (ring_fd == -1 || probe_ops() == -1)
+		goto err;
+
+	features = p.features;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		goto err;
+
+	if (features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ring_fd,
+			      IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			goto err;
+	}
+
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err;
+
+	sq.head = sq_ptr + p.sq_off.head;
+	sq.tail = sq_ptr + p.sq_off.tail;
+	sq.mask = sq_ptr + p.sq_off.ring_mask;
+	sq.entries = sq_ptr + p.sq_off.ring_entries;
+	sq.array = sq_ptr + p.sq_off.array;
+	cq.head = cq_ptr + p.cq_off.head;
+	cq.tail = cq_ptr + p.cq_off.tail;
+	cq.mask = cq_ptr + p.cq_off.ring_mask;
+	cq.cqes = cq_ptr + p.cq_off.cqes;
+
+	nslots = nfds;
+	gen = calloc(nslots, sizeof(*gen));
+	armed = calloc(nslots, sizeof(*armed));
+	dirty = calloc(nslots, sizeof(*dirty));
+	dirty_list = calloc(nslots, sizeof(*dirty_list));
+	recv_ops = calloc(nslots, sizeof(*recv_ops));
+	send_ops = calloc(nslots, sizeof(*send_ops));
+	op_listed = calloc(nslots, sizeof(*op_listed));
+	op_list = calloc(nslots, sizeof(*op_list));
+	op_revents = calloc(nslots, sizeof(*op_revents));
+	ready_list = calloc(nslots, sizeof(*ready_list));
+	if (gen == NULL || armed == NULL || dirty == NULL ||
+	    dirty_list == NULL || recv_ops == NULL || send_ops == NULL ||
+	    op_listed == NULL || op_list == NULL || op_revents == NULL ||
+	    ready_list == NULL) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	return 0;
+err:
+	pr_warn("%s: %s\n", __func__, strerror(errno));
+	uring_exit();
+	return -1;
+}
+
+void uring_exit(void)
+{
+	if (sqes && sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+
+	if (cq_ptr && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+
+	if (sq_ptr && sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_size);
+
+	if (ring_fd != -1)
+		close(ring_fd);
+
+	free(gen);
+	free(armed);
+	free(dirty);
+	free(dirty_list);
+	free(recv_ops);
+	free(send_ops);
+	free(op_listed);
+	free(op_list);
+	free(op_revents);
+	free(ready_list);
+
+	sqes = NULL;
+	cq_ptr = sq_ptr = NULL;
+	ring_fd = -1;
+	gen = NULL;
+	armed = NULL;
+	dirty = NULL;
+	dirty_list = NULL;
+	recv_ops = send_ops = NULL;
+	op_listed = NULL;
+	op_list = NULL;
+	op_revents = NULL;
+	ready_list = NULL;
+	nslots = ndirty = nops = nflight = nready = 0;
+}
+
+/* follow clients[] when it grows */
+int uring_grow(int size)
+{
+	void *p;
+
+	if (size <= nslots)
+		return 0;
+
+	p = realloc(gen, size * sizeof(*gen));
+	if (p == NULL)
+		return -1;
+	gen = p;
+	memset(gen + nslots, 0, (size - nslots) * sizeof(*gen));
+
+	p = realloc(armed, size * sizeof(*armed));
+	if (p == NULL)
+		return -1;
+	armed = p;
+	memset(armed + nslots, 0, (size - nslots) * sizeof(*armed));
+
+	p = realloc(dirty, size * sizeof(*dirty));
+	if (p == NULL)
+		return -1;
+	dirty = p;
+	memset(dirty + nslots, 0, (size - nslots) * sizeof(*dirty));
+
+	p = realloc(dirty_list, size * sizeof(*dirty_list));
+	if (p == NULL)
+		return -1;
+	dirty_list = p;
+
+	p = realloc(recv_ops, size * sizeof(*recv_ops));
+	if (p == NULL)
+		return -1;
+	recv_ops = p;
+	memset(recv_ops + nslots, 0, (size - nslots) * sizeof(*recv_ops));
+
+	p = realloc(send_ops, size * sizeof(*send_ops));
+	if (p == NULL)
+		return -1;
+	send_ops = p;
+	memset(send_ops + nslots, 0, (size - nslots) * sizeof(*send_ops));
+
+	p = realloc(op_listed, size * sizeof(*op_listed));
+	if (p == NULL)
+		return -1;
+	op_listed = p;
+	memset(op_listed + nslots, 0, (size - nslots) * sizeof(*op_listed));
+
+	p = realloc(op_list, size * sizeof(*op_list));
+	if (p == NULL)
+		return -1;
+	op_list = p;
+
+	p = realloc(op_revents, size * sizeof(*op_revents));
+	if (p == NULL)
+		return -1;
+	op_revents = p;
+	memset(op_revents + nslots, 0, (size - nslots) * sizeof(*op_revents));
+
+	p = realloc(ready_list, size * sizeof(*ready_list));
+	if (p == NULL)
+		return -1;
+	ready_list = p;
+
+	nslots = size;
+
+	return 0;
+}
+
+/* called after clients[sockfd] changed, nothing is submitted until
+ * the next uring_poll_wait(). A sockfd read again while its last recv()
+ * filled the buffer gets a POLLIN at once, from the next flush. */
+void uring_poll_update(int sockfd)
+{
+	struct uring_op *op;
+
+	if (sockfd < 0 || sockfd >= nslots)
+		return;
+
+	mark_dirty(sockfd);
+
+	op = &recv_ops[sockfd];
+	if (op->more && op->state == URING_OP_IDLE && more_budget > 0 &&
+	    clients[sockfd].fd == sockfd && clients[sockfd].events & POLLIN) {
+		op->more = false;
+		more_budget--;
+		add_ready(sockfd, POLLIN);
+	}
+}
+
+/* must be called before sockfd is closed: an outstanding poll holds
+ * the file, so it has to be removed explicitly. A queued recv() or
+ * send() is dropped, there's none in flight between two rounds. */
+void uring_poll_del(int sockfd)
+{
+	if (sockfd < 0 || sockfd >= nslots)
+		return;
+
+	if (armed[sockfd])
+		queue_poll_remove(sockfd);
+
+	recv_ops[sockfd].state = URING_OP_IDLE;
+	recv_ops[sockfd].more = false;
+	send_ops[sockfd].state = URING_OP_IDLE;
+	op_revents[sockfd] = 0;
+}
+
+/**
+ * uring_queue_recv - recv() len bytes from sockfd to data in the next
+ * flush
+ *
+ * data must be left alone until uring_recv_result() returned what was
+ * read, after the POLLIN event made up for it.
+ *
+ * Return: 0 on success, -1 if the caller has to recv() by itself
+ */
+int uring_queue_recv(int sockfd, void *data, int len)
+{
+	struct uring_op *op;
+
+	if (sockfd < 0 || sockfd >= nslots)
+		return -1;
+
+	op = &recv_ops[sockfd];
+	if (op->state != URING_OP_IDLE)
+		return -1;
+
+	op->state = URING_OP_QUEUED;
+	op->data = data;
+	op->len = len;
+	list_op(sockfd);
+
+	return 0;
+}
+
+/**
+ * uring_queue_send - sendmsg() iov to sockfd in the next flush
+ *
+ * Like uring_queue_recv(), the POLLOUT event made up for it says when
+ * uring_send_result() has what was sent.
+ *
+ * Return: 0 on success, -1 if the caller has to send by itself
+ */
+int uring_queue_send(int sockfd, struct iovec *iov, int iovcnt)
+{
+	struct uring_op *op;
+
+	if (sockfd < 0 || sockfd >= nslots || iovcnt > 2)
+		return -1;
+
+	op = &send_ops[sockfd];
+	if (op->state != URING_OP_IDLE)
+		return -1;
+
+	op->state = URING_OP_QUEUED;
+	memcpy(op->iov, iov, iovcnt * sizeof(*iov));
+	op->len = iovcnt;
+	list_op(sockfd);
+
+	return 0;
+}
+
+/* hand the result of a completed op to its caller, like the syscall
+ * would, -1 with errno set on failure */
+static enum uring_op_state op_result(struct uring_op *op, int *ret)
+{
+	enum uring_op_state state = op->state;
+
+	if (state != URING_OP_DONE)
+		return state;
+
+	op->state = URING_OP_IDLE;
+	if (op->res < 0) {
+		errno = -op->res;
+		*ret = -1;
+	} else {
+		*ret = op->res;
+	}
+
+	return state;
+}
+
+/**
+ * uring_recv_result - what the recv() queued on sockfd returned
+ *
+ * Return: URING_OP_DONE with *ret set, URING_OP_IDLE if none was
+ * queued, otherwise it's still on its way
+ */
+enum uring_op_state uring_recv_result(int sockfd, int *ret)
+{
+	if (sockfd < 0 || sockfd >= nslots)
+		return URING_OP_IDLE;
+
+	return op_result(&recv_ops[sockfd], ret);
+}
+
+/* same as uring_recv_result(), for the send() */
+enum uring_op_state uring_send_result(int sockfd, int *ret)
+{
+	if (sockfd < 0 || sockfd >= nslots)
+		return URING_OP_IDLE;
+
+	return op_result(&send_ops[sockfd], ret);
+}
+
+static int uring_submit_and_wait(int timeout)
+{
+	static struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+	}
+
+#ifdef IORING_FEAT_EXT_ARG
+	if (timeout >= 0 && features & IORING_FEAT_EXT_ARG) {
+		struct io_uring_getevents_arg arg;
+
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = (unsigned long)&ts;
+		ret = uring_enter(sq_pending, 1, IORING_ENTER_GETEVENTS |
+				  IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (ret == -1 && errno == ETIME)
+			return 0;
+
+		return ret;
+	}
+#endif
+
+	/* the timeout completes by itself as soon as any other
+	 * request completes, so they don't pile up */
+	if (timeout >= 0) {
+		sqe = get_sqe();
+		if (sqe == NULL)
+			return -1;
+
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long)&ts;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = URING_TIMEOUT_DATA;
+	}
+
+	return uring_enter(sq_pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/* take everything off the cq ring, poll events only while there's room
+ * for them, the others are armed again in the next round */
+static void reap(struct poll_event *events, int *n, int room)
+{
+	int sockfd;
+	unsigned head, tail;
+	short revents;
+	__u64 data;
+	struct io_uring_cqe *cqe;
+
+	head = *cq.head;
+	tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &cq.cqes[head & *cq.mask];
+		head++;
+
+		data = cqe->user_data;
+		if (data == URING_TIMEOUT_DATA || data == URING_REMOVE_DATA)
+			continue;
+
+		sockfd = (int)(data & 0xffffffff);
+		if (data & URING_RECV_TAG) {
+			op_done(&recv_ops[sockfd], sockfd, cqe->res, POLLIN);
+			continue;
+		} else if (data & URING_SEND_TAG) {
+			op_done(&send_ops[sockfd], sockfd, cqe->res, POLLOUT);
+			continue;
+		}
+
+		if (sockfd >= nslots ||
+		    (unsigned)(data >> 32) != (gen[sockfd] & URING_GEN_MASK))
+			continue;
+
+		/* oneshot poll, rearm it in the next round to keep
+		 * the level triggered semantics of poll() */
+		armed[sockfd] = 0;
+		mark_dirty(sockfd);
+
+		if (cqe->res == -ECANCELED || *n >= room)
+			continue;
+
+		if (cqe->res < 0)
+			revents = POLLERR;
+		else
+			revents = cqe->res & (POLLIN | POLLOUT |
+					      POLLERR | POLLHUP);
+
+		events[*n].fd = sockfd;
+		events[*n].revents = revents;
+		(*n)++;
+	}
+
+	__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_poll_wait - submit this round's poll changes and reap events
+ *
+ * All (re)armed polls, removed polls and the wait itself go to the
+ * kernel in a single io_uring_enter().
+ *
+ * Return: same as poll_wait()
+ */
+int uring_poll_wait(struct poll_event *events, int maxevents, int timeout)
+{
+	int n = 0;
+
+	flush_dirty();
+	more_budget = URING_MORE_MAX;
+
+	if (uring_submit_and_wait(timeout) == -1 && errno != EINTR)
+		return -1;
+
+	reap(events, &n, maxevents);
+
+	return n;
+}
+
+/**
+ * uring_poll_flush - submit the recv()s and send()s queued since the
+ * last flush and reap them
+ *
+ * They go to the kernel in a single io_uring_enter() and complete in
+ * it, the sockfds are non-blocking. A sockfd whose recv() or send()
+ * completed gets a POLLIN or POLLOUT event, for the caller to handle
+ * in the same round.
+ *
+ * Return: the number of events, 0 once nothing is queued, -1 on error
+ */
+int uring_poll_flush(struct poll_event *events, int maxevents)
+{
+	int i, n = 0, room, sockfd;
+
+	if (nops == 0 && nready == 0)
+		return 0;
+
+	/* the made up POLLINs are in ready_list already */
+	room = maxevents - nready;
+	room -= flush_ops(room);
+
+	/* done by now, but their buffers mustn't be touched before the
+	 * completions say so */
+	while (nflight > 0) {
+		if (uring_enter(sq_pending, nflight, IORING_ENTER_GETEVENTS,
+				NULL, 0) == -1 && errno != EINTR)
+			return -1;
+
+		reap(events, &n, room);
+	}
+
+	for (i = 0; i < nready; i++) {
+		sockfd = ready_list[i];
+		/* deleted from poll since */
+		if (op_revents[sockfd] == 0)
+			continue;
+
+		events[n].fd = sockfd;
+		events[n].revents = op_revents[sockfd];
+		op_revents[sockfd] = 0;
+		n++;
+	}
+
+	nready = 0;
+
+	return n;
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014 Zhao, Gang <gang.zhao.42@gmail.com>
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ */
+
+#ifndef SS_URING_H
+#define SS_URING_H
+
+#include "common.h"
+
+/* io_uring is only built when the kernel headers know about it, the
+ * ops used here are all there by 5.9, which added 32 bit poll events */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_POLL_32BITS
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/uio.h>
+
+/* where a recv() or send() of the relay is, see uring_queue_recv() */
+enum uring_op_state {
+	URING_OP_IDLE,
+	URING_OP_QUEUED,
+	URING_OP_INFLIGHT,
+	URING_OP_DONE,
+};
+
+int uring_init(void);
+void uring_exit(void);
+int uring_grow(int size);
+void uring_poll_update(int sockfd);
+void uring_poll_del(int sockfd);
+int uring_poll_wait(struct poll_event *events, int maxevents, int timeout);
+int uring_poll_flush(struct poll_event *events, int maxevents);
+int uring_queue_recv(int sockfd, void *data, int len);
+int uring_queue_send(int sockfd, struct iovec *iov, int iovcnt);
+enum uring_op_state uring_recv_result(int sockfd, int *ret);
+enum uring_op_state uring_send_result(int sockfd, int *ret);
+#endif
+
+#endif